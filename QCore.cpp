@@ -21,6 +21,10 @@ ESP8266HTTPUpdateServer *  QCore::_pUpdateServer=  NULL;
 QTimer *                QCore::_pOTAStsTimer=      NULL;
 QCore::OTACallback      QCore::_pOTACallback=      NULL;
 QTimer *                QCore::_pTraceTimer=       NULL;
+QTraceLog *             QCore::_pTraceLog=         NULL;
+char *                  QCore::_pPrevTraceTail=    NULL;
+int                     QCore::_PrevTraceTailLen=  0;
+int                     QCore::_PrevTraceTailPos=  0;
 
 // Environment Settings file
 float                   QCore::_SettingsVersion=   0.0;
@@ -28,6 +32,15 @@ int                     QCore::_UtcOffsetHours=    0;
 char                    QCore::_Wifi_SSID[31+1];
 char                    QCore::_Wifi_Password[31+1];
 char                    QCore::_MQTT_Address[31+1];
+char                    QCore::_pCmdTopic[MQTT_TOPIC_LEN+1];
+char                    QCore::_pProfileTopic[MQTT_TOPIC_LEN+1];
+bool                    QCore::_ProfileDumpPending=   false;
+bool                    QCore::_ProfileResetPending=  false;
+bool                    QCore::_TraceSwitchesChanged= false;
+
+/* Names accepted for trace levels and sinks in device commands, indexed by TraceLevelType and TraceSinkType. */
+static const char *     gTraceLevelNames[]=  {"off", "event", "error", "warning", "info", "verbose", "reserved", "max"};
+static const char *     gTraceSinkNames[]=   {"serial", "mqtt", "log", "web"};
 
 // Trace Settings
 bool                    QCore::_Trace_Connection_Status= true;
@@ -48,6 +61,10 @@ QCore::QCore(const char * pDeviceIdentifier, ServiceSettingT Services)
 
    if (!QCore::_Initialized)
    {
+      #ifdef _DEBUG_QTIMESTAMP
+      QTimestamp::Test();                             // Before any timers are started
+      #endif
+
       /* Pin Setup */
       pinMode(_PinOnBoardLED, OUTPUT);
       digitalWrite(_PinOnBoardLED, HIGH);    // turn the on board LED off
@@ -56,7 +73,10 @@ QCore::QCore(const char * pDeviceIdentifier, ServiceSettingT Services)
       //_ServiceSetting= ServiceSettingT::SST_Default;
       _ServiceSetting= Services;
       _pOTAStsTimer= new QTimer(/*msec*/2000,/*Repeat*/true,/*Start*/true); 
+      _pOTAStsTimer->SetName("Core.OTASts");
+      _pOTAStsTimer->SetSlack(/*msec*/250);
       _pTraceTimer= new QTimer(/*min*/60/*sec*/*60/*msec*/*1000,/*Repeat*/true,/*Start*/false,/*Done*/true);
+      _pTraceTimer->SetName("Core.Trace");
 
       /* Create Environment settings file. Create it only if it does not yet exist. */
       WriteEnvSettings();
@@ -64,6 +84,13 @@ QCore::QCore(const char * pDeviceIdentifier, ServiceSettingT Services)
       /* Read settings file if present.   */
       ReadSettings();
 
+      /* Persistent trace log. Moves the last session's log aside for publishing. */
+      if (_ServiceSetting & ServiceSettingT::SST_TraceLog)
+      {
+         _pTraceLog= new QTraceLog();
+         _Trace.SetLog(_pTraceLog);
+      }
+
       /* Wifi setup */
       new QWifi(_Wifi_SSID, _Wifi_Password);             // Creates the Master object
 
@@ -78,6 +105,10 @@ QCore::QCore(const char * pDeviceIdentifier, ServiceSettingT Services)
       QTraceSwitch TraceSwitch= (TraceOn)?(QTrace::_TraceSwitchesLevel_Verbose):(QTrace::_TraceSwitchesLevel_Warning);
       _Trace.SetTraceSwitch(TraceSwitch);
 
+      #ifdef _DEBUG_QTIMER
+      QTimer::Benchmark();                            // Traced to serial
+      #endif
+
       QCore::_Initialized= true;
    }
 
@@ -89,7 +120,12 @@ QCore::QCore(const char * pDeviceIdentifier, ServiceSettingT Services)
    /* Trace setup for directing output of trace to mqtt. */
    sprintf(_pTraceTopic, "%s/%s/%s", TOPIC_PREFIX_DEVICE, pDeviceIdentifier, QMQTT::_pTraceSubTopic);
    QMQTT::Master()->SetTraceTopic(_pTraceTopic);            
-   _Trace.SetCallback(QMQTT::TraceCallback);
+   _Trace.SetCallback(QMQTT::Master());              // Lines are streamed into its trace batch
+
+   /* Device commands, e.g. on demand profile output. */
+   sprintf(_pCmdTopic, "%s/%s/%s", TOPIC_PREFIX_DEVICE, pDeviceIdentifier, _pCmdSubTopic);
+   sprintf(_pProfileTopic, "%s/%s/%s", TOPIC_PREFIX_DEVICE, pDeviceIdentifier, _pProfileSubTopic);
+   QMQTT::Master()->Subscribe(/*Topic*/_pCmdTopic, /*Callback*/QCore::MQTT_Callback);
 
    Serial.printf("\nQCore::QCore(): exit\n");   
 
@@ -107,8 +143,19 @@ void QCore::SetOTACallback(void (* pCallback)(bool Before))
    
 } // SetOTACallback
 /**************************************************************************************/
-void QCore::DoService()
+unsigned long QCore::DoService()
 {
+   QPROFILE_SCOPE("Core.DoService");
+
+   /* All timer queries in this pass see the same time. */
+   unsigned long PassStartMsec= QTimestamp::BeginLoopTick();
+   QTimestamp::GetNowTimeUsec64();           // Keeps the usec clock's rollover count current
+
+   #ifdef ENB_QTIMER_WHEEL
+   /* Advance the timer wheel once per pass, flagging expired timers for IsDone(). */
+   QTimerWheel::DoService();
+   #endif
+
    /* Housekeeping I */
    /* Wifi library needs to be called to maintain connection.
       Needs 2x calls before it establishes initial connection.
@@ -133,6 +180,27 @@ void QCore::DoService()
       // MQTT handler
       QMQTT::Master()->DoService();
 
+      /* Device commands received by the mqtt callback. */
+      if (_ProfileResetPending)
+      {
+         QProfile::ResetAll();
+         _ProfileResetPending= false;
+      }
+      if (_ProfileDumpPending && QMQTT::Master()->IsConnected())
+      {
+         PublishProfile();
+         _ProfileDumpPending= false;
+      }
+      if (_TraceSwitchesChanged)
+      {
+         QTRACE(TS_SERVICES, TLT_Event, "Trace switches: serial %08lX, mqtt %08lX, log %08lX",
+            (unsigned long) _Trace.GetSinkSwitches(TSK_Serial), (unsigned long) _Trace.GetSinkSwitches(TSK_Callback),
+            (unsigned long) _Trace.GetSinkSwitches(TSK_Log));
+         _TraceSwitchesChanged= false;
+      }
+      if (_pPrevTraceTail != NULL)
+         PublishPrevTraceChunk();
+
       /* Activities performed on reboot upon connection to network. */
       if (!_RebootNotify)
       {  /* Initial wifi connection after reboot. Note- resets flag once mqtt is connected. */
@@ -147,7 +215,8 @@ void QCore::DoService()
             char BuildDateFormatted[15+1];
             QTime::FormatDateStr(_BuildDate, BuildDateFormatted);
             //_Trace.printf(TS_SERVICES, TLT_Event, "Rebooted. Build %s", BuildDateFormatted); // Issue event notice
-            _Trace.printf(TS_SERVICES, TLT_Event, "Rebooted. Build %s, EnvFile: %s", BuildDateFormatted, (_EnvFileFound)?("Yes"):("No")); // Issue event notice
+            QTRACE(TS_SERVICES, TLT_Event, "Rebooted. Build %s, EnvFile: %s", BuildDateFormatted, (_EnvFileFound)?("Yes"):("No")); // Issue event notice
+            PublishPrevTraceLog();
             _RebootNotify= true;
          }
       } 
@@ -163,12 +232,27 @@ void QCore::DoService()
          {
             //float UptimeDays= millis() / 1000.0 / (60*60*24);
             float UptimeDays= QTimestamp::GetUptimeDays();
-            _Trace.printf(TS_SERVICES, TLT_Info, "Uptime (days): %.1f, %s", 
+            QTRACE(TS_SERVICES, TLT_Info, "Uptime (days): %.1f, %s", 
                UptimeDays,            
                QWifi::Master()->Dump()); // Mainly to see if there are disconnects occurring.
-            _Trace.printf(TS_SERVICES, TLT_Verbose, "%s", QMQTT::Master()->Dump());
+            QTRACE(TS_SERVICES, TLT_Verbose, "%s", QMQTT::Master()->Dump());
+            QTRACE(TS_SERVICES, TLT_Verbose, "%s", QMQTT::Master()->DumpPublishQueue());
+            QTRACE(TS_SERVICES, TLT_Verbose, "%s", QMQTT::Master()->DumpOfflineBuffer());
+            QTRACE(TS_SERVICES, TLT_Verbose, "Timer pool: %d/%d used, max %d, heap %d", 
+               QTimer::GetPoolUsedCnt(), QTimer::GetPoolSize(), QTimer::GetPoolHighWaterCnt(), QTimer::GetPoolHeapCnt());
+            QTRACE(TS_SERVICES, TLT_Verbose, "Stack: %u min free, Heap: %u free",   // Stack low-water since boot
+               (unsigned) ESP.getFreeContStack(), (unsigned) ESP.getFreeHeap());
+            QTimer::TraceAll(TS_SERVICES, TLT_Max);   // Late-fire report, to find services starving the loop
+            #ifdef ENB_QPROFILE
+            if (_Trace.IsOutput(TS_SERVICES, TLT_Verbose))
+            {  /* Where loop time went this period. Reset only once reported, else the stats
+                  keep accumulating for {"profile":"dump"}. */
+               QProfile::TraceAll(TS_SERVICES, TLT_Verbose);
+               QProfile::ResetAll();
+            }
+            #endif
             if (_ServiceSetting & ServiceSettingT::SST_NTP)
-               _Trace.printf(TS_SERVICES, TLT_Max, "%s", QTime::Master()->Dump());
+               QTRACE(TS_SERVICES, TLT_Max, "%s", QTime::Master()->Dump());
          }
       }
    }
@@ -184,8 +268,162 @@ void QCore::DoService()
    }
    #endif
 
+   /* Output traces deferred by time critical code during this pass. */
+   _Trace.DoService();
+   if (_pTraceLog != NULL)
+      _pTraceLog->DoService();
+
+   QTimestamp::EndLoopTick();
+   return QTimer::GetNextExpiryMsec(PassStartMsec);
+
 } // DoService
 /**************************************************************************************/
+void QCore::PublishPrevTraceLog()
+/* Publishes the tail of the previous session's trace log to the trace topic, split at line
+   boundaries into packet sized payloads. Published directly rather than traced, so that it
+   is not logged again. The tail is bigger than the publish queue, so this queues the header
+   and DoService() queues a chunk per pass, see PublishPrevTraceChunk(). */
+{
+   if ((_pTraceLog == NULL) || !_pTraceLog->HasPrevSession() || (_pPrevTraceTail != NULL))
+      return;
+
+   _pPrevTraceTail= new char[_PrevTraceTailSize+1];
+   _PrevTraceTailLen= _pTraceLog->ReadPrevTail(_pPrevTraceTail, _PrevTraceTailSize+1);
+   _PrevTraceTailPos= 0;
+
+   QMQTT::Master()->Publish(_pTraceTopic, "Previous session trace log:", /*RetainMsg*/false, QPublishQueue::PQP_Trace);
+
+} // PublishPrevTraceLog
+/**************************************************************************************/
+void QCore::PublishPrevTraceChunk()
+/* Queues the next packet sized chunk of the previous session's tail, and frees the tail once
+   all of it is queued. Waits while disconnected, as trace is not kept offline. */
+{
+   if (!QMQTT::Master()->IsConnected())
+      return;
+
+   int MaxLen= MQTT_MAX_PACKET_SIZE - strlen(_pTraceTopic) - 7;   // per QMQTT::Publish()
+   int TailLen= _PrevTraceTailLen - _PrevTraceTailPos;
+   if ((TailLen > 0) && (MaxLen > 0))
+   {
+      char * pChunk= &_pPrevTraceTail[_PrevTraceTailPos];
+      int ChunkLen= TailLen;
+      if (ChunkLen > MaxLen)
+      {  /* Break after the last full line that fits. */
+         ChunkLen= MaxLen;
+         while ((ChunkLen > 0) && (pChunk[ChunkLen-1] != '\n'))
+            ChunkLen--;
+         if (ChunkLen == 0)
+            ChunkLen= MaxLen;
+      }
+
+      char Saved= pChunk[ChunkLen];
+      pChunk[ChunkLen]= 0;
+      QMQTT::Master()->Publish(_pTraceTopic, pChunk, /*RetainMsg*/false, QPublishQueue::PQP_Trace);
+      pChunk[ChunkLen]= Saved;
+
+      _PrevTraceTailPos+= ChunkLen;
+      TailLen-= ChunkLen;
+   }
+
+   if ((TailLen <= 0) || (MaxLen <= 0))
+   {
+      delete[] _pPrevTraceTail;
+      _pPrevTraceTail= NULL;
+   }
+
+} // PublishPrevTraceChunk
+/**************************************************************************************/
+/*static*/ void QCore::MQTT_Callback(char * pTopic, byte * pPayload, unsigned int PayloadLength)
+/* Callback from mqtt server on the device command topic. As for QMQTT_Entity::MQTT_Callback(),
+   do *not* trace in here. */
+{
+   if (strcmp(pTopic, _pCmdTopic) != 0)
+      return;
+
+   /* Messages are json text, so convert from bytes. */
+   char Message[PayloadLength + 1];
+   memcpy(Message, pPayload, PayloadLength);
+   Message[PayloadLength]= '\0';
+
+   DoCommand(Message);
+
+} // MQTT_Callback
+/**************************************************************************************/
+/*static*/ void QCore::DoCommand(char * pMessage)
+/* Parses a device command, flagging any tracing or publishing for DoService(). Unknown keys are ignored.
+      {"profile":"dump"}      publishes the QProfile stats to device/<id>/profile
+      {"profile":"reset"}     starts a new QProfile period
+      {"trace_switch":4, "trace_level":"verbose", "trace_sink":"mqtt"}
+                              sets one trace switch nibble, see DoTraceCommand()     */
+{
+   StaticJsonBuffer<JSON_OBJECT_SIZE(8)> jsonBuffer;
+   JsonObject& JsonRoot= jsonBuffer.parseObject(pMessage);
+   if (!JsonRoot.success())
+      return;
+
+   if (JsonRoot.containsKey(_pJsonCmdTraceSwitch))
+      DoTraceCommand(JsonRoot);
+
+   if (JsonRoot.containsKey(_pJsonCmdProfile))
+   {
+      const char * pCmd= JsonRoot[_pJsonCmdProfile] | "";
+      if (strcmp(pCmd, "dump") == 0)
+         _ProfileDumpPending= true;
+      else if (strcmp(pCmd, "reset") == 0)
+         _ProfileResetPending= true;
+   }
+
+} // DoCommand
+/**************************************************************************************/
+/*static*/ void QCore::DoTraceCommand(JsonObject & JsonRoot)
+/* Sets the level of one trace switch at runtime, e.g. to raise a single module to Verbose
+   while debugging it, then back to Warning. The level is a TraceLevelType number or name.
+   Without a sink, all sinks are set. The result is traced by DoService(). */
+{
+   int TraceSwitchId= JsonRoot[_pJsonCmdTraceSwitch] | -1;
+   if ((TraceSwitchId < 0) || (TraceSwitchId >= TRACE_SWITCH_CNT))
+      return;                                         // else truncated to a valid switch
+
+   int TraceLevel= JsonRoot[_pJsonCmdTraceLevel] | -1;
+   if (TraceLevel < 0)
+   {
+      const char * pLevel= JsonRoot[_pJsonCmdTraceLevel] | "";
+      for (int i= 0 ; i <= TLT_Max ; i++)
+      {
+         if (strcmp(pLevel, gTraceLevelNames[i]) == 0)
+            TraceLevel= i;
+      }
+   }
+
+   int Sink= TSK_Cnt;
+   const char * pSink= JsonRoot[_pJsonCmdTraceSink] | "";
+   for (int i= 0 ; i < TSK_Cnt ; i++)
+   {
+      if (strcmp(pSink, gTraceSinkNames[i]) == 0)
+         Sink= i;
+   }
+   if ((pSink[0] != 0) && (Sink == TSK_Cnt))
+      return;                                         // unknown sink
+
+   if ((TraceLevel >= 0) &&
+      _Trace.SetTraceSwitchLevel((TraceSinkType) Sink, TraceSwitchId, (TraceLevelType) TraceLevel))
+      _TraceSwitchesChanged= true;
+
+} // DoTraceCommand
+/**************************************************************************************/
+void QCore::PublishProfile()
+/* Publishes a payload per probe called in the current period, as QProfile::TraceAll(). */
+{
+   for (int i= 0 ; i < QProfile::GetProbeCnt() ; i++)
+   {
+      QProfile * pProbe= QProfile::GetProbe(i);
+      if (pProbe->GetCnt() > 0)
+         QMQTT::Master()->Publish(_pProfileTopic, pProbe->Dump());
+   }
+
+} // PublishProfile
+/**************************************************************************************/
 /* Reads environment settings file into the variables.   */
 void QCore::ReadSettings()
 {
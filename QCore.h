@@ -10,7 +10,10 @@
 #include "QMQTT.h"
 #include "QTrace.h"
 #include "QTime.h"                                    // NTP
+#include "QTraceLog.h"
+#include "QProfile.h"
 #include <ESP8266HTTPUpdateServer.h>
+#include <ArduinoJson.h>                             // Device commands
 
 /**************************************************************************************/
 /* QCore - Common setup() and loop() functionality. Use this as a library to avoid
@@ -44,6 +47,7 @@ class QCore
       SST_Trace=           0x01,                      // Trace ouput
       SST_MQTT=            0x02,                      // MQTT, incl trace output
       SST_NTP=             0x04,                      // Time
+      SST_TraceLog=        0x08,                      // Trace log in flash, tail published after reboot
 
       SST_All=             0xFFFF
    };
@@ -99,10 +103,31 @@ class QCore
 
    static QTimer *         _pTraceTimer;
 
+   /* Persistent trace log, if SST_TraceLog. */
+   static QTraceLog *      _pTraceLog;
+   static const int        _PrevTraceTailSize=  1024;
+   static char *           _pPrevTraceTail;           // Being published, a chunk per pass. NULL if none
+   static int              _PrevTraceTailLen;
+   static int              _PrevTraceTailPos;
+
    //////// QMQTT ////////
    //static constexpr char * _pMQTT_IPAddress=  MQTT_URL;
    static char             _MQTT_Address[];
 
+   /* Device command topic, device/<id>/cmd, json of the form {"profile":"dump"}, see DoCommand().
+      Work that traces or publishes is done from DoService(), not from the mqtt callback. */
+   static constexpr char * _pCmdSubTopic=       "cmd";
+   static constexpr char * _pProfileSubTopic=   "profile";
+   static constexpr char * _pJsonCmdProfile=    "profile";      // "dump" publishes to device/<id>/profile, "reset" clears
+   static constexpr char * _pJsonCmdTraceSwitch=   "trace_switch";   // 0..7
+   static constexpr char * _pJsonCmdTraceLevel=    "trace_level";    // 0..7 or name, e.g. "verbose"
+   static constexpr char * _pJsonCmdTraceSink=     "trace_sink";     // optional, e.g. "mqtt". Default all sinks
+   static char             _pCmdTopic[MQTT_TOPIC_LEN+1];
+   static char             _pProfileTopic[MQTT_TOPIC_LEN+1];
+   static bool             _ProfileDumpPending;
+   static bool             _ProfileResetPending;
+   static bool             _TraceSwitchesChanged;
+
 
    //////// NTP ////////
    static int              _UtcOffsetHours;
@@ -121,7 +146,10 @@ class QCore
                            QCore(const char * pDeviceIdentifier, ServiceSettingT Services);
    void                    SetOTACallback(void (* pCallback)(bool Before));
 
-   void                    DoService();
+   /* Call from loop(). Returns msec until the next timer is due, so that the caller can
+      delay() or light sleep rather than spin, e.g.
+         delay(min(Core.DoService(), MyMaxSleepMsec));   */
+   unsigned long           DoService();
    ESP8266WebServer *      GetWebServer(){return _pWebServer;}
 
    protected:
@@ -129,6 +157,13 @@ class QCore
    void                    ReadSettings();
 
    void                    WriteEnvSettings();   
+   void                    PublishPrevTraceLog();
+   void                    PublishPrevTraceChunk();
+
+   static void             MQTT_Callback(char * pTopic, byte * pPayload, unsigned int PayloadLength);
+   static void             DoCommand(char * pMessage);
+   static void             DoTraceCommand(JsonObject & JsonRoot);
+   void                    PublishProfile();
 
 }; // QCore
 
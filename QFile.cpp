@@ -32,7 +32,7 @@ void QFile::Init()
       #endif
 
       if (!Result)
-         _Trace.printf(TS_SERVICES, TLT_Error, "Spiffs: could not mount file system");
+         QTRACE(TS_SERVICES, TLT_Error, "Spiffs: could not mount file system");
    }
 } // Init
 /**************************************************************************************/
@@ -68,12 +68,10 @@ int QFile::ReadStr(char * pStrBfr, int BfrSize)
          pStrBfr[i]= 0;
          Result= i;
          f.close();
-         #ifdef _QFILE_DEBUG
-         _Trace.printf(TS_SERVICES, TLT_Verbose, "QFile::ReadStr():%d, %s", Result, pStrBfr);
-         #endif
+         QTRACE(TS_SERVICES, TLT_Verbose, "QFile::ReadStr():%d, %s", Result, pStrBfr);
       }
       else
-         _Trace.printf(TS_SERVICES, TLT_Error, "QFile::ReadStr(): file read error");
+         QTRACE(TS_SERVICES, TLT_Error, "QFile::ReadStr(): file read error");
    }
    return Result;
 
@@ -94,13 +92,137 @@ int QFile::WriteStr(char * pStrBfr)
       f.close();
    }
    else
-      _Trace.printf(TS_SERVICES, TLT_Error, "QFile::WriteStr(): file write error");
+      QTRACE(TS_SERVICES, TLT_Error, "QFile::WriteStr(): file write error");
 
    return Result;
 
 } // WriteStr
+/**************************************************************************************/
+int QFile::Append(const char * pBfr, int Len)
+{
+   int Result= 0;
+   #ifdef ENB_SPIFFS
+   File f= SPIFFS.open(_pFileName, "a");
+   #else
+   File f= LittleFS.open(_pFileName, "a");
+   #endif   
+   if (f != NULL)
+   {
+      Result= f.write((const uint8_t *) pBfr, Len);
+      f.close();
+   }
+   else
+      QTRACE(TS_SERVICES, TLT_Error, "QFile::Append(): file write error");
 
+   return Result;
 
+} // Append
+/**************************************************************************************/
+unsigned long QFile::Size()
+{
+   unsigned long Result= 0;
+   if (this->Exists())
+   {
+      #ifdef ENB_SPIFFS
+      File f= SPIFFS.open(_pFileName, "r");
+      #else
+      File f= LittleFS.open(_pFileName, "r");
+      #endif      
+      if (f != NULL)
+      {
+         Result= f.size();
+         f.close();
+      }
+   }
+   return Result;
 
+} // Size
+/**************************************************************************************/
+int QFile::ReadTail(char * pStrBfr, int BfrSize)
+{
+   int Result= 0;
+   if (this->Exists())
+   {
+      #ifdef ENB_SPIFFS
+      File f= SPIFFS.open(_pFileName, "r");
+      #else
+      File f= LittleFS.open(_pFileName, "r");
+      #endif      
+      if (f != NULL)
+      {
+         unsigned long FileSize= f.size();
+         bool Partial= (FileSize > (unsigned long) (BfrSize-1));
+         if (Partial)
+            f.seek(FileSize - (BfrSize-1));
+         Result= f.read((uint8_t *) pStrBfr, BfrSize-1);
+         pStrBfr[Result]= 0;
+         f.close();
+
+         if (Partial)
+         {  /* Drop the leading partial line. */
+            char * pLineStart= strchr(pStrBfr, '\n');
+            if (pLineStart != NULL)
+            {
+               pLineStart++;
+               Result-= (pLineStart - pStrBfr);
+               memmove(pStrBfr, pLineStart, Result + 1);
+            }
+         }
+      }
+      else
+         QTRACE(TS_SERVICES, TLT_Error, "QFile::ReadTail(): file read error");
+   }
+   return Result;
+
+} // ReadTail
+/**************************************************************************************/
+int QFile::ReadAt(unsigned long Offset, char * pStrBfr, int BfrSize)
+{
+   int Result= 0;
+   if (this->Exists())
+   {
+      #ifdef ENB_SPIFFS
+      File f= SPIFFS.open(_pFileName, "r");
+      #else
+      File f= LittleFS.open(_pFileName, "r");
+      #endif      
+      if (f != NULL)
+      {
+         if (Offset < f.size())
+         {
+            f.seek(Offset);
+            Result= f.read((uint8_t *) pStrBfr, BfrSize-1);
+         }
+         f.close();
+      }
+      else
+         QTRACE(TS_SERVICES, TLT_Error, "QFile::ReadAt(): file read error");
+   }
+   pStrBfr[Result]= 0;
+   return Result;
 
+} // ReadAt
+/**************************************************************************************/
+bool QFile::Rename(const char * pNewFileName)
+{
+   #ifdef ENB_SPIFFS
+   if (SPIFFS.exists(pNewFileName))
+      SPIFFS.remove(pNewFileName);
+   return (SPIFFS.rename(_pFileName, pNewFileName)); 
+   #else
+   if (LittleFS.exists(pNewFileName))
+      LittleFS.remove(pNewFileName);
+   return (LittleFS.rename(_pFileName, pNewFileName)); 
+   #endif
+
+} // Rename
+/**************************************************************************************/
+bool QFile::Remove()
+{
+   #ifdef ENB_SPIFFS
+   return (SPIFFS.remove(_pFileName)); 
+   #else
+   return (LittleFS.remove(_pFileName)); 
+   #endif
 
+} // Remove
@@ -14,8 +14,6 @@
 #include "LittleFS.h" 
 #endif
 
-#define  _QFILE_DEBUG                                 // Enables trace dump
-
 /**************************************************************************************/
 /* Abstracts the file system for non-volatile storage in ESP8266 environments.
    Applications include storing of settings.
@@ -49,6 +47,27 @@ class QFile
    /* WriteStr(): writes the given string to the file.
       Returns: # chars written. 0 if write failure.                  */
    int                     WriteStr(char * pStrBfr);
+
+   /* Append(): appends Len bytes to the end of the file, creating it if needed.
+      Returns: # bytes written. 0 if write failure.                  */
+   int                     Append(const char * pBfr, int Len);
+
+   /* Size of the file in bytes. 0 if no file.                       */
+   unsigned long           Size();
+
+   /* ReadTail(): reads the last BfrSize-1 bytes of the file as a null terminated string,
+      starting at a line boundary if the file is larger than that.
+      Returns: # chars read. 0 if no or empty file.                  */
+   int                     ReadTail(char * pStrBfr, int BfrSize);
+
+   /* ReadAt(): reads up to BfrSize-1 bytes from Offset as a null terminated string.
+      Returns: # chars read. 0 if no file or Offset is at or past the end.  */
+   int                     ReadAt(unsigned long Offset, char * pStrBfr, int BfrSize);
+
+   /* Renames the file to pNewFileName, replacing any existing file of that name.
+      The object still refers to its own name afterwards.            */
+   bool                    Rename(const char * pNewFileName);
+   bool                    Remove();
    
    protected:
    void                    Init();
@@ -39,6 +39,7 @@ void QIndicator::Init()
    _nBlinks= 0;
    _State= false;
    _pStateTimer= new QTimer(/*Msec*/_BlinkPeriodFastMsec,/*Repeat*/false,/*Start*/false);
+   _pStateTimer->SetName("Indicator.State");
 
    _nTicks= 0;
 
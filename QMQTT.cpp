@@ -6,6 +6,7 @@
 #include <stddef.h>
 #include "QMQTT.h"
 #include "QString.h"
+#include "QProfile.h"
 
 /* Library has a poorly conceived default size, modified it. This check is to make sure it doesn't   
    get blown away on an update. */
@@ -23,24 +24,25 @@
 /**************************************************************************************/
 QMQTT *           QMQTT::_pMasterObject= NULL;
 const char *      QMQTT::_pTraceTopic= NULL;
-int               QMQTT::_SubscriberCnt= 0;
-const char *      QMQTT::_pSubscriberTopics[QMQTT::_MaxSubscribers];
-pMQTTCallback     QMQTT::_pSubscriberCallbacks[QMQTT::_MaxSubscribers];
+QRateLimiter      QMQTT::_TraceRateLimiter(/*Lines*/10, /*msec*/1000, /*Burst*/20);
+char              QMQTT::_TraceBatchBfr[MQTT_MAX_PACKET_SIZE];
 
 
 /**************************************************************************************/
 /* Callback from QTrace to publish trace data to mqtt channel.
    Hack. Refer to https://isocpp.org/wiki/faq/pointers-to-members  */
-/*static*/ void QMQTT::TraceCallback(const char * pPayload)
+/*static*/ void QMQTT::TraceCallback(const char * pPayload, TraceLevelType TraceLevel)
 {
-   if ((_pMasterObject != NULL) && (_pMasterObject->_pTraceTopic != NULL))
+   if (_pMasterObject != NULL)
    {
-      _pMasterObject->Publish(/*Channel*/_pTraceTopic, /*Payload*/pPayload, /*RetainMsg*/false);
+      _pMasterObject->TraceBegin(TraceLevel);
+      _pMasterObject->TraceWrite(pPayload, strlen(pPayload));
+      _pMasterObject->TraceEnd(TraceLevel);
    }
 
 } // TraceCallback
 /**************************************************************************************/
-/*static*/ void QMQTT::Dispatch_Callback(char * pTopic, byte * pPayload, unsigned int PayloadLength)
+void QMQTT::Dispatch_Callback(char * pTopic, byte * pPayload, unsigned int PayloadLength)
 /* Callback from mqtt server. This method serves as a dispatcher, finding the end
    callback that this topic belngs to.
 
@@ -55,6 +57,7 @@ pMQTTCallback     QMQTT::_pSubscriberCallbacks[QMQTT::_MaxSubscribers];
    #ifdef _DEBUG_MQTT
    Serial.printf("QMQTT::Dispatch_Callback(): Entry, Topic:[%s]\n", pTopic);
    #endif
+   _InboundCnt++;
 
    /* Filter out Trace callbacks. Of the form .../trace */
    int TraceSuffixIndex= strlen(pTopic) - strlen(QMQTT::_pTraceSubTopic);
@@ -63,45 +66,28 @@ pMQTTCallback     QMQTT::_pSubscriberCallbacks[QMQTT::_MaxSubscribers];
       #ifdef _DEBUG_MQTT
       Serial.printf("QMQTT::Dispatch_Callback(): Filtering trace callback, Topic:[%s]\n", pTopic);
       #endif
+      _EchoCnt++;
 
       return;
    }
 
    /* Trace statements should be safe as of here. */
-   for (int i= 0 ; i < _SubscriberCnt ; i++)
+   /* Find the subscriber callbacks that this topic belongs to, in one pass over the topic.
+      Note that there can be multiple subscribers to the same topic. They are called in
+      the order subscribed. */
+   QTopicTrie::SubscriberMaskType Subscribers= _SubscriberTrie.Match(pTopic);
+   if (Subscribers == 0)
+      _EchoCnt++;
+   for (int i= 0 ; (i < _SubscriberCnt) && (Subscribers != 0) ; i++)
    {
-      /* Find the subscriber callback that this topic belongs to. 
-         Note that there can be multiple subscribers to the same topic. */
-      const char * pSubscriberTopic= _pSubscriberTopics[i];
-
-      /* If wildcard present in the subscriber, process up to that point in the string. */
-      char WildcardCh= '#';
-      int FindIndex= FindCh(pSubscriberTopic, WildcardCh);
-      if (FindIndex >= 0)
+      if (Subscribers & (((QTopicTrie::SubscriberMaskType) 1) << i))
       {
-         /* Identify if of the form "...xyz/#" */
-         if ( (FindIndex > 0) && (pSubscriberTopic[FindIndex-1] == '/'))
-            FindIndex--;
-
-         int Result= strncmp(pTopic, pSubscriberTopic, FindIndex); // also excludes any trailing '/'
-         if (Result == 0)
-         {
-            #ifdef _DEBUG_MQTT
-            Serial.printf("QMQTT::Dispatch_Callback(): Wildcard Match, Subscriber:%d, Topic:[%s], SubscriberTopic:[%s]\n",
-               i, pTopic, pSubscriberTopic);
-            #endif
-            _pSubscriberCallbacks[i](pTopic, pPayload, PayloadLength);
-         }
-      }
-      else
-      {  /* Exact topic match only. */
-         if (strcmp(pTopic, _pSubscriberTopics[i]) == 0)
-         {
-            #ifdef _DEBUG_MQTT
-            Serial.printf("QMQTT::Dispatch_Callback(): Match, Subscriber:%d, Topic:[%s]\n", i, pTopic);
-            #endif
-            _pSubscriberCallbacks[i](pTopic, pPayload, PayloadLength);
-         }
+         #ifdef _DEBUG_MQTT
+         Serial.printf("QMQTT::Dispatch_Callback(): Match, Subscriber:%d, Topic:[%s], SubscriberTopic:[%s]\n",
+            i, pTopic, _pSubscriberTopics[i]);
+         #endif
+         _pSubscriberCallbacks[i](pTopic, pPayload, PayloadLength);
+         Subscribers&= ~(((QTopicTrie::SubscriberMaskType) 1) << i);
       }
    }
 
@@ -145,11 +131,35 @@ void QMQTT::Init()
    if (QMQTT::_pMasterObject == NULL)
       _pMasterObject= this;
 
+   _TraceBatchLen= 0;
+   if (_pMasterObject == this)
+   {
+      _TraceBatchBfr[0]= 0;
+      _OfflineBuffer.EnableSlots(QOFFLINE_SLOT_CNT);   // State reports survive an outage
+   }
+   _TraceLineStart= -1;
+   _TraceFlushMsec= _TraceFlushMsecDflt;
+   _pTraceFlushTimer=         new QTimer(_TraceFlushMsec,/*Repeat*/false,/*Start*/false);
+   _pTraceFlushTimer->SetName("MQTT.TraceFlush");
+   _pTraceFlushTimer->SetSlack(/*msec*/500);
+   _TraceLineCnt= 0;
+   _TracePublishCnt= 0;
+   _SubscriberCnt= 0;
+   _InboundCnt= 0;
+   _EchoCnt= 0;
+   _PublishBudgetBytes= _PublishBudgetBytesDflt;
+
    _pIPAddress= NULL;
    _Port= _DfltPort;
    _pUserName= _pPassword= "";                  // Default is empty string (no username or password)
    _pConnectionStatusTimer=   new QTimer(/*sec*/60/*msec*/*1000,/*Repeat*/true,/*Start*/false,/*Done*/true); // Start in Done state   
+   _pConnectionStatusTimer->SetName("MQTT.ConnSts");
    _pMessageStatusTimer=      new QTimer(/*msec*/500,/*Repeat*/true,/*Start*/true,/*Done*/false);
+   _pMessageStatusTimer->SetName("MQTT.MsgSts");
+   _pMessageStatusTimer->SetSlack(/*msec*/100);
+   /* Twice the status check rate, so that the normal retry cadence is never refused. Only
+      caps extra attempts, e.g. if the status check period is shortened. */
+   _ConnectRateLimiter.Set(/*Attempts*/2, /*msec*/60 * 1000, /*Burst*/3);
    
    _pIdentifier= NULL;
    _pPublishTopic= NULL;
@@ -166,10 +176,13 @@ const char * QMQTT::Dump()
       (_pSubscribeTopic != NULL)?(_pSubscribeTopic):("none")
       ); */
 
-   snprintf(_StsBfr, _DumpBfrLen, "QMQTT: %s Connected:%s, SubscriberCnt:%d", 
+   snprintf(_StsBfr, _DumpBfrLen, "QMQTT: %s Connected:%s, SubscriberCnt:%d, Inbound/Echoed:%lu/%lu, TraceLines/Pubs:%lu/%lu, TraceDropped:%lu, ConnectDeferred:%lu", 
       _pIdentifier,
       (this->IsConnected()?("true"):("false")),
-      _SubscriberCnt
+      _SubscriberCnt,
+      (unsigned long) _InboundCnt, (unsigned long) _EchoCnt,
+      (unsigned long) _TraceLineCnt, (unsigned long) _TracePublishCnt,
+      _TraceRateLimiter.GetDroppedCnt(), _ConnectRateLimiter.GetDeferredCnt()
       );
 
    return _StsBfr;
@@ -189,6 +202,8 @@ bool QMQTT::IsConnected()
 /**************************************************************************************/
 void QMQTT::DoService()
 {
+   QPROFILE_SCOPE("MQTT.DoService");
+
    // TBD - BAIL IF QWIFI IS NOT CONNECTED?
    CheckConnection();
 
@@ -199,6 +214,16 @@ void QMQTT::DoService()
       loop();             // PubSubClient - note that if we're not connected, this returns immediately with false
    }
 
+   /* Publish trace lines that have waited out the flush time. */
+   if ((_TraceBatchLen > 0) && _pTraceFlushTimer->IsDone())
+      FlushTrace();
+
+   /* Once connected, messages kept while offline go ahead of what is queued after them. */
+   if (_OfflineBuffer.HasPending() && IsConnected())
+      _OfflineBuffer.Replay(_PublishQueue);
+
+   DrainPublishQueue();
+
 } // DoService
 /**************************************************************************************/
 void QMQTT::CheckConnection()
@@ -218,6 +243,12 @@ void QMQTT::Connect()
 {
    if (_pConnectionStatusTimer->IsDone())
    {
+      if (!_ConnectRateLimiter.TryAcquire())
+      {  /* Too many recent attempts, wait for the next status check. */
+         _ConnectRateLimiter.RecordDeferred();
+         return;
+      }
+
       #ifdef _DEBUG_MQTT
       Serial.printf("Attempting MQTT connection to %s\n", _pIPAddress);   
       #endif
@@ -234,13 +265,7 @@ void QMQTT::Connect()
          Resubscribe();
       } 
       else
-      {
-         #ifdef _DEBUG_MQTT  
-         Serial.print("Connect failed, rc=");
-         Serial.print(state());
-         Serial.printf("\n");   
-         #endif
-      }
+         QTRACE(TRACE_SWITCH_MQTT, TLT_Warning, "QMQTT::Connect(): failed, rc=%d", state());
    }
 } // Connect
 /**************************************************************************************/
@@ -252,8 +277,44 @@ void QMQTT::SetPublishTopic(const char * pTopic)
    
 } // SetPublishTopic
 /**************************************************************************************/
+bool QMQTT::Publish(const char * pTopic, const char * pPayload, bool RetainMsg, QPublishQueue::PriorityT Priority)
+/* Queues the message for the specified channel. It is published by DoService(), so this
+   is safe from within a subscribe callback.
+   While not connected, it is kept in the offline buffer instead, if enabled, replacing any earlier
+   message on the topic. Trace is not kept, it would only crowd out the rest.
+   Returns: false - if too big for a packet, or dropped by the queue's overflow policy or
+                    the offline buffer.
+*/
+{
+   if (pTopic == NULL)
+      return false;
+
+   /* Per PublishNow(), so that the queue only holds what can be sent. */
+   if ((strlen(pTopic) + 1 + strlen(pPayload) + 1 + 4) >= MQTT_MAX_PACKET_SIZE)
+      return false;
+
+   if (!IsConnected())
+   {
+      if (Priority == QPublishQueue::PQP_Trace)
+         return false;
+      return _OfflineBuffer.Store(pTopic, pPayload, RetainMsg, Priority);
+   }
+
+   /* Supersedes a value still waiting to be replayed. */
+   if (_OfflineBuffer.HasPending())
+      _OfflineBuffer.Discard(pTopic);
+   return _PublishQueue.Push(pTopic, pPayload, RetainMsg, Priority);
+   
+} // Publish
+/**************************************************************************************/
 bool QMQTT::Publish(const char * pTopic, const char * pPayload, bool RetainMsg)
-/* Publishes the message to the specified channel.
+{
+   return Publish(pTopic, pPayload, RetainMsg, QPublishQueue::PQP_Telemetry);
+   
+} // Publish
+/**************************************************************************************/
+bool QMQTT::PublishNow(const char * pTopic, const char * pPayload, bool RetainMsg)
+/* Publishes the message to the specified channel, bypassing the queue.
    Returns: false - if not connected to mqtt server or send error.
 */
 {
@@ -271,26 +332,185 @@ bool QMQTT::Publish(const char * pTopic, const char * pPayload, bool RetainMsg)
    }
    return Result;
    
-} // Publish
+} // PublishNow
+/**************************************************************************************/
+void QMQTT::DrainPublishQueue()
+/* Publishes queued messages, highest priority first, up to the per pass byte budget.
+   At least one goes per pass, so a message bigger than the budget is not stuck.  */
+{
+   int SentLen= 0;
+   const char * pTopic;
+   const char * pPayload;
+   bool Retain;
+   int Size;
+
+   while (IsConnected() && _PublishQueue.Front(&pTopic, &pPayload, &Retain, &Size))
+   {
+      if ((SentLen > 0) && (SentLen + Size > _PublishBudgetBytes))
+         break;
+
+      _PublishQueue.RecordPublished(PublishNow(pTopic, pPayload, Retain));
+      _PublishQueue.Pop();
+      SentLen+= Size;
+   }
+
+} // DrainPublishQueue
+/**************************************************************************************/
+bool QMQTT::FlushPublishQueue(unsigned long TimeoutMsec)
+/* Drains the queue a budget at a time, servicing the client in between so that the socket
+   keeps up. Stops early if the connection is lost. */
+{
+   uint32_t StartMsec= QTimestamp::GetNowTimeMsec();  // live, as the pass tick is frozen
+
+   while (!_PublishQueue.IsEmpty() && IsConnected())
+   {
+      DrainPublishQueue();
+      loop();                                         // PubSubClient
+      if ((QTimestamp::GetNowTimeMsec() - StartMsec) >= TimeoutMsec)
+         break;
+   }
+   return _PublishQueue.IsEmpty();
+
+} // FlushPublishQueue
 /**************************************************************************************/
 bool QMQTT::Publish(const char * pTopic, const char * pPayload)
-/* Publishes the message to the specified channel.
-   Returns: false - if not connected to mqtt server or send error.
+/* Queues the message for the specified channel, see Publish() above.
+   Returns: false - if dropped, see Publish().
 */
 {
    return Publish(pTopic, pPayload, /*RetainMsg*/false);
    
 } // Publish
 /**************************************************************************************/
+bool QMQTT::PublishTimeSeries(const char * pTopic, const char * pPayload)
+/* Samples go to the spill file while not connected, and after reconnecting until it is
+   replayed, so that they are published in order.
+   Returns: false - if dropped, see Publish().
+*/
+{
+   if ((pTopic != NULL) && _OfflineBuffer.IsSpillEnabled() && (!IsConnected() || _OfflineBuffer.HasSpillPending()))
+   {
+      if ((strlen(pTopic) + 1 + strlen(pPayload) + 1 + 4) >= MQTT_MAX_PACKET_SIZE)
+         return false;
+      return _OfflineBuffer.Spill(pTopic, pPayload);
+   }
+
+   return Publish(pTopic, pPayload, /*RetainMsg*/false, QPublishQueue::PQP_Telemetry);
+
+} // PublishTimeSeries
+/**************************************************************************************/
 bool QMQTT::Publish(const char * pPayload)
-/* Publishes the message to the default publish topic. If topic is not defined, returns error.
-   Returns: false - if not connected to mqtt server or send error.
+/* Queues the message for the default publish topic, see Publish() above.
+   Returns: false - if the topic is not defined, or dropped, see Publish().
 */
 {
    return Publish(_pPublishTopic, pPayload, /*RetainMsg*/false);
    
 } // Publish
 
+/**************************************************************************************/
+/* Trace */
+/**************************************************************************************/
+void QMQTT::SetTraceFlushTime(unsigned long FlushMsec)
+{
+   _TraceFlushMsec= FlushMsec;
+   if (FlushMsec > 0)
+      _pTraceFlushTimer->Set(FlushMsec);
+   FlushTrace();
+
+} // SetTraceFlushTime
+/**************************************************************************************/
+int QMQTT::GetTracePayloadMax()
+/* Returns: payload room in a packet for the trace topic, per the limit applied by Publish(). */
+{
+   return MQTT_MAX_PACKET_SIZE - strlen(_pTraceTopic) - 7;
+
+} // GetTracePayloadMax
+/**************************************************************************************/
+void QMQTT::TraceBegin(TraceLevelType TraceLevel)
+/* Starts a line in the trace batch. The line's text follows by TraceWrite().
+   Note- called from within trace output, so must not trace.   */
+{
+   _TraceLineStart= -1;
+   if ((_pTraceTopic == NULL) || (GetTracePayloadMax() <= 1))
+      return;
+
+   if ((_TraceBatchLen > 0) && (_TraceBatchLen + 1 >= GetTracePayloadMax()))
+      FlushTrace();
+
+   if (_TraceBatchLen > 0)
+      _TraceBatchBfr[_TraceBatchLen++]= '\n';
+   else
+      _pTraceFlushTimer->Start();
+   _TraceLineStart= _TraceBatchLen;
+
+} // TraceBegin
+/**************************************************************************************/
+void QMQTT::TraceWrite(const char * pStr, int Len)
+/* Appends to the line in the trace batch. If the line outgrows the packet, the batch before
+   it is published and the line moved to the start. Lines longer than a packet allows are
+   truncated.   */
+{
+   if (_TraceLineStart < 0)
+      return;
+
+   int MaxLen= GetTracePayloadMax();
+   if ((_TraceBatchLen + Len > MaxLen) && (_TraceLineStart > 0))
+   {
+      int PartLen= _TraceBatchLen - _TraceLineStart;
+      _TraceBatchLen= _TraceLineStart - 1;            // excl the '\n'
+      FlushTrace();
+
+      memmove(_TraceBatchBfr, &_TraceBatchBfr[_TraceLineStart], PartLen);
+      _TraceBatchLen= PartLen;
+      _TraceLineStart= 0;
+      _pTraceFlushTimer->Start();
+   }
+
+   if (_TraceBatchLen + Len > MaxLen)
+      Len= MaxLen - _TraceBatchLen;
+   if (Len > 0)
+   {
+      memcpy(&_TraceBatchBfr[_TraceBatchLen], pStr, Len);
+      _TraceBatchLen+= Len;
+   }
+
+} // TraceWrite
+/**************************************************************************************/
+void QMQTT::TraceEnd(TraceLevelType TraceLevel)
+{
+   if (_TraceLineStart < 0)
+      return;
+   _TraceLineStart= -1;
+   _TraceBatchBfr[_TraceBatchLen]= 0;
+   _TraceLineCnt++;
+
+   /* Events and errors go out right away, with whatever preceded them. */
+   if ((TraceLevel <= TLT_Error) || (_TraceFlushMsec == 0))
+      FlushTrace();
+
+} // TraceEnd
+/**************************************************************************************/
+void QMQTT::FlushTrace()
+/* Publishes the trace batch, subject to the trace rate. */
+{
+   if (_TraceBatchLen > 0)
+   {
+      _TraceBatchBfr[_TraceBatchLen]= 0;
+      if (_TraceRateLimiter.TryAcquire())
+      {
+         if (Publish(/*Channel*/_pTraceTopic, /*Payload*/_TraceBatchBfr, /*RetainMsg*/false, QPublishQueue::PQP_Trace))
+            _TracePublishCnt++;
+      }
+      else
+         _TraceRateLimiter.RecordDropped();
+
+      _TraceBatchLen= 0;
+      _TraceBatchBfr[0]= 0;
+      _pTraceFlushTimer->Stop();
+   }
+
+} // FlushTrace
 /**************************************************************************************/
 /* Subscribe */
 /**************************************************************************************/
@@ -309,9 +529,15 @@ void QMQTT::Subscribe(const char * pTopic, MQTT_CALLBACK_SIGNATURE)
 {
    if (_SubscriberCnt < _MaxSubscribers)
    {
+      if (!_SubscriberTrie.Add(pTopic, _SubscriberCnt))
+      {
+         QTRACE(TRACE_SWITCH_MQTT, TLT_Error, "QMQTT::Subscribe(): bad topic or trie full, Topic:[%s]", pTopic);
+         return;
+      }
+
       /* Once we have the first subscriber, set up the dispatcher as the callback. */
       if (_SubscriberCnt == 0)
-         this->setCallback(QMQTT::Dispatch_Callback); 
+         this->setCallback([this](char * pTopic, byte * pPayload, unsigned int PayloadLength){Dispatch_Callback(pTopic, pPayload, PayloadLength);});
 
       _pSubscriberTopics[_SubscriberCnt]= pTopic;
       _pSubscriberCallbacks[_SubscriberCnt]= callback;
@@ -321,6 +547,8 @@ void QMQTT::Subscribe(const char * pTopic, MQTT_CALLBACK_SIGNATURE)
       if (IsConnected())
          Resubscribe();
    }
+   else
+      QTRACE(TRACE_SWITCH_MQTT, TLT_Error, "QMQTT::Subscribe(): table full (QMQTT_MAX_SUBSCRIBERS %d), Topic:[%s]", _MaxSubscribers, pTopic);
   
 } // Subscribe
 
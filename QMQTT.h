@@ -7,10 +7,25 @@
 #include <PubSubClient.h>
 #include "QWifi.h"
 #include "QTimer.h"
+#include "QRateLimiter.h"
+#include "QTopicTrie.h"
+#include "QPublishQueue.h"
+#include "QOfflineBuffer.h"
 
 #define  _DEBUG_MQTT                                  // QMQTT - Outputs additional trace info to Serial
 #define MQTT_TOPIC_LEN          63
 
+/* The publish queue is per instance, so kept small, by default 3 full packets. It must hold
+   at least one. */
+#if QPUBLISH_QUEUE_SIZE < MQTT_MAX_PACKET_SIZE + 6
+#error "QPUBLISH_QUEUE_SIZE must be at least MQTT_MAX_PACKET_SIZE + 6"
+#endif
+
+/* QMQTT_MAX_SUBSCRIBERS, default 8, is defined in QTopicTrie.h. */
+#if QMQTT_MAX_SUBSCRIBERS > 32
+#error "QMQTT_MAX_SUBSCRIBERS must be <= 32, see QTopicTrie::SubscriberMaskType"
+#endif
+
 /* Signature of mqtt callback. */
 #if defined(ESP8266) || defined(ESP32)
 #include <functional>
@@ -29,16 +44,16 @@ typedef void (* pMQTTCallback)(char*, uint8_t*, unsigned int);
    - automatic reconnect and resubscribe to topic.
 
    It starts off unconnected. Will auto-connect on Publish or CheckMessages().
-   Note- Each instance supports only 1 subscribe topic.
+   Each instance has its own table of up to QMQTT_MAX_SUBSCRIBERS topics, each with its own
+   callback, in fixed memory.
 
    PubSubClient limitations & bugs
       - Cannot have more than 1 callback for subscribes. The callback handles all subscribed 
-        messages. So one can subscribe to more than 1 topic but cannot have separate callbacks,
-        even with separate instances. 
-        Oddly, it calls back only the first one set when using multiple instances.
+        messages. So each instance sets a dispatcher as its callback, which finds the
+        subscribers to the topic, see Dispatch_Callback().
 */   
 /**************************************************************************************/
-class QMQTT : public PubSubClient
+class QMQTT : public PubSubClient, public QTraceSink
 {
    ///////////////////////////////////////////////////////////
    // Data
@@ -56,16 +71,15 @@ class QMQTT : public PubSubClient
    // Credential info.
    static const uint16_t   _DfltPort= 1883;
 
-   static const int        _MaxSubscribers= 3;
-   static int              _SubscriberCnt;
+   static const int        _MaxSubscribers= QMQTT_MAX_SUBSCRIBERS;
 
-   /* Can contain wildcard suffix, e.g. "device/mydevice/#" */
-   static const char *     _pSubscriberTopics[_MaxSubscribers];
+   static const int        _DumpBfrLen= 159;
 
-   //static char             _pSubscribeTopic[_MaxSubscribers][MQTT_TOPIC_LEN+1];
-   static pMQTTCallback    _pSubscriberCallbacks[_MaxSubscribers];
+   /* Throttles trace output to mqtt. Batches over the rate are dropped. */
+   static QRateLimiter     _TraceRateLimiter;
 
-   static const int        _DumpBfrLen= 95;
+   /* Default max time a trace line waits in the batch before publishing. */
+   static const uint32_t   _TraceFlushMsecDflt= 2000;
    
    //////// Instance Data ////////
    const char *            _pIPAddress;
@@ -76,6 +90,41 @@ class QMQTT : public PubSubClient
    QTimer *                _pConnectionStatusTimer;         // controls freq of attempts to re-establish connection 
    QTimer *                _pMessageStatusTimer;            // controls freq of message checking
 
+   /* Throttles connection attempts while the broker is unreachable. Refused attempts are
+      deferred to the next connection status check. */
+   QRateLimiter            _ConnectRateLimiter;
+
+   /* Trace batch. Lines are joined with '\n' and published as one payload, see TraceCallback().
+      Only the master object traces, so it alone owns the static buffer. */
+   static char             _TraceBatchBfr[MQTT_MAX_PACKET_SIZE];
+   int                     _TraceBatchLen;
+   int                     _TraceLineStart;                 // of the line being written, -1 if none
+   uint32_t                _TraceFlushMsec;
+   QTimer *                _pTraceFlushTimer;               // started by the first line of a batch
+   uint32_t                _TraceLineCnt;
+   uint32_t                _TracePublishCnt;
+
+   /* Subscribers. Topics can contain wildcards, e.g. "device/mydevice/#" or "device/+/set". */
+   int                     _SubscriberCnt;
+   const char *            _pSubscriberTopics[_MaxSubscribers];
+   pMQTTCallback           _pSubscriberCallbacks[_MaxSubscribers];
+
+   /* Subscriber topics compiled for dispatch, see Dispatch_Callback(). */
+   QTopicTrie              _SubscriberTrie;
+
+   /* Inbound messages, and those no subscriber takes or on a trace topic, i.e. typically our
+      own publishes echoed back by the broker under a wildcard subscription. */
+   uint32_t                _InboundCnt;
+   uint32_t                _EchoCnt;
+
+   /* Outbound messages, published from DoService(), up to _PublishBudgetBytes per pass. */
+   QPublishQueue           _PublishQueue;
+   static const int        _PublishBudgetBytesDflt= 2 * MQTT_MAX_PACKET_SIZE;
+   int                     _PublishBudgetBytes;
+
+   /* Messages published while not connected, replayed by DoService() once connected. */
+   QOfflineBuffer          _OfflineBuffer;
+
    /* Name for this client of the mqtt server. e.g. device name.
       Must be unique across all entities. */
    const char *            _pIdentifier;                    
@@ -97,10 +146,20 @@ class QMQTT : public PubSubClient
    static void             SetTraceTopic(const char * pTraceTopic){_pTraceTopic= pTraceTopic;}
    /* Callback for redirecting Trace output to mqtt channel on the specified topic.
       This allows trace callback to be embedded within QMQTT class instead of declaring
-      it in every single app. Useful for apps that only need trace output on a single channel.    */
-   static void             TraceCallback(const char * pPayload);
+      it in every single app. Useful for apps that only need trace output on a single channel.
+      Lines are batched: published together when the packet is full, when an Event or Error
+      line arrives, or after the flush time.
+      The master object is also a QTraceSink, given to _Trace.SetCallback() to have lines
+      streamed straight into the batch.  */
+   static void             TraceCallback(const char * pPayload, TraceLevelType TraceLevel);
+   virtual void            TraceBegin(TraceLevelType TraceLevel);
+   virtual void            TraceWrite(const char * pStr, int Len);
+   virtual void            TraceEnd(TraceLevelType TraceLevel);
+
+   /* Max rate of trace batches published by TraceCallback(): Batches per PeriodMsec, bursts of up to Burst. */
+   static void             SetTraceRate(uint16_t Lines, uint32_t PeriodMsec, uint16_t Burst){_TraceRateLimiter.Set(Lines, PeriodMsec, Burst);}
    protected:
-   static void             Dispatch_Callback(char * pTopic, byte * pPayload, unsigned int PayloadLength);
+   void                    Dispatch_Callback(char * pTopic, byte * pPayload, unsigned int PayloadLength);
 
    public:
                            QMQTT(const char * pIPAddress, const char * pIdentifier);
@@ -111,6 +170,14 @@ class QMQTT : public PubSubClient
    const char *            GetIdentifier(){return _pIdentifier;};
    const char *            Dump();
    bool                    IsConnected();
+   unsigned long           GetInboundCnt(){return _InboundCnt;}
+   unsigned long           GetEchoCnt(){return _EchoCnt;}
+
+   /* Max rate of connection attempts: Attempts per PeriodMsec, bursts of up to Burst. */
+   void                    SetConnectRate(uint16_t Attempts, uint32_t PeriodMsec, uint16_t Burst){_ConnectRateLimiter.Set(Attempts, PeriodMsec, Burst);}
+
+   /* Max time a trace line waits in the batch. 0 publishes every line on its own. */
+   void                    SetTraceFlushTime(unsigned long FlushMsec);
    void                    DoService(); 
 
    /* Subscribe to a channel / topic. 
@@ -132,16 +199,45 @@ class QMQTT : public PubSubClient
       This includes the topic/channel name too.
       So ChannelName + Payload + mqtt header (5) + 2 < MQTT_MAX_PACKET_SIZE
       It will toss it if exceeded.       
+      Delivery is deferred: messages are queued and published by the next DoService() passes,
+      highest priority first, or by FlushPublishQueue(). Priority defaults to PQP_Telemetry.
+      While not connected, the latest message per topic is kept in the offline buffer, if
+      enabled by SetOfflineSlots(), and published after reconnecting. Trace is not kept.
    */
+   bool                    Publish(const char * pTopic, const char * pPayload, bool RetainMsg, QPublishQueue::PriorityT Priority);
    bool                    Publish(const char * pTopic, const char * pPayload, bool RetainMsg);
    bool                    Publish(const char * pTopic, const char * pPayload);
    bool                    Publish(const char * pPayload);
 
+   /* Publish a sample of a time series, e.g. a periodic reading, where every sample counts.
+      While not connected, samples are kept in the offline spill file if enabled, else as Publish(). */
+   bool                    PublishTimeSeries(const char * pTopic, const char * pPayload);
+
+   /* Publishes queued messages now rather than from DoService(), e.g. before a restart or deep
+      sleep. Returns: true if the queue was emptied within TimeoutMsec. */
+   bool                    FlushPublishQueue(unsigned long TimeoutMsec);
+
+   /* Max bytes of queued messages published per DoService() pass. */
+   void                    SetPublishBudget(int Bytes){_PublishBudgetBytes= Bytes;}
+   QPublishQueue *         GetPublishQueue(){return &_PublishQueue;}
+   const char *            DumpPublishQueue(){return _PublishQueue.Dump();}
+
+   /* Offline buffer. The master object has QOFFLINE_SLOT_CNT slots by default, others none, as
+      the slots take heap. The spill file is off by default, to spare the flash. */
+   void                    SetOfflineSlots(int SlotCnt){_OfflineBuffer.EnableSlots(SlotCnt);}
+   void                    SetOfflineSpill(bool Enable){_OfflineBuffer.EnableSpill(Enable);}
+   void                    SetReplayRate(uint16_t Msgs, uint32_t PeriodMsec, uint16_t Burst){_OfflineBuffer.SetReplayRate(Msgs, PeriodMsec, Burst);}
+   const char *            DumpOfflineBuffer(){return _OfflineBuffer.Dump();}
+
    protected:
    void                    Init();
    void                    Connect();
    void                    CheckConnection();
    void                    Resubscribe(); 
+   bool                    PublishNow(const char * pTopic, const char * pPayload, bool RetainMsg);
+   void                    DrainPublishQueue();
+   int                     GetTracePayloadMax();
+   void                    FlushTrace();
    
 }; // QMQTT
 
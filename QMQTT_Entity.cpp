@@ -7,6 +7,7 @@
 #include "QMQTT_Entity.h"
 #include "QTrace.h"
 #include "QIndicator.h"
+#include "QProfile.h"
 
 /**************************************************************************************/
 // QMQTT_Entity - Statics
@@ -24,14 +25,13 @@ QTimer *          QMQTT_Entity::_pServiceTimer= NULL;
 QMQTT *           QMQTT_Entity::_pMQTT= NULL;         // tbd- replace with QMQTT::Master()
 char              QMQTT_Entity::_pEntitiesTopic[MQTT_TOPIC_LEN+1];
 char              QMQTT_Entity::_pSubscribeTopic[MQTT_TOPIC_LEN+1];
+uint32_t          QMQTT_Entity::_EchoCnt= 0;
 QTimer *          QMQTT_Entity::_pAvailabilityTimer;
 
 char              QMQTT_Entity::_pJsonPayloadStr[MAX_JSON_PAYLOAD_STR+1];
 
 QShiftRegister *  QMQTT_Entity::_pShiftRegister= NULL;
-#ifdef _MQTT_ENTITY_DEBUG
 char              QMQTT_Entity::_TraceBfr[127+1];
-#endif
 
 
 /**************************************************************************************/
@@ -43,18 +43,23 @@ char              QMQTT_Entity::_TraceBfr[127+1];
       QMQTT_Entity::_pWifi= QWifi::Master();
       QMQTT_Entity::_pMQTT= QMQTT::Master();
       QMQTT_Entity::_pServiceTimer= new QTimer(/*Msec*/1000,/*Repeat*/true,/*Start*/true);
+      QMQTT_Entity::_pServiceTimer->SetName("Entity.Service");
+      QMQTT_Entity::_pServiceTimer->SetSlack(/*Msec*/100);
+      QMQTT_Entity::_pServiceTimer->SetPhaseLocked(QTimer::CPT_SkipMissed);
       QMQTT_Entity::_pAvailabilityTimer= new QTimer(_AvailabilityReportingSec */*msec*/1000,/*Repeat*/true,/*Start*/false, /*Done*/true);
+      QMQTT_Entity::_pAvailabilityTimer->SetName("Entity.Availability");
+      QMQTT_Entity::_pAvailabilityTimer->SetPhaseLocked(QTimer::CPT_SkipMissed);
 
       /* Generate the path to entities top, under which all entities will hang.
          Of the form "device/DeviceId/#", e.g. device/lighting_back     */
       sprintf(_pEntitiesTopic, "%s/%s", TOPIC_PREFIX_DEVICE, _pMQTT->GetIdentifier());
    
-      /* Set up the callback for subscribing to this device's topic.
-         Note that Trace dumps will also generate callbacks here, so any Trace in these routines is overload. */
-      sprintf(_pSubscribeTopic, "%s/#", _pEntitiesTopic);
+      /* Set up the callback for the entities' command topics, of the form "device/DeviceId/+/cmd".
+         It matches single level entity sub topics, others subscribe separately, see Init(). */
+      sprintf(_pSubscribeTopic, "%s/+/%s", _pEntitiesTopic, _pSetSubTopic);
       _pMQTT->Subscribe(/*Topic*/_pSubscribeTopic, /*Callback*/QMQTT_Entity::MQTT_Callback);
    
-      _Trace.printf(TS_SERVICES, TLT_Verbose, "QMQTT_Entity::Initialize(): SubscribeTo:[%s]", _pSubscribeTopic);
+      QTRACE(TS_SERVICES, TLT_Verbose, "QMQTT_Entity::Initialize(): SubscribeTo:[%s]", _pSubscribeTopic);
    }
 } // Initialize
 /**************************************************************************************/
@@ -67,7 +72,7 @@ char              QMQTT_Entity::_TraceBfr[127+1];
 /*static*/ void QMQTT_Entity::MQTT_Callback(char * pTopic, byte * pPayload, unsigned int PayloadLength)
 /* Callback from mqtt server on command channel. This method serves as a dispatcher.
    Implemented here (vs QMQTT) as we need to redirect to appropriate QMQTT_Entity (or subclassed) object.
-   Note that we can also arrive here from trace callbacks. So do *not* perform any trace statements within here.
+   Only entity command topics are subscribed, but do *not* perform any trace statements within here.
    Inputs:  pTopic         - e.g. device/lighting_back/pathway/set
             pPayload       - raw byte format. For this app it is json.
             PayloadLength
@@ -106,9 +111,10 @@ char              QMQTT_Entity::_TraceBfr[127+1];
       {  /* The topic for this callback matches this entity instance. Do not trace in here. */
          /* Call DoCommand() for this instance */
          pEntity->DoCommand(Message);
-         break;
+         return;
       }
    }
+   _EchoCnt++;
 
 } // MQTT_Callback
 /**************************************************************************************/
@@ -126,6 +132,8 @@ char              QMQTT_Entity::_TraceBfr[127+1];
 /**************************************************************************************/
 /*static*/ void QMQTT_Entity::DoService()
 {
+   QPROFILE_SCOPE("Entity.DoService");
+
    if ((_EntityCount > 0) && _pAvailabilityTimer->IsDone())
    {
       ReportAvailability();                           // Periodic reporting of availability
@@ -171,7 +179,7 @@ char              QMQTT_Entity::_TraceBfr[127+1];
 QMQTT_Entity::QMQTT_Entity(const char * pSubTopicEntity, EIOT IOType, int Address, bool ActiveLow)
 {
    Init(IOType, Address, ActiveLow, pSubTopicEntity);
-   _Trace.printf(TS_SERVICES, TLT_Verbose, "QMQTT_Entity(): Created entity %d, type:%d, Addr:%d, topic:[%s]", 
+   QTRACE(TS_SERVICES, TLT_Verbose, "QMQTT_Entity(): Created entity %d, type:%d, Addr:%d, topic:[%s]", 
       _EntityCount-1, _IOType, _Address, _pSubTopicEntity);
 
 } // QMQTT_Entity
@@ -179,7 +187,7 @@ QMQTT_Entity::QMQTT_Entity(const char * pSubTopicEntity, EIOT IOType, int Addres
 QMQTT_Entity::QMQTT_Entity(const char * pSubTopicEntity)
 {
    Init(EIOT::IOT_SHIFT_REGISTER, /*Address*/-1, /*ActiveLow*/false, pSubTopicEntity);
-   _Trace.printf(TS_SERVICES, TLT_Verbose, "QMQTT_Entity(): Created entity %d, topic:[%s]",
+   QTRACE(TS_SERVICES, TLT_Verbose, "QMQTT_Entity(): Created entity %d, topic:[%s]",
       _EntityCount-1, _pSubTopicEntity);
 
 } // QMQTT_Entity
@@ -200,7 +208,13 @@ void QMQTT_Entity::Init(EIOT IOType, int Address, bool ActiveLow, const char * p
    _pSubTopicEntity= pSubTopicEntity;                 // e.g. "myswitch"
    _pSubTopicCommand= QMQTT_Entity::_pSetSubTopic;    // e.g. "set"
 
-   _pStateReportingTimer= new QTimer(_StateReportingSec */*msec*/1000,/*Repeat*/true,/*Start*/false, /*Done*/true);
+   /* Reports are staggered across the period by entity, rather than all entities reporting
+      in the same pass. The first report after boot is not delayed, see IsReportDue().  */
+   _pStateReportingTimer= new QTimer(_StateReportingSec */*msec*/1000,/*Repeat*/true,/*Start*/false);
+   _pStateReportingTimer->SetName("Entity.StateRpt");
+   _pStateReportingTimer->SetPhaseLocked(QTimer::CPT_SkipMissed);
+   _pStateReportingTimer->StartDelayed(GetPhaseOffsetMsec(_StateReportingSec */*msec*/1000));
+   _InitialReportPending= true;
    _pStateCheckTimer= NULL;
 
    /* Add the new object to the list of objects. Used for dispatching callbacks from mqtt to the appropriate entity. */
@@ -210,16 +224,64 @@ void QMQTT_Entity::Init(EIOT IOType, int Address, bool ActiveLow, const char * p
       _EntityCount++;
    }
 
+   /* The shared "device/DeviceId/+/cmd" subscription only matches single level sub topics.
+      One spanning levels, e.g. "garden/pump", gets its own exact subscription.  */
+   if (strpbrk(pSubTopicEntity, "+#") != NULL)
+      QTRACE(TS_SERVICES, TLT_Error, "QMQTT_Entity::Init(): wildcard in SubTopic:[%s], commands ignored", pSubTopicEntity);
+   else if (strchr(pSubTopicEntity, '/') != NULL)
+   {
+      int Len= strlen(_pEntitiesTopic) + 1 + strlen(pSubTopicEntity) + 1 + strlen(_pSubTopicCommand);
+      if (Len > MQTT_TOPIC_LEN)
+         QTRACE(TS_SERVICES, TLT_Error, "QMQTT_Entity::Init(): command topic too long, SubTopic:[%s]", pSubTopicEntity);
+      else
+      {
+         char * pCommandTopic= new char[Len + 1];     // persists, as Subscribe() does not copy
+         sprintf(pCommandTopic, "%s/%s/%s", _pEntitiesTopic, pSubTopicEntity, _pSubTopicCommand);
+         _pMQTT->Subscribe(/*Topic*/pCommandTopic, /*Callback*/QMQTT_Entity::MQTT_Callback);
+         QTRACE(TS_SERVICES, TLT_Verbose, "QMQTT_Entity::Init(): SubscribeTo:[%s]", pCommandTopic);
+      }
+   }
+
 } // Init
-#ifdef _MQTT_ENTITY_DEBUG
+/**************************************************************************************/
+unsigned long QMQTT_Entity::GetPhaseOffsetMsec(unsigned long PeriodMsec)
+/* The period is divided into slots, one per possible entity. Slot is the bit reversed _Id, so
+   that however many entities exist, consecutive ones are spread furthest apart,
+   e.g. Ids 0,1,2,3 land at 0, 1/2, 1/4, 3/4 of the period.   */
+{
+   unsigned int SlotCnt= 1;
+   while (SlotCnt < MAX_ENTITY_INSTANCES)
+      SlotCnt<<= 1;
+
+   unsigned int Slot= 0;
+   for (unsigned int Bit= 1, ReversedBit= (SlotCnt >> 1) ; ReversedBit > 0 ; Bit<<= 1, ReversedBit>>= 1)
+   {
+      if (_Id & Bit)
+         Slot|= ReversedBit;
+   }
+
+   return (PeriodMsec / SlotCnt) * Slot;
+
+} // GetPhaseOffsetMsec
+/**************************************************************************************/
+bool QMQTT_Entity::IsReportDue()
+{
+   bool Result= _pStateReportingTimer->IsDone();
+   if (_InitialReportPending)
+   {
+      _InitialReportPending= false;
+      Result= true;
+   }
+   return Result;
+
+} // IsReportDue
 /**************************************************************************************/
 const char * QMQTT_Entity::Dump()
 {
-   sprintf(_TraceBfr, "QMQTT_Entity: %s", _pSubTopicEntity);
+   snprintf(_TraceBfr, sizeof(_TraceBfr), "QMQTT_Entity: %s, Echoed:%lu", _pSubTopicEntity, (unsigned long) _EchoCnt);
    return _TraceBfr;
    
 } // Dump
-#endif
 /**************************************************************************************/
 void QMQTT_Entity::Enable(bool Flag)
 {
@@ -231,13 +293,13 @@ void QMQTT_Entity::Enable(bool Flag)
    Used by sensors, e.g. to publish sensor reading.
    Inputs:  pText    payload- json string.
 */
-void QMQTT_Entity::ReportJsonStr(char * pJsonText)
+void QMQTT_Entity::ReportJsonStr(char * pJsonText, QPublishQueue::PriorityT Priority)
 {
    /* Generate the topic path for state publishing. Of the form EntityPath/ThisEntityName */
    char pStateTopic[MQTT_TOPIC_LEN+1];
    sprintf(pStateTopic, "%s/%s", _pEntitiesTopic, _pSubTopicEntity);
 
-   bool Result= QMQTT_Entity::_pMQTT->Publish(/*Topic*/pStateTopic, /*Payload*/pJsonText);
+   bool Result= QMQTT_Entity::_pMQTT->Publish(/*Topic*/pStateTopic, /*Payload*/pJsonText, /*RetainMsg*/false, Priority);
 
 } // ReportJsonStr
 /**************************************************************************************/
@@ -253,7 +315,7 @@ void QMQTT_Entity::ReportStateOnOff(bool State)
 {
    char * pJsonTextPayload= QMQTT_Entity::GetJsonStr(_pStateCommand, (State)?("on"):("off"));
 
-   ReportJsonStr(pJsonTextPayload);
+   ReportJsonStr(pJsonTextPayload, QPublishQueue::PQP_Ack);
 
 } // ReportStateOnOff
 
@@ -273,6 +335,7 @@ void QMQTT_Entity_Switch::Init()
 {
    _MaxOnTimeSec= QMQTT_Entity::_MaxOnTimeSecDflt;
    _pMaxOnTimer= new QTimer(_MaxOnTimeSec */*msec*/1000,/*Repeat*/false,/*Start*/false);
+   _pMaxOnTimer->SetName("Entity.MaxOn");
 } // Init
 /**************************************************************************************/
 void QMQTT_Entity_Switch::DoCommand(char * pMessage)
@@ -281,14 +344,12 @@ void QMQTT_Entity_Switch::DoCommand(char * pMessage)
    Inputs:  pMessage       json payload   e.g. {"state":"off"}
 */
 {
-   _Trace.printf(TS_SERVICES, TLT_Verbose, "QMQTT_Entity_Switch::DoCommand(): %s, Received:[%s]", _pSubTopicEntity, pMessage);
+   QTRACE(TS_SERVICES, TLT_Verbose, "QMQTT_Entity_Switch::DoCommand(): %s, Received:[%s]", _pSubTopicEntity, pMessage);
 
    /*  Process the mqtt message. TBD - JUST MOVE THE CODE IN ParseMessage here. */
    if (!ParseMessage(pMessage))
    {
-      #ifdef _MQTT_ENTITY_DEBUG
-      _Trace.printf(TS_SERVICES, TLT_Error, "Callback(): json error [%s]", pMessage);
-      #endif
+      QTRACE(TS_SERVICES, TLT_Error, "Callback(): json error [%s]", pMessage);
    }
   
 } // DoCommand
@@ -318,9 +379,7 @@ bool QMQTT_Entity_Switch::ParseMessage(char * pMessage)
    
    if (!JsonRoot.success())
    {
-      #ifdef _MQTT_ENTITY_DEBUG
-      _Trace.printf(TS_SERVICES, TLT_Error, "QMQTT_Entity_Switch::ParseMessage(): json error [%s]", pMessage);
-      #endif
+      QTRACE(TS_SERVICES, TLT_Error, "QMQTT_Entity_Switch::ParseMessage(): json error [%s]", pMessage);
       Result= false;
    }
    else
@@ -345,9 +404,7 @@ bool QMQTT_Entity_Switch::ParseMessage(char * pMessage)
          #endif
          else
          {  // unknown command
-            #ifdef _MQTT_ENTITY_DEBUG
-            _Trace.printf(TS_SERVICES, TLT_Error, "QMQTT_Entity_Switch::ParseMessage(): unknown cmd [%s]", pCmd);
-            #endif
+            QTRACE(TS_SERVICES, TLT_Error, "QMQTT_Entity_Switch::ParseMessage(): unknown cmd [%s]", pCmd);
             Result= false;
          }
       }
@@ -364,7 +421,7 @@ void QMQTT_Entity_Switch::CheckEntity()
    if (_pMaxOnTimer->IsDone())
       SetState(false);
 
-   if (_pStateReportingTimer->IsDone())
+   if (IsReportDue())
       Report();
 
 } // CheckEntity
@@ -408,7 +465,7 @@ void QMQTT_Entity_Switch::SetState(bool State)
 */
 {
    #ifdef _MQTT_ENTITY_DEBUG_DISABLED
-   _Trace.printf(TS_SERVICES, TLT_Verbose, "QMQTT_Entity_Switch::Entry(): addr:%d, state:%d", _Address, (State)?(1):(0)); 
+   QTRACE(TS_SERVICES, TLT_Verbose, "QMQTT_Entity_Switch::Entry(): addr:%d, state:%d", _Address, (State)?(1):(0)); 
    #endif
 
    _State= (State)?(1):(0);                        // State retained is logical value (exclusive of ActiveLow)
@@ -427,7 +484,7 @@ void QMQTT_Entity_Switch::SetState(bool State)
       uint32_t NewStationBits= CurStationBits & Mask;             // Clear this station bit (zero, regardless of active low or not)
       NewStationBits= NewStationBits | (StateBit << StationId);   // Set the bit for this station
       #ifdef _MQTT_ENTITY_DEBUG_DISABLED
-      _Trace.printf(TS_SERVICES, TLT_Verbose, "QMQTT_Entity_Switch::SetState(): Cur:%04x, Mask:%04x, New:%04x", 
+      QTRACE(TS_SERVICES, TLT_Verbose, "QMQTT_Entity_Switch::SetState(): Cur:%04x, Mask:%04x, New:%04x", 
          CurStationBits, Mask, NewStationBits);
       #endif
 
@@ -437,15 +494,12 @@ void QMQTT_Entity_Switch::SetState(bool State)
    {
       //_State= (State)?(1):(0);                        // State retained is logical value (exclusive of ActiveLow)
       digitalWrite(_Address, (StateBit == 1)?(HIGH):(LOW));
-      #ifdef _MQTT_ENTITY_DEBUG
-      _Trace.printf(TS_SERVICES, TLT_Verbose, "QMQTT_Entity_Switch::SetState(): %d", StateBit); 
-      #endif
+      QTRACE(TS_SERVICES, TLT_Verbose, "QMQTT_Entity_Switch::SetState(): %d", StateBit); 
    }
 
    /* Ack state info to state topic. Do this regardless of whether state changed in case of
       multiple masters or master is out of sync. */
    ReportStateOnOff(State);                               
-   _pStateReportingTimer->Restart();
 
    /* Update the watchdog timer. */
    if (State)
@@ -481,6 +535,8 @@ void QMQTT_Entity_Sensor::Init()
 {
    _pReadSensorCallback=   NULL;
    _pReportSensorCallback= NULL;
+   _ReportRateLimiter.Set(/*Reports*/6, /*msec*/60 * 1000, /*Burst*/3);
+   _ReportPending= false;
 } // Init
 /**************************************************************************************/
 void QMQTT_Entity_Sensor::SetReadSensorCallback(ReadSensorCallback pReadSensorCallback)
@@ -503,7 +559,17 @@ void QMQTT_Entity_Sensor::ReadSensorHandler(EntityStateT SensorState)
    bool StateChange= (SensorState != _State);
    _State= SensorState;
    if (StateChange)
-      Report();
+   {
+      if (_ReportPending)
+         _ReportRateLimiter.RecordDropped();          // Coalesced into the pending report
+      else if (_ReportRateLimiter.TryAcquire())
+         Report();
+      else
+      {
+         _ReportRateLimiter.RecordDeferred();
+         _ReportPending= true;
+      }
+   }
 
 } // ReadSensorHandler
 /**************************************************************************************/
@@ -516,7 +582,7 @@ void QMQTT_Entity_Sensor::CheckEntity()
    }
 
    // Check whether it's time to report the sensor value.
-   if (_pStateReportingTimer->IsDone())
+   if (IsReportDue())
    {  // Time to report state
       if (_pStateCheckTimer == NULL)
       {  /* No separate timer for state checking, read sensor and immediately report. */
@@ -525,6 +591,10 @@ void QMQTT_Entity_Sensor::CheckEntity()
 
       Report();
    }
+   else if (_ReportPending && _ReportRateLimiter.TryAcquire())
+   {  // Deferred change report
+      Report();
+   }
 
 } // CheckEntity
 /**************************************************************************************/
@@ -541,7 +611,9 @@ void QMQTT_Entity_Sensor::DoCommand(char * pMessage)
    else
       ReportStateOnOff();                               
 
-   _pStateReportingTimer->Restart();
+   /* The reporting timer is not restarted, so that periodic reports keep their phase
+      whether this one was periodic or change triggered. */
+   _ReportPending= false;
 
 } // Report
 
@@ -566,7 +638,7 @@ void QMQTT_Entity_Temperature_Sensor::ReadSensor()
 {
    _TemperatureF= _pTemperatureSensor->GetTemperatureF();
    #ifdef _MQTT_ENTITY_DEBUG_DISABLED
-   _Trace.printf(TS_SERVICES, TLT_Verbose, "QMQTT_Entity_Temperature_Sensor::ReadSensor(): %.1f", _TemperatureF);
+   QTRACE(TS_SERVICES, TLT_Verbose, "QMQTT_Entity_Temperature_Sensor::ReadSensor(): %.1f", _TemperatureF);
    #endif
 
 } // ReadSensor
@@ -596,6 +668,7 @@ QMQTT_Entity_Binary_Sensor::QMQTT_Entity_Binary_Sensor(const char * pSubTopicEnt
 void QMQTT_Entity_Binary_Sensor::Init()
 {
    _pStateCheckTimer= new QTimer(_StateCheckSec */*msec*/1000, /*Repeat*/true, /*Start*/false, /*Done*/true);
+   _pStateCheckTimer->SetName("Entity.StateCheck");
 } // Init
 /**************************************************************************************/
 void QMQTT_Entity_Binary_Sensor::ReadSensor()
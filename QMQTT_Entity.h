@@ -7,9 +7,9 @@
 #define QMQTT_Entity_h
 #include "QShiftRegister.h"
 #include "QTimer.h"
+#include "QRateLimiter.h"
 #include "QMQTT.h"
 
-#define  _MQTT_ENTITY_DEBUG                           // Enables trace dump
 #define  MAX_ENTITY_INSTANCES          8
 #define  MAX_JSON_PAYLOAD_STR          127            // Max resultant json payload string
 
@@ -79,9 +79,13 @@ class QMQTT_Entity
    static QMQTT *          _pMQTT;
 
    /* mqtt subscribe topics must be static/global
-      e.g. device/lighting_back/entities/#         */
+      Entity command topics only, e.g. device/lighting_back/+/cmd, so that the broker does not
+      echo our own state, availability and trace publishes back to us. */
    static char             _pSubscribeTopic[MQTT_TOPIC_LEN+1];
 
+   /* Messages to MQTT_Callback() not for any entity, e.g. echoes of our own publishes. */
+   static uint32_t         _EchoCnt;
+
    /* Availability timer for periodic publish of availability= online|offline. */
    static const int        _AvailabilityReportingSec= /*min*/5 * /*sec*/60;
    static QTimer *         _pAvailabilityTimer;
@@ -103,9 +107,7 @@ class QMQTT_Entity
    static const int        _MaxOnTimeSecDflt=   /*hrs*/6 * /*min*/60 * /*sec*/60;
 
    static QShiftRegister * _pShiftRegister;
-   #ifdef _MQTT_ENTITY_DEBUG
    static char             _TraceBfr[127+1];
-   #endif
 
 
    /* Instance Data        */
@@ -171,6 +173,9 @@ class QMQTT_Entity
    /* Sets the period for entity state reporting to mqtt. */
    QTimer *                _pStateReportingTimer;
 
+   /* Set until the first report, which goes out right away rather than at the phase offset. */
+   bool                    _InitialReportPending;
+
    
    ///////////////////////////////////////////////////////////
    // Methods
@@ -187,6 +192,7 @@ class QMQTT_Entity
 
    static void             MQTT_Callback(char * pSubTopicEntity, byte * pPayload, unsigned int PayloadLength);
    static char *           GetJsonStr(const char * pKey, const char * pValue);
+   static unsigned long    GetEchoCnt(){return _EchoCnt;}
 
    /* Instance Methods */
    public:
@@ -196,10 +202,8 @@ class QMQTT_Entity
                            QMQTT_Entity(const char * pSubTopicEntity, EIOT IOType, int Address, bool ActiveLow); 
                            QMQTT_Entity(const char * pSubTopicEntity);
 
-   #ifdef _MQTT_ENTITY_DEBUG
    public:
    const char *            Dump();
-   #endif
 
    bool                    IsEnabled(){return _Enabled;};
    void                    Enable(bool Flag);
@@ -208,6 +212,13 @@ class QMQTT_Entity
    void                    Init(EIOT IOType, int Address, bool ActiveLow, const char * pSubTopicEntity);
    virtual void            DoCommand(char * pMessage)= 0;
 
+   /* Offset into PeriodMsec for this entity's periodic work, so that entities sharing a period
+      do not all fire in the same pass. */
+   unsigned long           GetPhaseOffsetMsec(unsigned long PeriodMsec);
+
+   /* Returns: true if the periodic state report is due. The first is due at once. */
+   bool                    IsReportDue();
+
    /* Service each entity - for entities that need periodic checks/calls, e.g. to read state
             sensor value, etc. 
       Called by DoService(), with period set by ServiceTimer. 
@@ -226,7 +237,8 @@ class QMQTT_Entity
    void                    ReportStateOnOff(){ReportStateOnOff(_State);};
 
    public:
-   void                    ReportJsonStr(char * pJsonText);  
+   /* Queued at telemetry priority, or ack for state reports in response to a command. */
+   void                    ReportJsonStr(char * pJsonText, QPublishQueue::PriorityT Priority= QPublishQueue::PQP_Telemetry);  
 
 }; // QMQTT_Entity
 
@@ -304,6 +316,11 @@ class QMQTT_Entity_Sensor : public QMQTT_Entity
    ReadSensorCallback      _pReadSensorCallback;
    ReportSensorCallback    _pReportSensorCallback;
 
+   /* Throttles change triggered reports, e.g. from a chattering sensor. A change over the rate
+      is deferred, then reported once a token is available. Further changes while a report is
+      pending are coalesced into it, and counted as dropped. */
+   QRateLimiter            _ReportRateLimiter;
+   bool                    _ReportPending;
 
    ///////////////////////////////////////////////////////////
    // Methods
@@ -315,6 +332,11 @@ class QMQTT_Entity_Sensor : public QMQTT_Entity
    void                    SetReadSensorCallback(ReadSensorCallback pReadSensorCallback);
    void                    SetReportSensorCallback(ReportSensorCallback pReportSensorCallback);
 
+   /* Max rate of change triggered reports: Reports per PeriodMsec, bursts of up to Burst. */
+   void                    SetReportRate(uint16_t Reports, uint32_t PeriodMsec, uint16_t Burst){_ReportRateLimiter.Set(Reports, PeriodMsec, Burst);}
+   unsigned long           GetReportDroppedCnt(){return _ReportRateLimiter.GetDroppedCnt();}
+   unsigned long           GetReportDeferredCnt(){return _ReportRateLimiter.GetDeferredCnt();}
+
    protected:
    void                    Init();
    void                    DoCommand(char * pMessage);
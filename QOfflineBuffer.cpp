@@ -0,0 +1,242 @@
+///////////////////////////////////////////////////////////////////////////////
+// :mode=c:
+/*  QOfflineBuffer.cpp
+*/
+///////////////////////////////////////////////////////////////////////////////
+#include "QOfflineBuffer.h"
+
+/**************************************************************************************/
+QOfflineBuffer::QOfflineBuffer()
+{
+   Init();
+
+} // QOfflineBuffer
+/**************************************************************************************/
+void QOfflineBuffer::Init()
+{
+   _pSlots= NULL;
+   _SlotCnt= 0;
+   _SlotUsedCnt= 0;
+   _NextSeq= 0;
+   _pSpillFile= NULL;
+   _SpillSize= 0;
+   _SpillReadOffset= 0;
+   _ReplayRateLimiter.Set(5, 1000, 5);
+   _StoredCnt= 0;
+   _CoalescedCnt= 0;
+   _SpilledCnt= 0;
+   _ReplayedCnt= 0;
+   _DroppedCnt= 0;
+
+} // Init
+/**************************************************************************************/
+void QOfflineBuffer::EnableSlots(int SlotCnt)
+{
+   if (_pSlots != NULL)
+   {
+      _DroppedCnt+= _SlotUsedCnt;
+      delete[] _pSlots;
+      _pSlots= NULL;
+      _SlotCnt= 0;
+      _SlotUsedCnt= 0;
+   }
+
+   if (SlotCnt > 0)
+   {
+      _pSlots= new Slot[SlotCnt];
+      for (int i= 0 ; i < SlotCnt ; i++)
+         _pSlots[i].Topic[0]= 0;
+      _SlotCnt= SlotCnt;
+   }
+
+} // EnableSlots
+/**************************************************************************************/
+void QOfflineBuffer::EnableSpill(bool Enable)
+/* The file is left in place when disabled, to be replayed once enabled again. */
+{
+   if (Enable && (_pSpillFile == NULL))
+   {
+      _pSpillFile= new QFile(_pSpillFileName);
+      _SpillSize= _pSpillFile->Size();
+      _SpillReadOffset= 0;
+   }
+   else if (!Enable && (_pSpillFile != NULL))
+   {
+      delete _pSpillFile;
+      _pSpillFile= NULL;
+      _SpillSize= 0;
+      _SpillReadOffset= 0;
+   }
+
+} // EnableSpill
+/**************************************************************************************/
+int QOfflineBuffer::FindSlot(const char * pTopic)
+{
+   for (int i= 0 ; i < _SlotCnt ; i++)
+   {
+      if ((_pSlots[i].Topic[0] != 0) && (strcmp(_pSlots[i].Topic, pTopic) == 0))
+         return i;
+   }
+   return -1;
+
+} // FindSlot
+/**************************************************************************************/
+int QOfflineBuffer::FindOldestSlot(int Priority)
+{
+   int Result= -1;
+   for (int i= 0 ; i < _SlotCnt ; i++)
+   {
+      if ((_pSlots[i].Topic[0] != 0) && ((Priority < 0) || (_pSlots[i].Priority == Priority)) &&
+          ((Result < 0) || ((int32_t) (_pSlots[i].Seq - _pSlots[Result].Seq) < 0)))
+         Result= i;
+   }
+   return Result;
+
+} // FindOldestSlot
+/**************************************************************************************/
+bool QOfflineBuffer::Store(const char * pTopic, const char * pPayload, bool Retain, QPublishQueue::PriorityT Priority)
+{
+   if ((_SlotCnt == 0) || (strlen(pTopic) > QOFFLINE_TOPIC_LEN) || (strlen(pPayload) > QOFFLINE_PAYLOAD_LEN) || (pTopic[0] == 0))
+   {
+      _DroppedCnt++;
+      return false;
+   }
+
+   int Slot= FindSlot(pTopic);
+   if (Slot >= 0)
+      _CoalescedCnt++;
+   else
+   {
+      for (Slot= 0 ; (Slot < _SlotCnt) && (_pSlots[Slot].Topic[0] != 0) ; Slot++)
+         ;
+      if (Slot >= _SlotCnt)
+      {  /* Full: evict the oldest of the lowest priority, not above the new message's. */
+         Slot= -1;
+         for (int i= QPublishQueue::PQP_Cnt - 1 ; (i >= (int) Priority) && (Slot < 0) ; i--)
+            Slot= FindOldestSlot(i);
+
+         _DroppedCnt++;
+         if (Slot < 0)
+            return false;
+      }
+      else
+         _SlotUsedCnt++;
+      strcpy(_pSlots[Slot].Topic, pTopic);
+   }
+
+   strcpy(_pSlots[Slot].Payload, pPayload);
+   _pSlots[Slot].Seq= _NextSeq++;
+   _pSlots[Slot].Priority= Priority;
+   _pSlots[Slot].Retain= Retain;
+   _StoredCnt++;
+   return true;
+
+} // Store
+/**************************************************************************************/
+void QOfflineBuffer::Discard(const char * pTopic)
+{
+   int Slot= FindSlot(pTopic);
+   if (Slot >= 0)
+   {
+      _pSlots[Slot].Topic[0]= 0;
+      _SlotUsedCnt--;
+   }
+
+} // Discard
+/**************************************************************************************/
+bool QOfflineBuffer::Spill(const char * pTopic, const char * pPayload)
+{
+   int TopicLen= strlen(pTopic);
+   int PayloadLen= strlen(pPayload);
+   int LineLen= TopicLen + 1 + PayloadLen + 1;
+
+   if ((_pSpillFile == NULL) || (TopicLen == 0) || (TopicLen > QOFFLINE_TOPIC_LEN) || (LineLen - 1 > _SpillLineMax) ||
+       (_SpillSize + LineLen > QOFFLINE_SPILL_SIZE) || (strpbrk(pTopic, "\t\n") != NULL) || (strpbrk(pPayload, "\t\n") != NULL))
+   {
+      _DroppedCnt++;
+      return false;
+   }
+
+   char LineBfr[_SpillLineMax+2];
+   snprintf(LineBfr, sizeof(LineBfr), "%s\t%s\n", pTopic, pPayload);
+   if (_pSpillFile->Append(LineBfr, LineLen) != LineLen)
+   {  /* Replay skips a partly written line. */
+      _SpillSize= _pSpillFile->Size();
+      _DroppedCnt++;
+      return false;
+   }
+
+   _SpillSize+= LineLen;
+   _SpilledCnt++;
+   return true;
+
+} // Spill
+/**************************************************************************************/
+bool QOfflineBuffer::ReplaySpillLine(QPublishQueue & Queue)
+/* Returns: false if no line was handed to the queue, e.g. at the end of the file. */
+{
+   char LineBfr[_SpillLineMax+2];
+   bool Result= false;
+   int ReadLen= _pSpillFile->ReadAt(_SpillReadOffset, LineBfr, sizeof(LineBfr));
+   char * pEnd= strchr(LineBfr, '\n');
+   if (pEnd == NULL)
+      _SpillReadOffset= _SpillSize;                   // Truncated or corrupt, give up on the rest
+   else
+   {
+      _SpillReadOffset+= (pEnd - LineBfr) + 1;
+      *pEnd= 0;
+      char * pPayload= strchr(LineBfr, '\t');
+      if (pPayload != NULL)
+      {
+         *pPayload++= 0;
+         if (Queue.Push(LineBfr, pPayload, false, QPublishQueue::PQP_Telemetry))
+            _ReplayedCnt++;
+         else
+            _DroppedCnt++;
+         Result= true;
+      }
+   }
+
+   if ((ReadLen == 0) || (_SpillReadOffset >= _SpillSize))
+   {  /* All replayed. */
+      _pSpillFile->Remove();
+      _SpillSize= 0;
+      _SpillReadOffset= 0;
+   }
+   return Result;
+
+} // ReplaySpillLine
+/**************************************************************************************/
+void QOfflineBuffer::Replay(QPublishQueue & Queue)
+/* Latest values first, then the time series, which continues on after them while
+   HasSpillPending(). */
+{
+   while (HasPending() && _ReplayRateLimiter.IsAvailable())
+   {
+      int Oldest= FindOldestSlot();
+      if (Oldest >= 0)
+      {
+         Slot & Msg= _pSlots[Oldest];
+         if (Queue.Push(Msg.Topic, Msg.Payload, Msg.Retain, (QPublishQueue::PriorityT) Msg.Priority))
+            _ReplayedCnt++;
+         else
+            _DroppedCnt++;
+         Msg.Topic[0]= 0;
+         _SlotUsedCnt--;
+      }
+      else if (!ReplaySpillLine(Queue))
+         continue;                                    // Skipped a bad line, no token used
+      _ReplayRateLimiter.TryAcquire();
+   }
+
+} // Replay
+/**************************************************************************************/
+const char * QOfflineBuffer::Dump()
+{
+   snprintf(_StsBfr, _DumpBfrLen, "QOfflineBuffer: Slots:%d/%d, Spill:%s %lu/%lu, Stored:%lu, Coalesced:%lu, Spilled:%lu, Replayed:%lu, Dropped:%lu",
+      _SlotUsedCnt, _SlotCnt, (_pSpillFile != NULL)?("on"):("off"), _SpillSize - _SpillReadOffset, _SpillSize,
+      (unsigned long) _StoredCnt, (unsigned long) _CoalescedCnt, (unsigned long) _SpilledCnt,
+      (unsigned long) _ReplayedCnt, (unsigned long) _DroppedCnt);
+   return _StsBfr;
+
+} // Dump
@@ -0,0 +1,128 @@
+///////////////////////////////////////////////////////////////////////////////
+// :mode=c:
+/*  QOfflineBuffer.h                                                         */
+///////////////////////////////////////////////////////////////////////////////
+#ifndef QOfflineBuffer_h
+#define QOfflineBuffer_h
+#include "Arduino.h"
+#include "QPublishQueue.h"
+#include "QRateLimiter.h"
+#include "QFile.h"
+
+#ifndef QOFFLINE_SLOT_CNT
+#define QOFFLINE_SLOT_CNT              6              // Slots enabled by default on the master QMQTT object, 0 for none
+#endif
+#ifndef QOFFLINE_PAYLOAD_LEN
+#define QOFFLINE_PAYLOAD_LEN           127            // Max payload kept per slot
+#endif
+#ifndef QOFFLINE_SPILL_SIZE
+#define QOFFLINE_SPILL_SIZE            16384          // Max size of the time-series spill file, bytes
+#endif
+#define QOFFLINE_TOPIC_LEN             63             // as MQTT_TOPIC_LEN
+
+/**************************************************************************************/
+/* QOfflineBuffer - store and forward of mqtt publishes while wifi or the broker is down.
+   - State and telemetry: the latest payload per topic is kept in a slot, a newer one
+     replacing it. If the slots are full, the oldest of the lowest priority goes. Each slot
+     takes ~200 bytes of heap, so only the master QMQTT object enables them by default,
+     QOFFLINE_SLOT_CNT of them, see EnableSlots().
+   - Time series: optionally appended to a LittleFS spill file, one "topic\tpayload" line per
+     sample, so that every sample is kept. Off by default, to spare the flash.
+   Once connected, Replay() hands the buffered messages to the publish queue, slots oldest
+   first then the spill file in order, at a limited rate so that a reconnect does not cause
+   a publish storm. The spill file is removed once fully replayed; one left from a previous
+   session is replayed too.
+
+   Usage: see QMQTT::Publish() and QMQTT::PublishTimeSeries().
+*/
+/**************************************************************************************/
+class QOfflineBuffer
+{
+   ///////////////////////////////////////////////////////////
+   // Data
+   ///////////////////////////////////////////////////////////
+   public:
+   static constexpr char * _pSpillFileName=  "/mqtt.spill";
+
+   protected:
+   static const int        _SpillLineMax=    QOFFLINE_TOPIC_LEN + 1 + 191;   // excl '\n'
+
+   struct Slot
+   {
+      char                 Topic[QOFFLINE_TOPIC_LEN+1];     // empty if unused
+      char                 Payload[QOFFLINE_PAYLOAD_LEN+1];
+      uint32_t             Seq;                             // order stored, for replay
+      uint8_t              Priority;
+      bool                 Retain;
+   };
+
+   Slot *                  _pSlots;                   // NULL if disabled
+   int                     _SlotCnt;
+   int                     _SlotUsedCnt;
+   uint32_t                _NextSeq;
+
+   /* Spill file, NULL if disabled. Lines before _SpillReadOffset have been replayed. */
+   QFile *                 _pSpillFile;
+   unsigned long           _SpillSize;
+   unsigned long           _SpillReadOffset;
+
+   QRateLimiter            _ReplayRateLimiter;
+
+   /* Instrumentation. */
+   uint32_t                _StoredCnt;
+   uint32_t                _CoalescedCnt;             // Stored over an older value of the topic
+   uint32_t                _SpilledCnt;
+   uint32_t                _ReplayedCnt;
+   uint32_t                _DroppedCnt;               // No slots, too big, evicted, spill file full, or refused by the queue
+
+   /* Used for Dump(). */
+   static const int        _DumpBfrLen= 191;
+   char                    _StsBfr[_DumpBfrLen+1];
+
+   ///////////////////////////////////////////////////////////
+   // Methods
+   ///////////////////////////////////////////////////////////
+   public:
+                           QOfflineBuffer();
+
+   /* Enables SlotCnt slots, i.e. topics whose latest value is kept, 0 disables. Any values
+      kept are dropped.  */
+   void                    EnableSlots(int SlotCnt);
+
+   /* Enables the time-series spill file. Any left from the previous session is replayed. */
+   void                    EnableSpill(bool Enable);
+   bool                    IsSpillEnabled(){return (_pSpillFile != NULL);}
+
+   /* Max replay rate: Msgs per PeriodMsec, bursts of up to Burst. */
+   void                    SetReplayRate(uint16_t Msgs, uint32_t PeriodMsec, uint16_t Burst){_ReplayRateLimiter.Set(Msgs, PeriodMsec, Burst);}
+
+   /* Keeps the message as its topic's latest value.
+      Returns: false if dropped, e.g. slots disabled.  */
+   bool                    Store(const char * pTopic, const char * pPayload, bool Retain, QPublishQueue::PriorityT Priority);
+
+   /* Appends a time-series sample to the spill file.
+      Returns: false if dropped, e.g. spill disabled or full.  */
+   bool                    Spill(const char * pTopic, const char * pPayload);
+
+   /* Drops the topic's stored value, e.g. superseded by a newer publish. */
+   void                    Discard(const char * pTopic);
+
+   bool                    HasPending(){return (_SlotUsedCnt > 0) || HasSpillPending();}
+   bool                    HasSpillPending(){return (_SpillReadOffset < _SpillSize);}
+
+   /* Call when connected. Moves buffered messages to the queue, as the replay rate allows. */
+   void                    Replay(QPublishQueue & Queue);
+
+   const char *            Dump();
+
+   protected:
+   void                    Init();
+   int                     FindSlot(const char * pTopic);
+
+   /* Oldest used slot, of the given priority or any if -1.
+      Returns: -1 if none.  */
+   int                     FindOldestSlot(int Priority= -1);
+   bool                    ReplaySpillLine(QPublishQueue & Queue);
+};
+
+#endif
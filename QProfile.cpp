@@ -0,0 +1,113 @@
+///////////////////////////////////////////////////////////////////////////////
+// :mode=c:
+/*  QProfile.cpp
+*/
+///////////////////////////////////////////////////////////////////////////////
+#include "QProfile.h"
+
+/**************************************************************************************/
+// Static Member Initialization
+/**************************************************************************************/
+QProfile                QProfile::_Probes[QPROFILE_PROBE_CNT];
+int                     QProfile::_ProbeCnt=       0;
+uint32_t                QProfile::_RefusedCnt=     0;
+uint32_t                QProfile::_ResetMsec=      0;
+char                    QProfile::_StsBfr[_DumpBfrLen+1];
+
+/**************************************************************************************/
+/*static*/ QProfile * QProfile::Register(const char * pName)
+{
+   if (_ProbeCnt >= QPROFILE_PROBE_CNT)
+   {
+      _RefusedCnt++;
+      return NULL;
+   }
+
+   QProfile * pProbe= &_Probes[_ProbeCnt++];
+   pProbe->Init(pName);
+   return pProbe;
+
+} // Register
+/**************************************************************************************/
+void QProfile::Init(const char * pName)
+{
+   _pName= pName;
+   Reset();
+
+} // Init
+/**************************************************************************************/
+void QProfile::Reset()
+{
+   _Cnt= 0;
+   _TotalUsec= 0;
+   _MinUsec= 0xFFFFFFFFUL;
+   _MaxUsec= 0;
+   for (int i= 0 ; i < QPROFILE_BUCKET_CNT ; i++)
+      _Buckets[i]= 0;
+
+} // Reset
+/**************************************************************************************/
+/*static*/ void QProfile::ResetAll()
+{
+   for (int i= 0 ; i < _ProbeCnt ; i++)
+      _Probes[i].Reset();
+   _ResetMsec= QTimestamp::GetTickMsec();
+
+} // ResetAll
+/**************************************************************************************/
+/*static*/ int QProfile::GetBucket(uint32_t Usec)
+{
+   if (Usec < 2)
+      return 0;
+
+   int Bucket= 31 - __builtin_clz(Usec);
+   return (Bucket < QPROFILE_BUCKET_CNT)?(Bucket):(QPROFILE_BUCKET_CNT - 1);
+
+} // GetBucket
+/**************************************************************************************/
+void QProfile::Record(uint32_t Usec)
+{
+   _Cnt++;
+   _TotalUsec+= Usec;
+   if (Usec < _MinUsec)
+      _MinUsec= Usec;
+   if (Usec > _MaxUsec)
+      _MaxUsec= Usec;
+   _Buckets[GetBucket(Usec)]++;
+
+} // Record
+/**************************************************************************************/
+const char * QProfile::Dump()
+{
+   int Len= snprintf(_StsBfr, _DumpBfrLen, "QProfile %s: Calls:%lu, Usec avg/min/max:%lu/%lu/%lu",
+      (_pName != NULL)?(_pName):("?"),
+      GetCnt(), GetAvgUsec(), GetMinUsec(), GetMaxUsec());
+
+   /* Histogram, from the first to the last non-empty bucket. */
+   int First= 0;
+   int Last= QPROFILE_BUCKET_CNT - 1;
+   while ((First < Last) && (_Buckets[First] == 0))
+      First++;
+   while ((Last > First) && (_Buckets[Last] == 0))
+      Last--;
+
+   if ((_Cnt > 0) && (Len < _DumpBfrLen))
+      Len+= snprintf(&_StsBfr[Len], _DumpBfrLen - Len, ", Log2 from 2^%d:", First);
+   for (int i= First ; (_Cnt > 0) && (i <= Last) && (Len < _DumpBfrLen) ; i++)
+      Len+= snprintf(&_StsBfr[Len], _DumpBfrLen - Len, (i == First)?("%lu"):("/%lu"), (unsigned long) _Buckets[i]);
+
+   return _StsBfr;
+
+} // Dump
+/**************************************************************************************/
+/*static*/ void QProfile::TraceAll(uint8_t TraceSwitchId, TraceLevelType TraceLevel)
+{
+   _Trace.printf(TraceSwitchId, TraceLevel, F("QProfile: %d probes over %lu sec, %lu refused"),
+      _ProbeCnt, (unsigned long) ((QTimestamp::GetTickMsec() - _ResetMsec) / /*msec*/1000), (unsigned long) _RefusedCnt);
+   for (int i= 0 ; i < _ProbeCnt ; i++)
+   {
+      if (_Probes[i]._Cnt > 0)
+         _Trace.printf(TraceSwitchId, TraceLevel, F("%s"), _Probes[i].Dump());
+   }
+
+} // TraceAll
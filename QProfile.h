@@ -0,0 +1,130 @@
+///////////////////////////////////////////////////////////////////////////////
+// :mode=c:
+/*  QProfile.h                                                               */
+///////////////////////////////////////////////////////////////////////////////
+#ifndef QProfile_h
+#define QProfile_h
+#include "Arduino.h"
+#include "QTrace.h"
+#include "QTimer.h"
+
+//#define  ENB_QPROFILE                                 // Scoped probes. Without it QPROFILE_SCOPE() compiles to nothing.
+
+#ifndef QPROFILE_PROBE_CNT
+#ifdef ENB_QPROFILE
+#define QPROFILE_PROBE_CNT             12             // Probes in the fixed pool
+#else
+#define QPROFILE_PROBE_CNT             1              // Pool is unused without probes, keep it minimal
+#endif
+#endif
+#define QPROFILE_BUCKET_CNT            16             // Log2 histogram buckets, see QProfile::GetBucket()
+
+/**************************************************************************************/
+/* QProfile - profiling probe, accumulating the time spent in a scope: call count, total,
+   min and max usec, and a log2 histogram of the call times. Probes come from a fixed pool,
+   one per QPROFILE_SCOPE() site, registered on the first pass through it.
+
+   Stats accumulate from the last ResetAll(). When that trace is enabled, QCore traces them
+   with the periodic status dump, then resets, so each summary covers one status period. On demand, they are
+   published to device/<id>/profile, see QCore.
+
+   Usage:
+      void QMyClass::DoService()
+      {
+         QPROFILE_SCOPE("MyClass.DoService");         // Times the rest of the function
+         ...
+      }
+*/
+/**************************************************************************************/
+class QProfile
+{
+   ///////////////////////////////////////////////////////////
+   // Data
+   ///////////////////////////////////////////////////////////
+   protected:
+   const char *            _pName;
+   uint32_t                _Cnt;
+   uint64_t                _TotalUsec;
+   uint32_t                _MinUsec;
+   uint32_t                _MaxUsec;
+   uint32_t                _Buckets[QPROFILE_BUCKET_CNT];
+
+   /* Probe pool. */
+   static QProfile         _Probes[QPROFILE_PROBE_CNT];
+   static int              _ProbeCnt;
+   static uint32_t         _RefusedCnt;               // Registrations beyond the pool
+   static uint32_t         _ResetMsec;                // Start of the current stats period
+
+   /* Used for Dump(), shared by all probes. */
+   static const int        _DumpBfrLen= 159;
+   static char             _StsBfr[_DumpBfrLen+1];
+
+   ///////////////////////////////////////////////////////////
+   // Methods
+   ///////////////////////////////////////////////////////////
+   public:
+   /* Takes a probe from the pool. Caller's name string must persist.
+      Returns: NULL if the pool is used up. */
+   static QProfile *       Register(const char * pName);
+
+   /* Clears the stats of all probes, starting a new period. */
+   static void             ResetAll();
+
+   /* Traces a line per probe called in the current period. */
+   static void             TraceAll(uint8_t TraceSwitchId, TraceLevelType TraceLevel);
+
+   static int              GetProbeCnt(){return _ProbeCnt;}
+   static QProfile *       GetProbe(int Index){return &_Probes[Index];}
+   static unsigned long    GetRefusedCnt(){return _RefusedCnt;}
+
+   /* Adds a call of Usec duration. */
+   void                    Record(uint32_t Usec);
+   void                    Reset();
+
+   /* Histogram bucket for a duration: 0 for < 2 usec, else floor(log2(Usec)), the last
+      bucket also taking everything longer. */
+   static int              GetBucket(uint32_t Usec);
+
+   const char *            GetName(){return _pName;}
+   unsigned long           GetCnt(){return _Cnt;}
+   unsigned long           GetMinUsec(){return (_Cnt > 0)?(_MinUsec):(0);}
+   unsigned long           GetMaxUsec(){return _MaxUsec;}
+   unsigned long           GetAvgUsec(){return (_Cnt > 0)?((unsigned long) (_TotalUsec / _Cnt)):(0);}
+
+   /* Stats summary, with the non-empty span of the histogram. Returned string is overwritten
+      by the next Dump() of any probe. */
+   const char *            Dump();
+
+   protected:
+   void                    Init(const char * pName);
+};
+
+/**************************************************************************************/
+/* QProfileScope - times its lifetime into a probe. NULL probe is a no-op. */
+/**************************************************************************************/
+class QProfileScope
+{
+   ///////////////////////////////////////////////////////////
+   // Data
+   ///////////////////////////////////////////////////////////
+   protected:
+   QProfile *              _pProbe;
+   uint32_t                _StartUsec;
+
+   ///////////////////////////////////////////////////////////
+   // Methods
+   ///////////////////////////////////////////////////////////
+   public:
+                           QProfileScope(QProfile * pProbe){_pProbe= pProbe; _StartUsec= QTimestamp::GetNowTimeUsec();}
+                           ~QProfileScope(){if (_pProbe != NULL) _pProbe->Record(QTimestamp::GetNowTimeUsec() - _StartUsec);}
+};
+
+#ifdef ENB_QPROFILE
+#define QPROFILE_SCOPE(Name)                                                  \
+   static QProfile * _pQProfileProbe= QProfile::Register(Name);              \
+   QProfileScope _QProfileScope(_pQProfileProbe)
+#else
+#define QPROFILE_SCOPE(Name)
+#endif
+
+#endif
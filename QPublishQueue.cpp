@@ -0,0 +1,147 @@
+///////////////////////////////////////////////////////////////////////////////
+// :mode=c:
+/*  QPublishQueue.cpp
+*/
+///////////////////////////////////////////////////////////////////////////////
+#include "QPublishQueue.h"
+
+/**************************************************************************************/
+QPublishQueue::QPublishQueue()
+{
+   Init();
+
+} // QPublishQueue
+/**************************************************************************************/
+void QPublishQueue::Init()
+{
+   _UsedLen= 0;
+   _OverflowPolicy= OFP_DropOldest;
+   _QueuedCnt= 0;
+   _SentCnt= 0;
+   _FailedCnt= 0;
+   _HighWaterLen= 0;
+   for (int i= 0 ; i < PQP_Cnt ; i++)
+   {
+      _MsgCnt[i]= 0;
+      _DroppedCnt[i]= 0;
+   }
+
+} // Init
+/**************************************************************************************/
+uint16_t QPublishQueue::GetRecordSize(int Offset)
+/* Header fields are copied out bytewise, records are not aligned. */
+{
+   uint16_t Size;
+   memcpy(&Size, &_Arena[Offset], sizeof(Size));
+   return Size;
+
+} // GetRecordSize
+/**************************************************************************************/
+int QPublishQueue::Find(int Priority)
+{
+   if (Priority == PQP_Cnt)
+   {  /* Highest priority waiting. */
+      for (Priority= 0 ; (Priority < PQP_Cnt) && (_MsgCnt[Priority] == 0) ; Priority++)
+         ;
+   }
+   if ((Priority >= PQP_Cnt) || (_MsgCnt[Priority] == 0))
+      return -1;
+
+   for (int Offset= 0 ; Offset < _UsedLen ; Offset+= GetRecordSize(Offset))
+   {
+      if (GetRecordPriority(Offset) == Priority)
+         return Offset;
+   }
+   return -1;
+
+} // Find
+/**************************************************************************************/
+void QPublishQueue::Remove(int Offset)
+{
+   uint16_t Size= GetRecordSize(Offset);
+   _MsgCnt[GetRecordPriority(Offset)]--;
+   memmove(&_Arena[Offset], &_Arena[Offset + Size], _UsedLen - (Offset + Size));
+   _UsedLen-= Size;
+
+} // Remove
+/**************************************************************************************/
+bool QPublishQueue::Push(const char * pTopic, const char * pPayload, bool Retain, PriorityT Priority)
+{
+   int TopicLen= strlen(pTopic);
+   int PayloadLen= strlen(pPayload);
+   int Size= _HdrSize + TopicLen + 1 + PayloadLen + 1;
+
+   if (Size > QPUBLISH_QUEUE_SIZE)
+   {
+      _DroppedCnt[Priority]++;
+      return false;
+   }
+
+   /* Make room. */
+   while (_UsedLen + Size > QPUBLISH_QUEUE_SIZE)
+   {
+      int Victim= -1;
+      for (int i= PQP_Cnt - 1 ; (i >= (int) Priority) && (Victim < 0) && (_OverflowPolicy == OFP_DropOldest) ; i--)
+         Victim= Find(i);
+
+      if (Victim < 0)
+      {
+         _DroppedCnt[Priority]++;
+         return false;
+      }
+      _DroppedCnt[GetRecordPriority(Victim)]++;
+      Remove(Victim);
+   }
+
+   uint8_t * pRecord= &_Arena[_UsedLen];
+   uint16_t Size16= Size;
+   uint16_t TopicLen16= TopicLen;
+   memcpy(&pRecord[0], &Size16, sizeof(Size16));
+   pRecord[2]= Priority;
+   pRecord[3]= (Retain)?(1):(0);
+   memcpy(&pRecord[4], &TopicLen16, sizeof(TopicLen16));
+   memcpy(&pRecord[_HdrSize], pTopic, TopicLen + 1);
+   memcpy(&pRecord[_HdrSize + TopicLen + 1], pPayload, PayloadLen + 1);
+
+   _UsedLen+= Size;
+   _MsgCnt[Priority]++;
+   _QueuedCnt++;
+   if (_UsedLen > _HighWaterLen)
+      _HighWaterLen= _UsedLen;
+   return true;
+
+} // Push
+/**************************************************************************************/
+bool QPublishQueue::Front(const char ** ppTopic, const char ** ppPayload, bool * pRetain, int * pSize)
+{
+   int Offset= Find(PQP_Cnt);
+   if (Offset < 0)
+      return false;
+
+   uint16_t TopicLen;
+   memcpy(&TopicLen, &_Arena[Offset + 4], sizeof(TopicLen));
+   *ppTopic= (const char *) &_Arena[Offset + _HdrSize];
+   *ppPayload= (const char *) &_Arena[Offset + _HdrSize + TopicLen + 1];
+   *pRetain= (_Arena[Offset + 3] != 0);
+   *pSize= GetRecordSize(Offset);
+   return true;
+
+} // Front
+/**************************************************************************************/
+void QPublishQueue::Pop()
+{
+   int Offset= Find(PQP_Cnt);
+   if (Offset >= 0)
+      Remove(Offset);
+
+} // Pop
+/**************************************************************************************/
+const char * QPublishQueue::Dump()
+{
+   snprintf(_StsBfr, _DumpBfrLen, "QPublishQueue: Msgs:%d, Bytes:%u/%u, Max:%u, Queued:%lu, Sent/Failed:%lu/%lu, Dropped ack/tlm/trace:%lu/%lu/%lu",
+      GetMsgCnt(), _UsedLen, QPUBLISH_QUEUE_SIZE, _HighWaterLen, (unsigned long) _QueuedCnt,
+      (unsigned long) _SentCnt, (unsigned long) _FailedCnt,
+      (unsigned long) _DroppedCnt[PQP_Ack], (unsigned long) _DroppedCnt[PQP_Telemetry], (unsigned long) _DroppedCnt[PQP_Trace]);
+   return _StsBfr;
+
+} // Dump
@@ -0,0 +1,113 @@
+///////////////////////////////////////////////////////////////////////////////
+// :mode=c:
+/*  QPublishQueue.h                                                          */
+///////////////////////////////////////////////////////////////////////////////
+#ifndef QPublishQueue_h
+#define QPublishQueue_h
+#include "Arduino.h"
+#include <PubSubClient.h>                             // MQTT_MAX_PACKET_SIZE
+
+#ifndef QPUBLISH_QUEUE_SIZE
+#define QPUBLISH_QUEUE_SIZE            (3 * MQTT_MAX_PACKET_SIZE)   // Arena for queued topics and payloads, bytes
+#endif
+#if QPUBLISH_QUEUE_SIZE > 0xFFFF
+#error "QPUBLISH_QUEUE_SIZE must be <= 65535, arena offsets are uint16_t"
+#endif
+
+/**************************************************************************************/
+/* QPublishQueue - outbound mqtt messages waiting to be published, by priority. Topic and
+   payload are copied into a fixed arena, as records packed oldest first:
+      [Size:2][Priority:1][Retain:1][TopicLen:2] Topic '\0' Payload '\0'
+   Front() is the oldest message of the highest priority waiting. Pop() removes it and packs
+   the records after it down, so the arena needs no free list.
+
+   When a message does not fit, the overflow policy decides what goes:
+      OFP_DropNew       the new message
+      OFP_DropOldest    queued messages of the same or lower priority, lowest priority and
+                        oldest first, else the new message
+   Drops are counted per priority of the message dropped.
+
+   Usage: see QMQTT::Publish() and QMQTT::DrainPublishQueue().
+*/
+/**************************************************************************************/
+class QPublishQueue
+{
+   public:
+   /* Highest first. */
+   typedef enum PriorityT
+   {
+      PQP_Ack=             0,                         // State acks, e.g. of switch commands
+      PQP_Telemetry,                                  // Sensor readings, availability, status
+      PQP_Trace,
+      PQP_Cnt
+   };
+
+   typedef enum OverflowPolicyT
+   {
+      OFP_DropNew=         0,
+      OFP_DropOldest
+   };
+
+   ///////////////////////////////////////////////////////////
+   // Data
+   ///////////////////////////////////////////////////////////
+   protected:
+   static const int        _HdrSize=         6;
+
+   uint8_t                 _Arena[QPUBLISH_QUEUE_SIZE];
+   uint16_t                _UsedLen;
+   uint16_t                _MsgCnt[PQP_Cnt];
+   OverflowPolicyT         _OverflowPolicy;
+
+   /* Instrumentation. */
+   uint32_t                _QueuedCnt;
+   uint32_t                _SentCnt;
+   uint32_t                _FailedCnt;                // Publish errors once dequeued
+   uint32_t                _DroppedCnt[PQP_Cnt];
+   uint16_t                _HighWaterLen;
+
+   /* Used for Dump(). */
+   static const int        _DumpBfrLen= 159;
+   char                    _StsBfr[_DumpBfrLen+1];
+
+   ///////////////////////////////////////////////////////////
+   // Methods
+   ///////////////////////////////////////////////////////////
+   public:
+                           QPublishQueue();
+
+   void                    SetOverflowPolicy(OverflowPolicyT Policy){_OverflowPolicy= Policy;}
+
+   /* Copies the message into the queue.
+      Returns: false if dropped, per the overflow policy.  */
+   bool                    Push(const char * pTopic, const char * pPayload, bool Retain, PriorityT Priority);
+
+   /* Next message to publish. Pointers are into the arena, valid until the next Push() or Pop().
+      Size is of its record, for budgeting.
+      Returns: false if empty.  */
+   bool                    Front(const char ** ppTopic, const char ** ppPayload, bool * pRetain, int * pSize);
+   void                    Pop();
+
+   /* Caller's accounting of the outcome of publishing Front(). */
+   void                    RecordPublished(bool Sent){if (Sent) _SentCnt++; else _FailedCnt++;}
+
+   bool                    IsEmpty(){return (_UsedLen == 0);}
+   int                     GetMsgCnt(){return _MsgCnt[PQP_Ack] + _MsgCnt[PQP_Telemetry] + _MsgCnt[PQP_Trace];}
+   int                     GetUsedLen(){return _UsedLen;}
+   unsigned long           GetQueuedCnt(){return _QueuedCnt;}
+   unsigned long           GetDroppedCnt(PriorityT Priority){return _DroppedCnt[Priority];}
+
+   const char *            Dump();
+
+   protected:
+   void                    Init();
+
+   /* Offset of the oldest record of the given priority, or of the highest waiting if
+      PQP_Cnt, -1 if none. */
+   int                     Find(int Priority);
+   void                    Remove(int Offset);
+   uint16_t                GetRecordSize(int Offset);
+   uint8_t                 GetRecordPriority(int Offset){return _Arena[Offset+2];}
+};
+
+#endif
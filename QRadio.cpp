@@ -6,8 +6,7 @@
 #include "QRadio.h"
 #include "QTrace.h"
 #include "QString.h"
-
-#define  TRACE_SWITCH_RADIO      TS_SERVICES          // Allows remapping of the trace switch
+#include "QProfile.h"
 
 /**************************************************************************************/
 // QRadioRcvr
@@ -41,6 +40,7 @@ void QRadioRcvr::Init()
    #ifdef _RADIO_INDICATOR
    _PinMessageReceived= (D6);
    _pIndicatorTimer= new QTimer(/*Msec*/1000,/*Repeat*/false,/*Start*/false);
+   _pIndicatorTimer->SetName("Radio.Indicator");
    #endif
 
 } // Init
@@ -110,7 +110,7 @@ void QRadioRcvr::SetDeviceType(uint8_t DeviceType)
    _pMsgBfrReady= NULL;
    _pMsgBfrPending= _MsgBfr1;
 
-   _LastEntryTime_usec= micros();         // Capture time right before this gets turned on
+   _LastEntryTime_usec= QTimestamp::GetNowTimeUsec64();   // Capture time right before this gets turned on
    _Enabled= true;
 
 } // SetDeviceType
@@ -151,16 +151,12 @@ ICACHE_RAM_ATTR int QRadioRcvr::AddPulse()
 {
    int Result= 0;
 
-   /* number of microseconds since the Arduino board began. Rolls over every ~70 minutes. */
-   unsigned long NowTime_usec= micros(); 
-   unsigned long DeltaTime_usec;
-   if (NowTime_usec < _LastEntryTime_usec) 
-      DeltaTime_usec= (ULONG_MAX - _LastEntryTime_usec) + 1 + NowTime_usec; // rollover case
-   else 
-      DeltaTime_usec= NowTime_usec - _LastEntryTime_usec;
+   /* Microseconds since boot, 64 bit so no rollover handling. */
+   uint64_t NowTime_usec= QTimestamp::GetNowTimeUsec64(); 
+   uint64_t DeltaTime_usec= NowTime_usec - _LastEntryTime_usec;
 
    /* Cap it to 32K-1 */
-   uint16_t Data= DeltaTime_usec & 0x7FFF;
+   uint16_t Data= (DeltaTime_usec > 0x7FFF)?(0x7FFF):((uint16_t) DeltaTime_usec);
 
    if (_Enabled && !IsFull())
    {
@@ -206,7 +202,7 @@ int QRadioRcvr::GetMessage(uint8_t * pMsgOutArr, int MsgBfrSize)
       #ifdef _RADIO_DEBUG
       char TraceStr[_MaxMsgSizeBytes * 3];
       ToHexStr(pMsgOutArr, Result, TraceStr);
-      _Trace.printf(TRACE_SWITCH_RADIO, TLT_Verbose, "QRadioRcvr::GetMessage(): Message retrieved, Sz:%d [%s], %s", Result, TraceStr, GetStats());
+      QTRACE(TRACE_SWITCH_RADIO, TLT_Verbose, "QRadioRcvr::GetMessage(): Message retrieved, Sz:%d [%s], %s", Result, TraceStr, GetStats());
       #endif
    }
 
@@ -274,9 +270,10 @@ bool QRadioRcvr::IsSync()
 {
    bool Result= false;
    int   PulseCount= 0;
-   #ifdef _RADIO_DEBUG2   
-   _SyncPulseMin= 1024; _SyncPulseMax= 0;
-   #endif
+   if (QTrace::IsCompiled(TRACE_SWITCH_RADIO, TLT_Max))
+   {
+      _SyncPulseMin= 1024; _SyncPulseMax= 0;
+   }
 
    if (Count() >= _MaxSyncPulseCount + (_MinMsgSizeBytes * 8))
    {  // Sufficient data in queue to search for pulse train
@@ -301,10 +298,11 @@ bool QRadioRcvr::IsSync()
          else
          {
             PulseCount++;
-            #ifdef _RADIO_DEBUG2 
-            _SyncPulseMin= (PulseWidth < _SyncPulseMin)?(PulseWidth):(_SyncPulseMin);  
-            _SyncPulseMax= (PulseWidth > _SyncPulseMax)?(PulseWidth):(_SyncPulseMax); 
-            #endif
+            if (QTrace::IsCompiled(TRACE_SWITCH_RADIO, TLT_Max))
+            {
+               _SyncPulseMin= (PulseWidth < _SyncPulseMin)?(PulseWidth):(_SyncPulseMin);  
+               _SyncPulseMax= (PulseWidth > _SyncPulseMax)?(PulseWidth):(_SyncPulseMax); 
+            }
 
             IncrHead(1);
          } 
@@ -360,10 +358,8 @@ int QRadioRcvr::GetBit()
                && (Short_Pulse_Width_usec <= (Nominal_Short_Pulse_Width_usec + Tolerance_usec)))
             {  // Valid data pulse pair
                Result= (Pulse1_Width_usec <= Pulse2_Width_usec)?(0):(1);
-               #ifdef _RADIO_DEBUG2
-               _Trace.printf(TRACE_SWITCH_RADIO, TLT_Warning, "QRadioRcvr: Pulse Ratio Pass. %d/%d=%d",
+               QTRACED(TRACE_SWITCH_RADIO, TLT_Max, "QRadioRcvr: Pulse Ratio Pass. %d/%d=%d",
                   Pulse1_Width_usec, Pulse2_Width_usec, Result);
-               #endif
             }
    
             // Other method- allow to be +-X % of total
@@ -389,6 +385,8 @@ int QRadioRcvr::GetBit()
 /* Cycle the state machine. Requires at least 3 calls to post data.  */
 void QRadioRcvr::DoStateMachine()
 {
+   QPROFILE_SCOPE("Radio.DoStateMachine");
+
    /* Note- designed to allow re-entrance to the same state for completion,
       e.g. if waiting on fifo data. */
    switch (_State)
@@ -431,9 +429,7 @@ void QRadioRcvr::DoStateMachine()
             if (IsSync())
             {  // Found a valid sync pulse train. Head of queue is 1st data bit.
                digitalWrite(LED_BUILTIN, LOW);                 // 0/Low=On.
-               #ifdef _RADIO_DEBUG2
-               _Trace.printf(TRACE_SWITCH_RADIO, TLT_Verbose, "QRadioRcvr:Sync found, min/max:%d/%d, %s", _SyncPulseMin, _SyncPulseMax, Dump());
-               #endif
+               QTRACE(TRACE_SWITCH_RADIO, TLT_Max, "QRadioRcvr:Sync found, min/max:%d/%d, %s", _SyncPulseMin, _SyncPulseMax, Dump());
                _State= State_Accumulate_Wait;                  // found N sync pulses in a row
                break;
             }
@@ -450,16 +446,14 @@ void QRadioRcvr::DoStateMachine()
          //int MinBits= /*bytes*/ 8 * /*bits/byte*/ 8 * /*pulses/bit*/ 2;
          if (Count() >= MinBits)
          {
-            #ifdef _RADIO_DEBUG2
             // Dump the data pulses
-            int TraceBfrSz= 128;
-            if (_HeadIndex < _PulseBfrSize - MinBits)
+            if (QTrace::IsCompiled(TRACE_SWITCH_RADIO, TLT_Max) && (_HeadIndex < _PulseBfrSize - MinBits))
             {
+               const int TraceBfrSz= 128;
                char TraceBfr[TraceBfrSz];
                ToStr(_PulseBfr + _HeadIndex, /*#Items*/MinBits, TraceBfr, TraceBfrSz);
-               _Trace.printf(TRACE_SWITCH_RADIO, TLT_Verbose, "QRadioRcvr: %s [%s]", Dump(), TraceBfr);
+               QTRACE(TRACE_SWITCH_RADIO, TLT_Max, "QRadioRcvr: %s [%s]", Dump(), TraceBfr);
             }
-            #endif
 
             _State= State_Accumulate_Data;
          }
@@ -475,7 +469,7 @@ void QRadioRcvr::DoStateMachine()
                int MsgBfrIndex= _BitIndex >> 3;
                if (MsgBfrIndex >= _MaxMsgSizeBytes)
                {  // Message has hit max size. For now, keep it. tbd- whether to abandon and return to seek.
-                  _Trace.printf(TRACE_SWITCH_RADIO, TLT_Warning, "QRadioRcvr: message size exceeds max (%d of %d), truncating.", MsgBfrIndex, _MaxMsgSizeBytes);
+                  QTRACED(TRACE_SWITCH_RADIO, TLT_Warning, "QRadioRcvr: message size exceeds max (%d of %d), truncating.", MsgBfrIndex, _MaxMsgSizeBytes);
                   _State= State_Post_Data;
                   break;
                }
@@ -489,11 +483,9 @@ void QRadioRcvr::DoStateMachine()
             {  /* Not a data bit. Note, item is still in queue and will be processed by Seek.
                   If we got disabled in middle of this, start over. */
                _State= (_Enabled)?(State_Post_Data):(State_Sync_Seek);
-               #ifdef _RADIO_DEBUG2
                if (Bit != PT_Termination)
-                  _Trace.printf(TRACE_SWITCH_RADIO, TLT_Verbose, "QRadioRcvr: data stream terminated: BitIndex:%d, Pulse:%d,%d.",
+                  QTRACED(TRACE_SWITCH_RADIO, TLT_Max, "QRadioRcvr: data stream terminated: BitIndex:%d, Pulse:%d,%d.",
                      _BitIndex, _PulseBfr[_HeadIndex], _PulseBfr[(_HeadIndex +1) % _PulseBfrSize]);
-               #endif
                break;                                       // Done accumulating data
             }
          }
@@ -507,23 +499,17 @@ void QRadioRcvr::DoStateMachine()
          int ByteCnt= _BitIndex >> 3;
          if ((_BitIndex == 0) || (_BitIndex % 8 != 0))
          {  // Partially complete byte, error
-            #ifdef _RADIO_DEBUG2
             _MsgErrorCnt++;
-            _Trace.printf(TRACE_SWITCH_RADIO, TLT_Verbose, "QRadioRcvr: incomplete data byte received, dropping message. BitIndex:%d, %s", _BitIndex, GetStats());
-            #endif
+            QTRACE(TRACE_SWITCH_RADIO, TLT_Max, "QRadioRcvr: incomplete data byte received, dropping message. BitIndex:%d, %s", _BitIndex, GetStats());
          }
          else if (ByteCnt < _MinMsgSizeBytes)
          {  // Message too short, error
-            #ifdef _RADIO_DEBUG2
             _MsgErrorCnt++;
-            _Trace.printf(TRACE_SWITCH_RADIO, TLT_Warning, "QRadioRcvr: message size below min (%d of %d).", ByteCnt, _MinMsgSizeBytes);
-            #endif
+            QTRACED(TRACE_SWITCH_RADIO, TLT_Max, "QRadioRcvr: message size below min (%d of %d).", ByteCnt, _MinMsgSizeBytes);
          }
          else if (_MsgCntBytes > 0)
          {  // Prior message not read yet, dump this one.
-            #ifdef _RADIO_DEBUG2
-            _Trace.printf(TRACE_SWITCH_RADIO, TLT_Warning, "QRadioRcvr: message overrun.");
-            #endif
+            QTRACED(TRACE_SWITCH_RADIO, TLT_Max, "QRadioRcvr: message overrun.");
          }
          else
          {  // Successful receive. Set the active buffer and mark as message ready
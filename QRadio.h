@@ -8,7 +8,6 @@
 #include "AllApps.h"
 #include "QTimer.h"
 #define _RADIO_DEBUG
-//#define _RADIO_DEBUG2
 //#define  _RADIO_INDICATOR               // Blinks led on D6 when packet received. Note- can conflict with parent indicator
 #define _RADIO_DECODE_METHOD2
 
@@ -94,7 +93,7 @@ class QRadioRcvr
    uint16_t *              _PulseBfr;
 
    /* Keeps track of time since last pulse entered into queue. */
-   unsigned long           _LastEntryTime_usec;
+   uint64_t                _LastEntryTime_usec;
 
    /* Head points to the next available data. */
    uint16_t                _HeadIndex;
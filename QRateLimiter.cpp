@@ -0,0 +1,101 @@
+///////////////////////////////////////////////////////////////////////////////
+// :mode=c:
+/*  QRateLimiter.cpp
+*/
+///////////////////////////////////////////////////////////////////////////////
+#include "QRateLimiter.h"
+
+/**************************************************************************************/
+QRateLimiter::QRateLimiter()
+{
+   Init();
+
+} // QRateLimiter
+/**************************************************************************************/
+QRateLimiter::QRateLimiter(uint16_t Tokens, uint32_t PeriodMsec, uint16_t Burst)
+{
+   Init();
+   Set(Tokens, PeriodMsec, Burst);
+
+} // QRateLimiter
+/**************************************************************************************/
+void QRateLimiter::Init()
+{
+   _CostMsec= 0;
+   _CapacityMsec= 0;
+   _CreditMsec= 0;
+   _LastRefillMsec= 0;
+   _DroppedCnt= 0;
+   _DeferredCnt= 0;
+
+} // Init
+/**************************************************************************************/
+void QRateLimiter::Set(uint16_t Tokens, uint32_t PeriodMsec, uint16_t Burst)
+{
+   if (Tokens == 0)
+      _CostMsec= 0;
+   else
+   {
+      _CostMsec= PeriodMsec / Tokens;
+      if (_CostMsec == 0)
+         _CostMsec= 1;
+   }
+
+   if (Burst == 0)
+      Burst= 1;
+   _CapacityMsec= _CostMsec * Burst;
+   _CreditMsec= _CapacityMsec;
+   _LastRefillMsec= QTimestamp::GetTickMsec();
+
+} // Set
+/**************************************************************************************/
+void QRateLimiter::Refill()
+{
+   uint32_t NowMsec= QTimestamp::GetTickMsec();
+   uint32_t ElapsedMsec= NowMsec - _LastRefillMsec;
+   _LastRefillMsec= NowMsec;
+
+   if (ElapsedMsec >= (_CapacityMsec - _CreditMsec))
+      _CreditMsec= _CapacityMsec;
+   else
+      _CreditMsec+= ElapsedMsec;
+
+} // Refill
+/**************************************************************************************/
+bool QRateLimiter::TryAcquire()
+{
+   bool Result= true;
+
+   if (_CostMsec > 0)
+   {
+      Refill();
+      if (_CreditMsec >= _CostMsec)
+         _CreditMsec-= _CostMsec;
+      else
+         Result= false;
+   }
+
+   return Result;
+
+} // TryAcquire
+/**************************************************************************************/
+bool QRateLimiter::IsAvailable()
+{
+   return (GetWaitMsec() == 0);
+
+} // IsAvailable
+/**************************************************************************************/
+unsigned long QRateLimiter::GetWaitMsec()
+{
+   unsigned long Result= 0;
+
+   if (_CostMsec > 0)
+   {
+      Refill();
+      if (_CreditMsec < _CostMsec)
+         Result= _CostMsec - _CreditMsec;
+   }
+
+   return Result;
+
+} // GetWaitMsec
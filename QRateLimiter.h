@@ -0,0 +1,73 @@
+///////////////////////////////////////////////////////////////////////////////
+// :mode=c:
+/*  QRateLimiter.h                                                           */
+///////////////////////////////////////////////////////////////////////////////
+#ifndef QRateLimiter_h
+#define QRateLimiter_h
+#include "Arduino.h"
+#include "QTimer.h"
+
+/**************************************************************************************/
+/* QRateLimiter - token bucket, for throttling events such as publishes or connection
+   attempts. Allows Tokens events per PeriodMsec on average, with bursts of up to Burst
+   events after a quiet spell.
+
+   The bucket is kept as time credit in msec: each event costs PeriodMsec / Tokens, and
+   credit accrues with elapsed time up to Burst events' worth. Time is from
+   QTimestamp::GetTickMsec().
+
+   Usage:
+      if (Limiter.TryAcquire())
+         Publish(...);
+      else
+         Limiter.RecordDropped();      // or RecordDeferred() if the caller retries later
+*/
+/**************************************************************************************/
+class QRateLimiter
+{
+   ///////////////////////////////////////////////////////////
+   // Data
+   ///////////////////////////////////////////////////////////
+   protected:
+   uint32_t                _CostMsec;                 // Credit used per event, 0 if unlimited
+   uint32_t                _CapacityMsec;             // Max credit, i.e. burst
+   uint32_t                _CreditMsec;
+   uint32_t                _LastRefillMsec;
+
+   /* Instrumentation. */
+   uint32_t                _DroppedCnt;
+   uint32_t                _DeferredCnt;
+
+   ///////////////////////////////////////////////////////////
+   // Methods
+   ///////////////////////////////////////////////////////////
+   public:
+   /* Unlimited until Set(). */
+                           QRateLimiter();
+                           QRateLimiter(uint16_t Tokens, uint32_t PeriodMsec, uint16_t Burst);
+
+   /* Sets the rate. Bucket starts full. Tokens == 0 removes the limit. */
+   void                    Set(uint16_t Tokens, uint32_t PeriodMsec, uint16_t Burst);
+
+   /* Takes a token if one is available.
+      Returns: true if the event may proceed.   */
+   bool                    TryAcquire();
+
+   /* As TryAcquire(), without taking the token. */
+   bool                    IsAvailable();
+
+   /* Time until a token is available, 0 if available now. */
+   unsigned long           GetWaitMsec();
+
+   /* Caller's accounting of events refused by TryAcquire(). */
+   void                    RecordDropped(){_DroppedCnt++;}
+   void                    RecordDeferred(){_DeferredCnt++;}
+   unsigned long           GetDroppedCnt(){return _DroppedCnt;}
+   unsigned long           GetDeferredCnt(){return _DeferredCnt;}
+
+   protected:
+   void                    Init();
+   void                    Refill();
+};
+
+#endif
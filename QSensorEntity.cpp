@@ -28,6 +28,7 @@ void QSensorEntity::Init(int StaleTimeSec)
    _ValueFloat= 0;
    _StaleTimeSec= StaleTimeSec;
    _pStaleTimer= new QTimer(/*sec*/_StaleTimeSec * /*msec*/1000,/*Repeat*/false,/*Start*/false,/*Done*/true);
+   _pStaleTimer->SetName("Sensor.Stale");
 
 } // Init
 #ifdef _DEBUG_QSENSORENTITY
@@ -47,7 +48,7 @@ void QSensorEntity::Set(float Value)
    _pStaleTimer->Start();                             // Reset the stale timer.
    ASSERT_MSG(!IsStale(), "QSensorEntity::Set(): stale failure"); 
    #ifdef _DEBUG_QSENSORENTITY
-   _Trace.printf(TS_SERVICES, TLT_Max, "QSensorEntity::Set(): %s=%.2f", _pName, _ValueFloat);
+   QTRACE(TS_SERVICES, TLT_Max, "QSensorEntity::Set(): %s=%.2f", _pName, _ValueFloat);
    #endif
 
 } // Set
@@ -4,6 +4,7 @@
 ///////////////////////////////////////////////////////////////////////////////
 #include "QTemperature.h"
 #include "QTrace.h"
+#include "QProfile.h"
 //#include <wiring.h>                                   // analogRead()
 #include "Arduino.h"                                 // analogRead()
 
@@ -50,6 +51,8 @@ bool QTemperature::IsActive()
 /**************************************************************************************/
 void QTemperature::ReadTemperature()
 {
+   QPROFILE_SCOPE("Temperature.Read");
+
    if (_SensorType == TemperatureSensorT::TST_TMP36)
    {  // Analog Sensor
       /* Read the temperature.
@@ -71,7 +74,7 @@ void QTemperature::ReadTemperature()
       //if ((_TemperatureF >= 0) && (_TemperatureF <= 140)) 
       {
          #ifdef _DEBUG_TEMPERATURE
-         _Trace.printf(TRACE_SWITCH_LIB, TLT_Verbose, "Temperature (TMP36): %.1fC, %.1fF, Voltage:%.3f, ADC:%d", 
+         QTRACE(TRACE_SWITCH_LIB, TLT_Verbose, "Temperature (TMP36): %.1fC, %.1fF, Voltage:%.3f, ADC:%d", 
             _TemperatureC, _TemperatureF, Voltage, AnalogReading);
          #endif
       }
@@ -95,24 +98,24 @@ void QTemperature::ReadTemperature()
          bool GetAddressResult= _pDallasTemperature->getAddress(deviceAddress, /*deviceIndex*/0);
 
          /*
-         _Trace.printf(TRACE_SWITCH_LIB, TLT_Verbose, "#Devices: %d, GetAddress:%s",
+         QTRACE(TRACE_SWITCH_LIB, TLT_Verbose, "#Devices: %d, GetAddress:%s",
             I2CDeviceCnt,
             (GetAddressResult == true)?("Ok"):("Not Ok")
             );*/
-         _Trace.printf(TRACE_SWITCH_LIB, TLT_Verbose, "#Devices: %d, #TempSensors: %d",
+         QTRACE(TRACE_SWITCH_LIB, TLT_Verbose, "#Devices: %d, #TempSensors: %d",
             I2CDeviceCnt,
             TempSensorCnt
             );
 
          if (I2CDeviceCnt == 0)
          {
-            _Trace.printf(TRACE_SWITCH_LIB, TLT_Verbose, "QTemperature::ReadTemperature(): call begin()");
+            QTRACE(TRACE_SWITCH_LIB, TLT_Verbose, "QTemperature::ReadTemperature(): call begin()");
             _pDallasTemperature->begin();
             delay(/*msec*/2000);
          }          
       }
       else
-         _Trace.printf(TRACE_SWITCH_LIB, TLT_Verbose, "Temperature (I2C): %.1fF", _TemperatureF);
+         QTRACE(TRACE_SWITCH_LIB, TLT_Verbose, "Temperature (I2C): %.1fF", _TemperatureF);
       #endif
    }
 
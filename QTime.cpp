@@ -54,6 +54,7 @@ void QTime::Init()
       _pNTPClient= new NTPClient(_ntpUDP, "pool.ntp.org", /*TZ Offset (sec)*/_utcOffsetSeconds, /*update interval (msec)*/_NTPUpdateIntervalSec*1000);
       //_pWaitTimer= new QTimer(/*Sec*/60*/*Msec*/1000,/*Repeat*/false,/*Start*/true);
       _pOfflineTimer= new QTimer(/*Sec*/_NTPUpdateIntervalSec/*Msec*/*1000,/*Repeat*/false,/*Start*/false);
+      _pOfflineTimer->SetName("Time.Offline");
    
       #ifdef QTIME_OFFLINE
       _DayOfWeekOffline= random(/*min*/0, /*below max*/8); 
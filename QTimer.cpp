@@ -7,54 +7,141 @@
 #include "QTimer.h"
 #include "QTrace.h" 
 
+/* The 64 bit clocks are updated with interrupts blocked, so that a read from an ISR cannot
+   interleave the update. A host build, e.g. simulating on QVirtualClock, has no ISRs, so
+   needs neither the lock nor the IRAM placement. */
+#if defined(ESP8266)
+#define  QTIMESTAMP_LOCK()             uint32_t SavedPS= xt_rsil(15)
+#define  QTIMESTAMP_UNLOCK()           xt_wsr_ps(SavedPS)
+#else
+#define  QTIMESTAMP_LOCK()
+#define  QTIMESTAMP_UNLOCK()
+#ifndef ICACHE_RAM_ATTR
+#define  ICACHE_RAM_ATTR
+#endif
+#endif
+
 /**************************************************************************************/
 /* QTimestamp                                                                         */
 /**************************************************************************************/
-uint32_t                   QTimestamp::_PrevTimestamp= 0;
-int                        QTimestamp::_RolloverCnt= 0;
-#ifdef _DEBUG_QTIMESTAMP
-int                        QTimestamp::_RolledOver= -2;
+uint32_t                   QTimestamp::_MsecLow= 0;
+uint32_t                   QTimestamp::_MsecHigh= 0;
+uint32_t                   QTimestamp::_UsecLow= 0;
+uint32_t                   QTimestamp::_UsecHigh= 0;
+bool                       QTimestamp::_LoopTickActive= false;
+QTimestamp::Timestamp64Type QTimestamp::_LoopTickMsec= 0;
+QTimestamp::ClockSourceType QTimestamp::_pMsecSource= QTimestamp::ReadMillis;
+QTimestamp::ClockSourceType QTimestamp::_pUsecSource= QTimestamp::ReadMicros;
 
+#ifdef _DEBUG_QTIMESTAMP
 /**************************************************************************************/
 /*static*/ void QTimestamp::Test()
 {
    ASSERT_MSG(QTimestamp::Compare(0xFFFFFFF0UL,/*Reference*/0x00000008UL) < 0, "QTimestamp failure 1"); 
    ASSERT_MSG(QTimestamp::Compare(0x00000008UL,/*Reference*/0xFFFFFFF0UL) > 0, "QTimestamp failure 2"); 
+
+   /* 64 bit extension across the 32 bit wrap. */
+   uint32_t LowTime= 0xFFFFFFF0UL;
+   uint32_t HighTime= 0;
+   ASSERT_MSG(ExtendTimestamp(0xFFFFFFFFUL, LowTime, HighTime) == 0x0FFFFFFFFULL, "QTimestamp failure 3"); 
+   ASSERT_MSG(ExtendTimestamp(0x00000005UL, LowTime, HighTime) == 0x100000005ULL, "QTimestamp failure 4"); 
+   ASSERT_MSG(ExtendTimestamp(0x00000005UL, LowTime, HighTime) == 0x100000005ULL, "QTimestamp failure 5"); 
+   ASSERT_MSG(ExtendTimestamp(0x80000000UL, LowTime, HighTime) == 0x180000000ULL, "QTimestamp failure 6"); 
+   ASSERT_MSG(ExtendTimestamp(0x00000001UL, LowTime, HighTime) == 0x200000001ULL, "QTimestamp failure 7"); 
+
+   /* Live clocks on a virtual clock starting 10 minutes before the msec wrap. 150 minutes in
+      1 minute steps crosses the msec wrap once and the ~71.6 minute usec wrap at least twice. */
+   const uint32_t StepMsec= /*sec*/60 * /*msec*/1000;
+   const int StepCnt= 150;
+   QVirtualClock::Install((0xFFFFFFFFULL - (10 * StepMsec)) * /*usec*/1000);
+   Timestamp64Type StartMsec= GetNowTimeMsec64();
+   Timestamp64Type StartUsec= GetNowTimeUsec64();
+   for (int i= 0 ; i < StepCnt ; i++)
+   {
+      QVirtualClock::AdvanceMsec(StepMsec);
+      GetNowTimeMsec64();
+      GetNowTimeUsec64();
+   }
+   ASSERT_MSG((GetNowTimeMsec64() - StartMsec) == ((Timestamp64Type) StepCnt * StepMsec), "QTimestamp failure 8"); 
+   ASSERT_MSG((GetNowTimeUsec64() - StartUsec) == ((Timestamp64Type) StepCnt * StepMsec * /*usec*/1000), "QTimestamp failure 9"); 
+   ASSERT_MSG((GetNowTimeMsec64() >> 32) == 1, "QTimestamp failure 10"); 
+   ASSERT_MSG((GetNowTimeUsec64() >> 32) >= 2, "QTimestamp failure 11"); 
+   ASSERT_MSG((uint32_t) GetNowTimeMsec64() == GetNowTimeMsec(), "QTimestamp failure 12"); 
+   QVirtualClock::Uninstall();
 }
 #endif
 /**************************************************************************************/
-/*static */ uint32_t QTimestamp::GetNowTimeMsec()
+/*static*/ ICACHE_RAM_ATTR uint32_t QTimestamp::ReadMillis()
 {
-   unsigned long Result= millis();
-
-   #ifdef _DEBUG_QTIMESTAMP
-   /* Rollover testing - start millis off with a high offset, N minutes from rollover. */
-   unsigned long OffsetMsec= (/*min*/10 */*sec*/60 * /*msec*/1000);
-   unsigned long MaxTimeMsec= 0xFFFFFFFFUL;
-   unsigned long StartTimeMsec= (MaxTimeMsec - OffsetMsec);
-   Result= StartTimeMsec + millis();
+   return millis();
+} // ReadMillis
+/**************************************************************************************/
+/*static*/ ICACHE_RAM_ATTR uint32_t QTimestamp::ReadMicros()
+{
+   return micros();
+} // ReadMicros
+/**************************************************************************************/
+/*static*/ void QTimestamp::SetClockSource(ClockSourceType pMsecSource, ClockSourceType pUsecSource)
+{
+   QTIMESTAMP_LOCK();
+   _pMsecSource= (pMsecSource != NULL)?(pMsecSource):(ReadMillis);
+   _pUsecSource= (pUsecSource != NULL)?(pUsecSource):(ReadMicros);
+   _MsecLow= _MsecHigh= 0;
+   _UsecLow= _UsecHigh= 0;
+   _LoopTickActive= false;
+   QTIMESTAMP_UNLOCK();
 
-   if ((_RolledOver < 0) && (Result < StartTimeMsec))
-   {  // Rollover
-      _Trace.printf(TLT_Verbose, "QTimestamp::GetNowTimeMsec(): Rollover %08lx", Result);
-      _RolledOver++;
-   }
-   else if ((_RolledOver < -1) && (millis() > (/*min*/1 */*sec*/60 * /*msec*/1000)))
+} // SetClockSource
+/**************************************************************************************/
+/*static*/ ICACHE_RAM_ATTR QTimestamp::Timestamp64Type QTimestamp::ExtendTimestamp(uint32_t NowTime, uint32_t & LowTime, uint32_t & HighTime)
+{
+   if (NowTime < LowTime)
    {  // Rollover
-      Test();
-      _Trace.printf(TLT_Verbose, "QTimestamp::GetNowTimeMsec(): Result %08lx", Result);
-      _RolledOver++;
+      HighTime++;
    }
-   #endif
+   LowTime= NowTime;
 
-   if (Result < _PrevTimestamp)
-   {  // Rollover
-      _RolloverCnt++;
-   }
-   _PrevTimestamp= Result;
+   return (((Timestamp64Type) HighTime) << 32) | NowTime;
+
+} // ExtendTimestamp
+/**************************************************************************************/
+/*static*/ ICACHE_RAM_ATTR QTimestamp::Timestamp64Type QTimestamp::GetNowTimeMsec64()
+{
+   QTIMESTAMP_LOCK();
+   uint32_t NowMsec= _pMsecSource();
+   Timestamp64Type Result= ExtendTimestamp(NowMsec, _MsecLow, _MsecHigh);
+   QTIMESTAMP_UNLOCK();
 
    return Result;
 
+} // GetNowTimeMsec64
+/**************************************************************************************/
+/*static*/ ICACHE_RAM_ATTR QTimestamp::Timestamp64Type QTimestamp::GetNowTimeUsec64()
+{
+   QTIMESTAMP_LOCK();
+   uint32_t NowUsec= _pUsecSource();
+   Timestamp64Type Result= ExtendTimestamp(NowUsec, _UsecLow, _UsecHigh);
+   QTIMESTAMP_UNLOCK();
+
+   return Result;
+
+} // GetNowTimeUsec64
+/**************************************************************************************/
+/*static*/ QTimestamp::TimestampType QTimestamp::BeginLoopTick()
+{
+   _LoopTickMsec= GetNowTimeMsec64();
+   _LoopTickActive= true;
+
+   return (TimestampType) _LoopTickMsec;
+
+} // BeginLoopTick
+/**************************************************************************************/
+/*static */ uint32_t QTimestamp::GetNowTimeMsec()
+/* Read straight from the source, so that timer polls do not block interrupts. The 64 bit
+   clock is extended by its own readers, e.g. BeginLoopTick() once per pass. */
+{
+   return _pMsecSource();
+
 } // GetNowTimeMsec
 /**************************************************************************************/
 /*static*/ int QTimestamp::Compare(uint32_t Timestamp, uint32_t Reference)
@@ -64,7 +151,7 @@ int                        QTimestamp::_RolledOver= -2;
    if (Timestamp != Reference)
    {
       /*  32 bits, rolls over after ~49.7 days. See http://playground.arduino.cc/Code/TimingRollover  */
-      if ((long) (Timestamp - Reference) >= 0)
+      if ((int32_t) (Timestamp - Reference) >= 0)
          Result= 1;
       else
          Result= -1;
@@ -90,16 +177,353 @@ int                        QTimestamp::_RolledOver= -2;
 /**************************************************************************************/
 /*static*/ float QTimestamp::GetUptimeDays()
 {
-   float UptimeDays= _RolloverCnt * (((float) _MaxTimestampMsec) / (float) _MsecPerDay);
-   UptimeDays+= ((float) GetNowTimeMsec()) / (float) _MsecPerDay;
+   uint32_t UptimeSec= GetNowTimeMsec64() / /*msec*/1000;
+   float UptimeDays= ((float) UptimeSec) / (float) _SecPerDay;
    return UptimeDays;
 
 } // GetUptimeDays
 
+/**************************************************************************************/
+/* QVirtualClock                                                                      */
+/**************************************************************************************/
+uint64_t                   QVirtualClock::_NowUsec= 0;
+
+/**************************************************************************************/
+/*static*/ void QVirtualClock::Install(uint64_t StartUsec)
+{
+   _NowUsec= StartUsec;
+   QTimestamp::SetClockSource(ReadMsec, ReadUsec);
+
+} // Install
+/**************************************************************************************/
+/*static*/ void QVirtualClock::Uninstall()
+{
+   QTimestamp::SetClockSource(NULL, NULL);
+
+} // Uninstall
+
+
+#ifdef ENB_QTIMER_WHEEL
+/**************************************************************************************/
+/* QTimerWheel                                                                        */
+/**************************************************************************************/
+bool                       QTimerWheel::_Initialized= false;
+uint32_t                   QTimerWheel::_CurTick= 0;
+QTimer *                   QTimerWheel::_pSlots[QTimerWheel::_LevelCnt][QTimerWheel::_SlotCnt];
+uint64_t                   QTimerWheel::_Occupied[QTimerWheel::_LevelCnt];
+unsigned long              QTimerWheel::_ScheduledCnt= 0;
+
+/**************************************************************************************/
+/*static*/ void QTimerWheel::DoService()
+/* Moves the wheel forward to now. Steps directly to the next occupied level 0 slot or the
+   next level 0 wrap, whichever comes first, so a long gap between calls costs one step per
+   64 msec rather than one per msec.  */
+{
+   uint32_t NowTick= QTimestamp::GetTickMsec();
+   if (!_Initialized)
+   {
+      _CurTick= NowTick;
+      _Initialized= true;
+   }
+
+   while (_CurTick != NowTick)
+   {
+      uint32_t Slot= _CurTick & _SlotMask;
+      uint32_t ToWrap= _SlotCnt - Slot;
+      uint32_t ToNow= NowTick - _CurTick;
+
+      /* Occupied level 0 slots after the current one. */
+      uint64_t Pending= (Slot == _SlotMask)?(0):(_Occupied[0] & (~0ULL << (Slot + 1)));
+      if (Pending != 0)
+      {
+         uint32_t Step= __builtin_ctzll(Pending) - Slot;
+         if (Step <= ToNow)
+         {
+            _CurTick+= Step;
+            ExpireSlot(_CurTick & _SlotMask);
+            continue;
+         }
+      }
+
+      if (ToWrap <= ToNow)
+      {  /* Level 0 wraps. Refile the next block of timers from the upper levels, then expire
+            anything due at exactly this tick. */
+         _CurTick+= ToWrap;
+         Cascade();
+         ExpireSlot(0);
+      }
+      else
+         _CurTick= NowTick;
+   }
+
+} // DoService
+/**************************************************************************************/
+/*static*/ void QTimerWheel::Schedule(QTimer * pTimer)
+{
+   if (!_Initialized)
+   {
+      _CurTick= QTimestamp::GetTickMsec();
+      _Initialized= true;
+   }
+
+   Remove(pTimer);
+   pTimer->_Expired= false;
+   Insert(pTimer);
+
+} // Schedule
+/**************************************************************************************/
+/*static*/ unsigned long QTimerWheel::GetNextExpiryMsec()
+{
+   unsigned long Result= QTimer::_NoExpiryMsec;
+   uint32_t MinDelta= 0xFFFFFFFFUL;
+
+   for (int Level= 0 ; Level < _LevelCnt ; Level++)
+   {
+      if (_Occupied[Level] != 0)
+      {  /* Level 0 slots expire at their tick. Upper level slots cascade once the wheel
+            reaches the start of their span.  */
+         int Shift= _LevelBits * Level;
+         uint32_t Slot= (_CurTick >> Shift) & _SlotMask;
+         uint32_t EventTick= ((_CurTick >> Shift) + NextSlotDistance(_Occupied[Level], Slot)) << Shift;
+         uint32_t Delta= EventTick - _CurTick;
+         if (Delta < MinDelta)
+            MinDelta= Delta;
+      }
+   }
+
+   if (MinDelta != 0xFFFFFFFFUL)
+   {
+      uint32_t EventTick= _CurTick + MinDelta;
+      uint32_t NowMsec= QTimestamp::GetNowTimeMsec();
+      Result= (QTimestamp::Compare(EventTick, NowMsec) > 0)?(EventTick - NowMsec):(0);
+   }
+
+   return Result;
+
+} // GetNextExpiryMsec
+/**************************************************************************************/
+/*static*/ int QTimerWheel::NextSlotDistance(uint64_t Occupied, uint32_t Slot)
+/* Distance, 1.._SlotCnt, from Slot to the next occupied slot in wheel order. Occupied must be
+   non-zero.   */
+{
+   uint64_t Rotated= (Slot == _SlotMask)?(Occupied):((Occupied >> (Slot + 1)) | (Occupied << (_SlotMask - Slot)));
+   return __builtin_ctzll(Rotated) + 1;
+
+} // NextSlotDistance
+/**************************************************************************************/
+/*static*/ void QTimerWheel::Insert(QTimer * pTimer)
+/* Files the timer in the level whose span covers the time remaining to its deadline. The
+   slot is taken from the deadline bits for that level. Deadlines at or before the wheel
+   position expire immediately.   */
+{
+   uint32_t Deadline= pTimer->GetDeadlineMsec();
+   if (pTimer->_SlackMsec > 0)
+   {  /* Round up within the slack to the largest power of 2 boundary that fits. */
+      uint32_t Granularity= 1UL << (31 - __builtin_clz(pTimer->_SlackMsec + 1));
+      Deadline= (Deadline + pTimer->_SlackMsec) & ~(Granularity - 1);
+   }
+
+   uint32_t Delta= Deadline - _CurTick;
+   if ((int32_t) Delta <= 0)
+   {
+      pTimer->_Expired= true;
+      return;
+   }
+
+   int Level= 0;
+   while ((Level < _LevelCnt - 1) && (Delta >= (1UL << (_LevelBits * (Level + 1)))))
+      Level++;
+
+   int Shift= _LevelBits * Level;
+   uint32_t Slot;
+   if ((Level == _LevelCnt - 1) && (Delta >= (1UL << (_LevelBits * _LevelCnt))))
+      Slot= ((_CurTick >> Shift) + _SlotMask) & _SlotMask;    // Beyond range, park in the last slot
+   else
+      Slot= (Deadline >> Shift) & _SlotMask;
+
+   QTimer * pHead= _pSlots[Level][Slot];
+   pTimer->_pWheelPrev= NULL;
+   pTimer->_pWheelNext= pHead;
+   if (pHead != NULL)
+      pHead->_pWheelPrev= pTimer;
+   _pSlots[Level][Slot]= pTimer;
+   _Occupied[Level]|= (1ULL << Slot);
+
+   pTimer->_WheelLevel= Level;
+   pTimer->_WheelSlot= Slot;
+   _ScheduledCnt++;
+
+} // Insert
+/**************************************************************************************/
+/*static*/ void QTimerWheel::Remove(QTimer * pTimer)
+{
+   if (pTimer->_WheelLevel >= 0)
+   {
+      int Level= pTimer->_WheelLevel;
+      int Slot= pTimer->_WheelSlot;
+      if (pTimer->_pWheelPrev != NULL)
+         pTimer->_pWheelPrev->_pWheelNext= pTimer->_pWheelNext;
+      else
+         _pSlots[Level][Slot]= pTimer->_pWheelNext;
+      if (pTimer->_pWheelNext != NULL)
+         pTimer->_pWheelNext->_pWheelPrev= pTimer->_pWheelPrev;
+
+      if (_pSlots[Level][Slot] == NULL)
+         _Occupied[Level]&= ~(1ULL << Slot);
+
+      pTimer->_pWheelNext= pTimer->_pWheelPrev= NULL;
+      pTimer->_WheelLevel= -1;
+      _ScheduledCnt--;
+   }
+
+} // Remove
+/**************************************************************************************/
+/*static*/ void QTimerWheel::Cascade()
+/* Called as level 0 wraps. Refiles the current slot of level 1 into the lower level, and so
+   on up the levels for as long as each one wraps too.   */
+{
+   for (int Level= 1 ; Level < _LevelCnt ; Level++)
+   {
+      uint32_t Slot= (_CurTick >> (_LevelBits * Level)) & _SlotMask;
+      QTimer * pTimer= _pSlots[Level][Slot];
+      _pSlots[Level][Slot]= NULL;
+      _Occupied[Level]&= ~(1ULL << Slot);
+
+      while (pTimer != NULL)
+      {
+         QTimer * pNext= pTimer->_pWheelNext;
+         pTimer->_WheelLevel= -1;
+         _ScheduledCnt--;
+         Insert(pTimer);
+         pTimer= pNext;
+      }
+
+      if (Slot != 0)
+         break;
+   }
+
+} // Cascade
+/**************************************************************************************/
+/*static*/ void QTimerWheel::ExpireSlot(int Slot)
+{
+   QTimer * pTimer= _pSlots[0][Slot];
+   _pSlots[0][Slot]= NULL;
+   _Occupied[0]&= ~(1ULL << Slot);
+
+   while (pTimer != NULL)
+   {
+      QTimer * pNext= pTimer->_pWheelNext;
+      pTimer->_pWheelNext= pTimer->_pWheelPrev= NULL;
+      pTimer->_WheelLevel= -1;
+      pTimer->_Expired= true;
+      _ScheduledCnt--;
+      pTimer= pNext;
+   }
+
+} // ExpireSlot
+#endif
+
 
 /**************************************************************************************/
 /* QTimer                                                                             */
 /**************************************************************************************/
+QTimer *                   QTimer::_pFirstTimer= NULL;
+void *                     QTimer::_pPoolFree= NULL;
+uint16_t                   QTimer::_PoolUsedCnt= 0;
+uint16_t                   QTimer::_PoolHighWaterCnt= 0;
+uint16_t                   QTimer::_PoolHeapCnt= 0;
+char                       QTimer::_StsBfr[QTimer::_DumpBfrLen+1];
+
+/* Pool slots. A free slot holds the link to the next free slot, else a QTimer. */
+union QTimerPoolSlot
+{
+   QTimerPoolSlot *        pNextFree;
+   alignas(QTimer) uint8_t Timer[sizeof(QTimer)];
+};
+static QTimerPoolSlot      _PoolSlots[QTIMER_POOL_SIZE];
+static bool                _PoolInitialized= false;
+
+/**************************************************************************************/
+/*static*/ unsigned long QTimer::GetNextExpiryMsec(unsigned long PassStartMsec)
+{
+   unsigned long Result= QTimer64::GetNextExpiryMsec(PassStartMsec);
+
+   #ifdef ENB_QTIMER_WHEEL
+   unsigned long WheelMsec= QTimerWheel::GetNextExpiryMsec();
+   if (WheelMsec < Result)
+      Result= WheelMsec;
+   #else
+   uint32_t NowMsec= QTimestamp::GetNowTimeMsec();
+
+   for (QTimer * pTimer= _pFirstTimer ; pTimer != NULL ; pTimer= pTimer->_pNextTimer)
+   {
+      if (pTimer->_State == TimerStateT::TST_Enabled)
+      {
+         uint32_t DeadlineMsec= pTimer->GetDeadlineMsec();
+         if (QTimestamp::Compare(DeadlineMsec, /*Reference*/PassStartMsec) > 0)
+         {  /* Due after the pass started. Wake at the end of its slack window, by which time
+               any other timer with a deadline inside the window is also due. */
+            uint32_t WakeMsec= DeadlineMsec + pTimer->_SlackMsec;
+            uint32_t Msec= (QTimestamp::Compare(WakeMsec, NowMsec) > 0)?(WakeMsec - NowMsec):(0);
+            if (Msec < Result)
+               Result= Msec;
+            if (Result == 0)
+               break;
+         }
+      }
+   }
+   #endif
+
+   return Result;
+
+} // GetNextExpiryMsec
+/**************************************************************************************/
+/*static*/ void * QTimer::operator new(size_t Size)
+{
+   if (!_PoolInitialized)
+   {  /* Chain all slots onto the free list. */
+      for (int i= QTIMER_POOL_SIZE - 1 ; i >= 0 ; i--)
+      {
+         _PoolSlots[i].pNextFree= (QTimerPoolSlot *) _pPoolFree;
+         _pPoolFree= &_PoolSlots[i];
+      }
+      _PoolInitialized= true;
+   }
+
+   void * pResult;
+   if ((_pPoolFree != NULL) && (Size <= sizeof(_PoolSlots[0])))
+   {
+      pResult= _pPoolFree;
+      _pPoolFree= ((QTimerPoolSlot *) pResult)->pNextFree;
+      _PoolUsedCnt++;
+      if (_PoolUsedCnt > _PoolHighWaterCnt)
+         _PoolHighWaterCnt= _PoolUsedCnt;
+   }
+   else
+   {  /* Pool exhausted, or a larger derived class. */
+      pResult= ::operator new(Size);
+      if (_PoolHeapCnt < 0xFFFF)
+         _PoolHeapCnt++;
+   }
+
+   return pResult;
+
+} // operator new
+/**************************************************************************************/
+/*static*/ void QTimer::operator delete(void * pTimer)
+{
+   uint8_t * pByte= (uint8_t *) pTimer;
+   if ((pByte >= (uint8_t *) _PoolSlots) && (pByte < (uint8_t *) (_PoolSlots + QTIMER_POOL_SIZE)))
+   {
+      ((QTimerPoolSlot *) pTimer)->pNextFree= (QTimerPoolSlot *) _pPoolFree;
+      _pPoolFree= pTimer;
+      _PoolUsedCnt--;
+   }
+   else
+      ::operator delete(pTimer);
+
+} // operator delete
+/**************************************************************************************/
 QTimer::QTimer()
 {
    Init();
@@ -128,19 +552,55 @@ QTimer::QTimer(unsigned long DurationMsec, bool StartTimer)
    
 } // QTimer
 /**************************************************************************************/
+QTimer::~QTimer()
+{
+   #ifdef ENB_QTIMER_WHEEL
+   QTimerWheel::Remove(this);
+   #endif
+
+   /* Unlink from the registry. */
+   QTimer ** ppTimer= &_pFirstTimer;
+   while ((*ppTimer != NULL) && (*ppTimer != this))
+      ppTimer= &(*ppTimer)->_pNextTimer;
+   if (*ppTimer != NULL)
+      *ppTimer= _pNextTimer;
+
+} // ~QTimer
+/**************************************************************************************/
 void QTimer::Init()
 {
    _State= TimerStateT::TST_Disabled;
-   _StartTimeMsec= 0;
+   _DeadlineMsec= 0;
    _Repeat= false;
-   _RemainingTimeMsec= 0;
+   _RepeatMode= RepeatModeT::RMT_Restart;
+   _CatchupPolicy= CatchupPolicyT::CPT_SkipMissed;
+   _MissedCnt= 0;
+   _SlackMsec= 0;
    SetDuration(/*msec*/1000);
 
+   /* Add to the registry. */
+   _pNextTimer= _pFirstTimer;
+   _pFirstTimer= this;
+
+   #ifdef ENB_QTIMER_WHEEL
+   _Expired= false;
+   _WheelLevel= -1;
+   _WheelSlot= 0;
+   _pWheelNext= _pWheelPrev= NULL;
+   #endif
+
+   #ifdef ENB_QTIMER_STATS
+   _pName= NULL;
+   _FireCnt= 0;
+   _LateTotalMsec= 0;
+   _LateMaxMsec= 0;
+   #endif
+
 } // Init 
 /**************************************************************************************/
 void QTimer::SetDuration(unsigned long DurationMsec)
 {
-   _MasterDurationMsec= _CurDurationMsec= DurationMsec;
+   _PeriodMsec= DurationMsec;
 
 } // SetDuration 
 /**************************************************************************************/
@@ -161,15 +621,31 @@ void QTimer::Set(unsigned long DurationMsec, bool Repeat, bool StartTimer)
 void QTimer::Disable()
 {
    _State= TimerStateT::TST_Disabled;
+   #ifdef ENB_QTIMER_WHEEL
+   QTimerWheel::Remove(this);
+   #endif
 } // Disable 
 /**************************************************************************************/
 void QTimer::Start()
-/* Starts/restarts the timer with the value existing in _CurDurationMsec. */
+/* Starts/restarts the timer for a full period. */
 {
-   _StartTimeMsec= QTimestamp::GetNowTimeMsec();
-   _State= TimerStateT::TST_Enabled;
+   Arm(QTimestamp::GetTickMsec() + _PeriodMsec);
 } // Start 
 /**************************************************************************************/
+void QTimer::StartDelayed(unsigned long DelayMsec)
+{
+   Arm(QTimestamp::GetTickMsec() + DelayMsec);
+} // StartDelayed 
+/**************************************************************************************/
+void QTimer::Arm(unsigned long DeadlineMsec)
+{
+   _DeadlineMsec= DeadlineMsec;
+   _State= TimerStateT::TST_Enabled;
+   #ifdef ENB_QTIMER_WHEEL
+   QTimerWheel::Schedule(this);
+   #endif
+} // Arm 
+/**************************************************************************************/
 void QTimer::Start(unsigned long DurationMsec)
 {
    SetDuration(DurationMsec);
@@ -180,20 +656,19 @@ void QTimer::Start(unsigned long DurationMsec)
 void QTimer::Pause()
 {
    /* Note the remaining time left for later resume. */
-   _RemainingTimeMsec= RemainingTimeMsec();
+   _DeadlineMsec= RemainingTimeMsec();
    _State= TimerStateT::TST_Paused;
+   #ifdef ENB_QTIMER_WHEEL
+   QTimerWheel::Remove(this);
+   #endif
 } // Pause 
 /**************************************************************************************/
 void QTimer::Resume()
 {
    if (_State == TimerStateT::TST_Paused)
-   {
-      _CurDurationMsec= _RemainingTimeMsec;
-      Start();
-   }
+      Arm(QTimestamp::GetTickMsec() + _DeadlineMsec);
    else if (_State == TimerStateT::TST_Disabled)
    {  // Timer was never paused, starting from Stopped state.
-      _CurDurationMsec= _MasterDurationMsec;
       Start();
    }
    // else - enabled, not Paused, ignore Resume
@@ -206,6 +681,9 @@ void QTimer::Cancel()
       || (_State == TimerStateT::TST_Paused))
    {  // Force it to Done state
       _State= TimerStateT::TST_Done;
+      #ifdef ENB_QTIMER_WHEEL
+      QTimerWheel::Remove(this);
+      #endif
    }
 
 } // Cancel 
@@ -213,7 +691,6 @@ void QTimer::Cancel()
 void QTimer::Stop()
 {
    Disable();
-   SetDuration(_MasterDurationMsec);           
 } // Stop 
 /**************************************************************************************/
 void QTimer::SetRepeat(bool Flag)
@@ -221,14 +698,69 @@ void QTimer::SetRepeat(bool Flag)
    _Repeat= Flag;
 } // SetRepeat 
 /**************************************************************************************/
+void QTimer::SetRepeatMode(RepeatModeT Mode, CatchupPolicyT Policy)
+{
+   _RepeatMode= Mode;
+   _CatchupPolicy= Policy;
+} // SetRepeatMode 
+/**************************************************************************************/
+void QTimer::AddMissed(unsigned long MissedCnt)
+{
+   unsigned long Total= _MissedCnt + MissedCnt;
+   _MissedCnt= (Total > 0xFFFF)?(0xFFFF):(Total);
+
+} // AddMissed 
+/**************************************************************************************/
+void QTimer::Repeat()
+/* Restarts a repeating timer that has just been observed Done while running. */
+{
+   if (_RepeatMode != RepeatModeT::RMT_PhaseLocked)
+   {
+      Start();
+      return;
+   }
+
+   /* Phase locked. Work out how many further periods have passed since the deadline. */
+   uint32_t PeriodMsec= _PeriodMsec;
+   uint32_t NowMsec= QTimestamp::GetTickMsec();
+   uint32_t DeadlineMsec= GetDeadlineMsec();
+   uint32_t LateMsec= (QTimestamp::Compare(NowMsec, DeadlineMsec) > 0)?(NowMsec - DeadlineMsec):(0);
+   uint32_t MissedCnt= (PeriodMsec > 0)?(LateMsec / PeriodMsec):(0);
+
+   switch (_CatchupPolicy)
+   {
+      case CatchupPolicyT::CPT_FireAll:
+      {  /* Next deadline is one period on, even if already passed. Each late period counts once. */
+         if (MissedCnt > 0)
+            AddMissed(1);
+         Arm(DeadlineMsec + PeriodMsec);
+         break;
+      }
+      case CatchupPolicyT::CPT_FireOnce:
+      {  /* Phase is kept while on time. Once a whole period is missed, restart from now. */
+         AddMissed(MissedCnt);
+         Arm(((MissedCnt > 0)?(NowMsec):(DeadlineMsec)) + PeriodMsec);
+         break;
+      }
+      default:
+      case CatchupPolicyT::CPT_SkipMissed:
+      {
+         AddMissed(MissedCnt);
+         Arm(DeadlineMsec + ((MissedCnt + 1) * PeriodMsec));
+         break;
+      }
+   }
+
+} // Repeat 
+/**************************************************************************************/
 unsigned long QTimer::ElapsedTimeMsec()
 {
    unsigned long Result= 0;
    if (_State == TimerStateT::TST_Enabled)
-      Result= QTimestamp::GetNowTimeMsec() - _StartTimeMsec;
+      Result= QTimestamp::GetTickMsec() - (_DeadlineMsec - _PeriodMsec);
    else if (_State == TimerStateT::TST_Paused)
    {
-      Result= _MasterDurationMsec - _RemainingTimeMsec;
+      Result= _PeriodMsec - _DeadlineMsec;
    }
 
    return Result;
@@ -239,12 +771,9 @@ unsigned long QTimer::RemainingTimeMsec()
 {
    unsigned long Result= 0;
    if (_State == TimerStateT::TST_Enabled)
-   {
-      unsigned long EndTimeMsec= _StartTimeMsec + _CurDurationMsec;  // may rollover
-      Result= EndTimeMsec - QTimestamp::GetNowTimeMsec();
-   }
+      Result= _DeadlineMsec - QTimestamp::GetTickMsec();   // may rollover
    else if (_State == TimerStateT::TST_Paused)
-      Result= _RemainingTimeMsec;
+      Result= _DeadlineMsec;
 
    return Result;
    
@@ -255,19 +784,18 @@ bool QTimer::IsDone()
    bool Done= false; 
    if (_State == TimerStateT::TST_Enabled)
    {
-      if (_StartTimeMsec == 0)
-         Done= true;                               // Initial timer activation  LOSE THIS
-      else
-      {
-         unsigned long EndTimeMsec= _StartTimeMsec + _CurDurationMsec;  // may rollover
-         if (QTimestamp::Compare(QTimestamp::GetNowTimeMsec(), /*Reference*/EndTimeMsec) >= 0)
-            Done= true;
-      }
+      #ifdef ENB_QTIMER_WHEEL
+      Done= _Expired;                              // Set by QTimerWheel::DoService()
+      #else
+      if (QTimestamp::Compare(QTimestamp::GetTickMsec(), /*Reference*/_DeadlineMsec) >= 0)
+         Done= true;
+      #endif
 
       if (Done)
       {  // Timer is done, restart it if in repeat mode, else disable.
+         RecordFire(/*OnDeadline*/true);
          if (_Repeat)
-            Start(_MasterDurationMsec);
+            Repeat();
          else
            _State= TimerStateT::TST_Done;             // Non-repetitive timers move to a done state 
       }
@@ -275,17 +803,219 @@ bool QTimer::IsDone()
    else if (_State == TimerStateT::TST_Done)
    {  /* Timer is one of: initialized in Done state, non-repetitive and Done, or Cancelled. */
       Done= true;
+      RecordFire(/*OnDeadline*/false);
       if (_Repeat)
-         Start(_MasterDurationMsec);
+         Start();
    }
    return Done;
    
 } // IsDone
+#ifdef _DEBUG_QTIMER
+/**************************************************************************************/
+/*static*/ void QTimer::Benchmark(int TimerCnt, int PassCnt)
+/* Periods are spread over 10 msec..10 sec, so that some timers fire during the run. The
+   1 msec delay per pass, outside the measured time, lets the clock move and the system run. */
+{
+   QTimer ** ppTimers= new QTimer * [TimerCnt];
+   for (int i= 0 ; i < TimerCnt ; i++)
+      ppTimers[i]= new QTimer(/*msec*/10 + ((i * 7919UL) % 10000), /*Repeat*/true, /*Start*/true);
+
+   uint32_t TotalUsec= 0;
+   uint32_t MaxUsec= 0;
+   uint32_t FireCnt= 0;
+   for (int Pass= 0 ; Pass < PassCnt ; Pass++)
+   {
+      delay(1);
+      uint32_t StartUsec= micros();
+      QTimestamp::BeginLoopTick();
+      #ifdef ENB_QTIMER_WHEEL
+      QTimerWheel::DoService();
+      #endif
+      for (int i= 0 ; i < TimerCnt ; i++)
+      {
+         if (ppTimers[i]->IsDone())
+            FireCnt++;
+      }
+      QTimestamp::EndLoopTick();
+      uint32_t PassUsec= micros() - StartUsec;
+      TotalUsec+= PassUsec;
+      if (PassUsec > MaxUsec)
+         MaxUsec= PassUsec;
+   }
+
+   for (int i= 0 ; i < TimerCnt ; i++)
+      delete ppTimers[i];
+   delete [] ppTimers;
+
+   #ifdef ENB_QTIMER_WHEEL
+   const char * pMode= "wheel";
+   #else
+   const char * pMode= "list";
+   #endif
+   _Trace.printf(TS_SERVICES, TLT_Info, "QTimer::Benchmark(): %d timers (%s), %d passes, usec/pass avg:%lu max:%lu, fired:%lu",
+      TimerCnt, pMode, PassCnt, (unsigned long) (TotalUsec / PassCnt), (unsigned long) MaxUsec, (unsigned long) FireCnt);
+
+} // Benchmark
+/**************************************************************************************/
+/*static*/ void QTimer::Benchmark()
+{
+   Benchmark(/*Timers*/8, /*Passes*/1000);
+   Benchmark(/*Timers*/64, /*Passes*/1000);
+   #ifndef ESP8266
+   Benchmark(/*Timers*/1024, /*Passes*/1000);
+   #endif
+
+} // Benchmark
+#endif
+/**************************************************************************************/
+void QTimer::RecordFire(bool OnDeadline)
+/* OnDeadline - fired by reaching the deadline, rather than from the Done state. */
+{
+   #ifdef ENB_QTIMER_STATS
+   _FireCnt++;
+   if (OnDeadline)
+   {
+      uint32_t NowMsec= QTimestamp::GetTickMsec();
+      uint32_t LateMsec= (QTimestamp::Compare(NowMsec, _DeadlineMsec) > 0)?(NowMsec - _DeadlineMsec):(0);
+      _LateTotalMsec+= LateMsec;
+      if (LateMsec > _LateMaxMsec)
+         _LateMaxMsec= (LateMsec > 0xFFFF)?(0xFFFF):(LateMsec);
+   }
+   #endif
+
+} // RecordFire
+/**************************************************************************************/
+const char * QTimer::Dump()
+{
+   unsigned long RemainingMsec= (_State == TimerStateT::TST_Done)?(0):(RemainingTimeMsec());
+   #ifdef ENB_QTIMER_STATS
+   snprintf(_StsBfr, _DumpBfrLen, "QTimer %s: Period:%lu, Remaining:%lu, Fires:%lu, Late avg/max:%lu/%u, Missed:%u", 
+      (_pName != NULL)?(_pName):("?"),
+      (unsigned long) _PeriodMsec, RemainingMsec,
+      (unsigned long) _FireCnt, 
+      (unsigned long) ((_FireCnt > 0)?(_LateTotalMsec / _FireCnt):(0)), _LateMaxMsec,
+      _MissedCnt);
+   #else
+   snprintf(_StsBfr, _DumpBfrLen, "QTimer: Period:%lu, Remaining:%lu, Missed:%u", 
+      (unsigned long) _PeriodMsec, RemainingMsec, _MissedCnt);
+   #endif
+   return _StsBfr;
+
+} // Dump
+/**************************************************************************************/
+/*static*/ void QTimer::TraceAll(uint8_t TraceSwitchId, TraceLevelType TraceLevel)
+{
+   for (QTimer * pTimer= _pFirstTimer ; pTimer != NULL ; pTimer= pTimer->_pNextTimer)
+      _Trace.printf(TraceSwitchId, TraceLevel, F("%s"), pTimer->Dump());
+
+} // TraceAll
+/**************************************************************************************/
+/* QTimer64                                                                           */
+/**************************************************************************************/
+QTimer64 *                 QTimer64::_pFirstTimer= NULL;
+
+/**************************************************************************************/
+/*static*/ unsigned long QTimer64::GetNextExpiryMsec(unsigned long PassStartMsec)
+{
+   unsigned long Result= QTimer::_NoExpiryMsec;
+   uint64_t NowMsec= QTimestamp::GetNowTimeMsec64();
+   uint64_t PassStartMsec64= NowMsec - (uint32_t) (((uint32_t) NowMsec) - PassStartMsec);
+
+   for (QTimer64 * pTimer= _pFirstTimer ; pTimer != NULL ; pTimer= pTimer->_pNextTimer)
+   {
+      if (pTimer->_Running && (pTimer->_DeadlineMsec > PassStartMsec64))
+      {
+         uint64_t Msec= (pTimer->_DeadlineMsec > NowMsec)?(pTimer->_DeadlineMsec - NowMsec):(0);
+         if (Msec < Result)
+            Result= Msec;
+      }
+   }
+
+   return Result;
+
+} // GetNextExpiryMsec
+/**************************************************************************************/
+QTimer64::QTimer64(uint64_t DurationMsec, bool Repeat, bool StartTimer)
+{
+   _Running= false;
+   _Done= false;
+   _Repeat= Repeat;
+   _DurationMsec= DurationMsec;
+   _DeadlineMsec= 0;
+
+   /* Add to the registry. */
+   _pNextTimer= _pFirstTimer;
+   _pFirstTimer= this;
 
+   if (StartTimer)
+      Start();
+
+} // QTimer64
+/**************************************************************************************/
+QTimer64::~QTimer64()
+{
+   QTimer64 ** ppTimer= &_pFirstTimer;
+   while ((*ppTimer != NULL) && (*ppTimer != this))
+      ppTimer= &(*ppTimer)->_pNextTimer;
+   if (*ppTimer != NULL)
+      *ppTimer= _pNextTimer;
+
+} // ~QTimer64
+/**************************************************************************************/
+void QTimer64::Start()
+{
+   _DeadlineMsec= QTimestamp::GetTickMsec64() + _DurationMsec;
+   _Running= true;
+   _Done= false;
 
+} // Start
+/**************************************************************************************/
+void QTimer64::Start(uint64_t DurationMsec)
+{
+   _DurationMsec= DurationMsec;
+   Start();
 
+} // Start
+/**************************************************************************************/
+void QTimer64::Stop()
+{
+   _Running= false;
+   _Done= false;
 
+} // Stop
+/**************************************************************************************/
+bool QTimer64::IsDone()
+{
+   if (_Running)
+   {
+      uint64_t NowMsec= QTimestamp::GetTickMsec64();
+      if (NowMsec >= _DeadlineMsec)
+      {
+         if (_Repeat && (_DurationMsec > 0))
+         {  /* Next deadline on the original phase. */
+            uint64_t MissedCnt= (NowMsec - _DeadlineMsec) / _DurationMsec;
+            _DeadlineMsec+= (MissedCnt + 1) * _DurationMsec;
+            return true;
+         }
+         _Running= false;
+         _Done= true;
+      }
+   }
 
+   return _Done;
 
+} // IsDone
+/**************************************************************************************/
+uint64_t QTimer64::RemainingTimeMsec()
+{
+   uint64_t Result= 0;
+   if (_Running)
+   {
+      uint64_t NowMsec= QTimestamp::GetTickMsec64();
+      if (_DeadlineMsec > NowMsec)
+         Result= _DeadlineMsec - NowMsec;
+   }
 
+   return Result;
 
+} // RemainingTimeMsec
@@ -5,13 +5,26 @@
 #ifndef QTimer_h
 #define QTimer_h
 #include "Arduino.h"             // e.g. DigitalRead(), sprintf()
+#include "QTrace.h"
 
 //#define  _DEBUG_QTIMER
 //#define  _DEBUG_QTIMESTAMP
+//#define  ENB_QTIMER_WHEEL                             // Timers scheduled on the central QTimerWheel. Requires QTimerWheel::DoService() in loop.
+//#define  ENB_QTIMER_STATS                             // Per timer name, fire count and late-fire latency, for QTimer::TraceAll()
+#ifndef QTIMER_POOL_SIZE
+#define  QTIMER_POOL_SIZE                 48          // # QTimer objects allocated from the static pool before falling back to the heap
+#endif
+#if QTIMER_POOL_SIZE > 0xFFFF
+#error "QTIMER_POOL_SIZE must be <= 65535, pool counts are uint16_t"
+#endif
+
+class QTimer;
 
 /**************************************************************************************/
 /* QTimestamp - Helpers for time measurements from based on microcontroller timestamps,
    e.g. millis().
+   The time source is pluggable, e.g. QVirtualClock for simulation. Library code reads time
+   through this class rather than millis()/micros(), so that it follows the source.
 */   
 /**************************************************************************************/
 class QTimestamp
@@ -22,20 +35,67 @@ class QTimestamp
    public:
    typedef uint32_t        TimestampType;
 
+   typedef uint64_t        Timestamp64Type;
+
+   /* Time source - returns a free running 32 bit count, e.g. millis(). */
+   typedef uint32_t        (* ClockSourceType)();
+
    protected:
    static const TimestampType _MaxTimestampMsec= 0xFFFFFFFFUL;
    static const TimestampType _MsecPerDay= /*hrs*/24 * /*min*/60 */*sec*/60 * /*msec*/1000;
-   static TimestampType       _PrevTimestamp;
-   static int              _RolloverCnt;
+   static const TimestampType _SecPerDay= /*hrs*/24 * /*min*/60 */*sec*/60;
+
+   static ClockSourceType  _pMsecSource;
+   static ClockSourceType  _pUsecSource;
+
+   /* 64 bit clocks. The low words are the last raw millis()/micros() readings, the high words
+      count their rollovers. Rollovers are caught as long as each clock is read at least once
+      per 32 bit period, ~49.7 days for msec, ~71.6 minutes for usec. QCore reads both every
+      loop pass.  */
+   static uint32_t         _MsecLow;
+   static uint32_t         _MsecHigh;
+   static uint32_t         _UsecLow;
+   static uint32_t         _UsecHigh;
+
+   /* Loop tick - time captured once at the start of a loop pass. While active, timer queries
+      use it rather than reading the clock, so all expiry decisions in a pass agree. */
+   static bool             _LoopTickActive;
+   static Timestamp64Type  _LoopTickMsec;
 
    ///////////////////////////////////////////////////////////
    // Methods
    ///////////////////////////////////////////////////////////
 
    public:
-   /* Gets the current timestamp. For ESP8266, this is based on millis(). */
+   /* Replaces the msec and usec time sources, e.g. with QVirtualClock. NULL restores
+      millis()/micros(). Resets the 64 bit clocks, so call before timers are started. */
+   static void             SetClockSource(ClockSourceType pMsecSource, ClockSourceType pUsecSource);
+
+   /* Gets the current timestamp. For ESP8266, this is based on millis(). Interrupts are not
+      blocked, so this is the read for frequent polls, e.g. QTimer::IsDone(). */
    static TimestampType    GetNowTimeMsec();
 
+   /* 64 bit monotonic clocks, no rollover handling needed. The low 32 bits of the msec clock
+      match GetNowTimeMsec(). Safe to call from an ISR. Each read blocks interrupts briefly,
+      to update the rollover count.  */
+   static Timestamp64Type  GetNowTimeMsec64();
+   static Timestamp64Type  GetNowTimeUsec64();
+
+   /* Raw 32 bit usec clock, for timing short spans, e.g. QProfile. Rolls over every ~71.6 minutes,
+      so take differences by unsigned subtraction. */
+   static TimestampType    GetNowTimeUsec(){return _pUsecSource();}
+
+   /* Extends a 32 bit clock reading to 64 bits, given the previous reading and the rollover
+      count, which are updated. Caller must prevent concurrent updates. */
+   static Timestamp64Type  ExtendTimestamp(uint32_t NowTime, uint32_t & LowTime, uint32_t & HighTime);
+
+   /* Loop tick. BeginLoopTick() captures the time and returns it, EndLoopTick() reverts to
+      live reads. QCore wraps its pass in these. Outside a pass, GetTickMsec() is live. */
+   static TimestampType    BeginLoopTick();
+   static void             EndLoopTick(){_LoopTickActive= false;}
+   static TimestampType    GetTickMsec(){return (_LoopTickActive)?((TimestampType) _LoopTickMsec):(GetNowTimeMsec());}
+   static Timestamp64Type  GetTickMsec64(){return (_LoopTickActive)?(_LoopTickMsec):(GetNowTimeMsec64());}
+
    /* Compares the Timestamp to the Reference time. Values are integer times in any units of interest
       e.g. millis() readings. Handles rollover of timestamps.
       Relies on assumption that max difference is 0x7FFFFFFF.
@@ -53,26 +113,86 @@ class QTimestamp
    static float            GetUptimeDays();
 
    #ifdef _DEBUG_QTIMESTAMP
-   static int              _RolledOver;
+   /* Self test, including both 32 bit rollovers on QVirtualClock. Call before timers are started. */
    static void             Test();
    #endif
 
+   protected:
+   static uint32_t         ReadMillis();
+   static uint32_t         ReadMicros();
+
 }; // QTimestamp
 
+/**************************************************************************************/
+/* QVirtualClock - simulated time source for QTimestamp. Time moves only when advanced, so a
+   host build can run days of timer driven behaviour in seconds, including rollovers of both
+   the msec and usec clocks.
+
+   Usage:
+      QVirtualClock::Install(StartUsec);
+      while (...)
+         QVirtualClock::AdvanceMsec(QCore::DoService());   // sleep time returned by the pass
+      QVirtualClock::Uninstall();
+*/   
+/**************************************************************************************/
+class QVirtualClock
+{
+   ///////////////////////////////////////////////////////////
+   // Data
+   ///////////////////////////////////////////////////////////
+   protected:
+   static uint64_t         _NowUsec;
+
+   ///////////////////////////////////////////////////////////
+   // Methods
+   ///////////////////////////////////////////////////////////
+   public:
+   /* Makes this the time source for QTimestamp, starting at StartUsec. The msec source reads
+      StartUsec / 1000, so start near (0xFFFFFFFF * 1000) to reach the msec rollover early. */
+   static void             Install(uint64_t StartUsec);
+   static void             Uninstall();
+
+   static void             AdvanceUsec(uint64_t Usec){_NowUsec+= Usec;}
+   static void             AdvanceMsec(uint64_t Msec){_NowUsec+= Msec * /*usec*/1000;}
+   static uint64_t         GetNowUsec(){return _NowUsec;}
+
+   /* Time sources, in the form of millis() and micros(). */
+   static uint32_t         ReadMsec(){return (uint32_t) (_NowUsec / /*usec*/1000);}
+   static uint32_t         ReadUsec(){return (uint32_t) _NowUsec;}
+
+}; // QVirtualClock
+
 
 /**************************************************************************************/
 /* QTimer - a general purpose countdown timer. Various controls available for:
    - automatically repeating the countdown once Done.
    - Initial state of Done or !Done.
    - Pause & Resume.
-
-   Future enhancements:
-   - Initial start delay in msec.
+   - Phase locked repeat, so that periodic work does not drift by the loop latency.
+   - Initial start delay in msec, e.g. to spread the phases of timers with the same period.
 
 */   
 /**************************************************************************************/
 class QTimer
 {
+   public:
+   /* How a repeating timer restarts once Done. */
+   typedef enum RepeatModeT
+   {
+      RMT_Restart=         0,                         // Restart from the time IsDone() observed expiry
+      RMT_PhaseLocked,                                // Advance the deadline by one period from the previous deadline
+      RMT_Count
+   };
+
+   /* Phase locked timers only - handling of periods that passed before IsDone() was called. */
+   typedef enum CatchupPolicyT
+   {
+      CPT_SkipMissed=      0,                         // Fire once, skip to the next deadline on the original phase
+      CPT_FireOnce,                                   // Fire once, restart the phase from now
+      CPT_FireAll,                                    // Fire on each IsDone() call until caught up
+      CPT_Count
+   };
+
    ///////////////////////////////////////////////////////////
    // Data
    ///////////////////////////////////////////////////////////
@@ -87,17 +207,93 @@ class QTimer
       TST_Count
    };
 
-   TimerStateT             _State;
-   bool                    _Repeat;
-   unsigned long           _StartTimeMsec;
-   unsigned long           _MasterDurationMsec;
-   unsigned long           _CurDurationMsec;
-   unsigned long           _RemainingTimeMsec;
+   /* Registry of all live timers, for queries across timers, e.g. GetNextExpiryMsec(). */
+   static QTimer *         _pFirstTimer;
+   QTimer *                _pNextTimer;
+
+   /* Static pool - QTimer objects are allocated from here by operator new, keeping them in one
+      contiguous block rather than scattered across the heap. Heap is used once the pool is full. */
+   static void *           _pPoolFree;
+   static uint16_t         _PoolUsedCnt;
+   static uint16_t         _PoolHighWaterCnt;
+   static uint16_t         _PoolHeapCnt;
+
+   /* Enabled: absolute deadline, may rollover. Paused: remaining time. */
+   uint32_t                _DeadlineMsec;
+   uint32_t                _PeriodMsec;
+
+   /* Tolerance past the deadline within which the timer may fire. Lets the loop sleep until
+      several deadlines can be serviced in one wakeup. Defaults to 0.   */
+   uint16_t                _SlackMsec;
+
+   /* Phase locked timers - count of periods that were not fired on time, saturates. For
+      instrumentation. */
+   uint16_t                _MissedCnt;
+
+   /* Flags, packed. */
+   uint8_t                 _State:           2;       // TimerStateT
+   uint8_t                 _Repeat:          1;
+   uint8_t                 _RepeatMode:      1;       // RepeatModeT
+   uint8_t                 _CatchupPolicy:   2;       // CatchupPolicyT
+   #ifdef ENB_QTIMER_WHEEL
+   /* Timing wheel linkage. _Expired is set by QTimerWheel when the deadline passes, so that
+      IsDone() on a running timer is a flag read. _WheelLevel < 0 when not scheduled on the wheel. */
+   uint8_t                 _Expired:         1;
+   int8_t                  _WheelLevel;
+   uint8_t                 _WheelSlot;
+   QTimer *                _pWheelNext;
+   QTimer *                _pWheelPrev;
+   friend class            QTimerWheel;
+   #endif
+
+   #ifdef ENB_QTIMER_STATS
+   /* Introspection. Late time is from the deadline to the IsDone() call that observed it. */
+   const char *            _pName;
+   uint32_t                _FireCnt;
+   uint32_t                _LateTotalMsec;
+   uint16_t                _LateMaxMsec;
+   #endif
+
+   /* Used for Dump(), shared by all timers. */
+   static const int        _DumpBfrLen= 95;
+   static char             _StsBfr[_DumpBfrLen+1];
    
+   public:
+   static const unsigned long _NoExpiryMsec=  0xFFFFFFFFUL;
+
    ///////////////////////////////////////////////////////////
    // Methods
    ///////////////////////////////////////////////////////////
    public:
+   /* Time until the next running timer is due to fire, accounting for slack. Allows the loop to
+      sleep rather than spin.
+         PassStartMsec  - timestamp at the start of the current loop pass. Timers that expired
+                          before then were visible to their owners during the pass, so do not
+                          count as pending.
+      Returns: msec, 0 if a timer is already due, _NoExpiryMsec if no timers are running.   */
+   static unsigned long    GetNextExpiryMsec(unsigned long PassStartMsec);
+
+   /* Allocation from the static pool. */
+   static void *           operator new(size_t Size);
+   static void             operator delete(void * pTimer);
+
+   /* Pool occupancy - slots in use, most ever in use, and allocations that fell back to heap. */
+   static int              GetPoolSize(){return QTIMER_POOL_SIZE;}
+   static int              GetPoolUsedCnt(){return _PoolUsedCnt;}
+   static int              GetPoolHighWaterCnt(){return _PoolHighWaterCnt;}
+   static int              GetPoolHeapCnt(){return _PoolHeapCnt;}
+
+   /* Traces Dump() of every live timer. */
+   static void             TraceAll(uint8_t TraceSwitchId, TraceLevelType TraceLevel);
+
+   #ifdef _DEBUG_QTIMER
+   /* Benchmark of timer servicing: usec per loop pass to poll TimerCnt running timers, incl
+      advancing the timing wheel if enabled. Traced per timer count. Benchmark() runs 8, 64
+      and, except on ESP8266 whose heap cannot hold them, 1024 timers. */
+   static void             Benchmark(int TimerCnt, int PassCnt);
+   static void             Benchmark();
+   #endif
+
    /* General Usage
          - To create a timer that starts immediately, create with StartTimer= true;
          - Repeat: if true, timer starts again afer IsDone(). If false, stays in IsDone() state until
@@ -125,11 +321,16 @@ class QTimer
 
    /* Countdown timer, non-repetitive. */
                            QTimer(unsigned long DurationMsec, bool StartTimer);
+                           ~QTimer();
 
    void                    Set(unsigned long DurationMsec);
    void                    Start();
    void                    Start(unsigned long DurationMsec);
    void                    Restart(){Start();}
+
+   /* Starts the timer with the first expiry after DelayMsec rather than the period. Repeats
+      continue every period from there. */
+   void                    StartDelayed(unsigned long DelayMsec);
    void                    Pause();
 
    /* Resume the timer. Note that can resume a timer that was never started (starts from beginning). */
@@ -142,20 +343,159 @@ class QTimer
    void                    Stop();
 
    void                    SetRepeat(bool Flag);
+
+   /* Sets how a repeating timer restarts. Phase locked timers keep their deadlines on a fixed
+      grid of the period, regardless of how late IsDone() is called. */
+   void                    SetRepeatMode(RepeatModeT Mode, CatchupPolicyT Policy);
+   void                    SetPhaseLocked(CatchupPolicyT Policy){SetRepeatMode(RepeatModeT::RMT_PhaseLocked, Policy);}
+   unsigned long           GetMissedCnt(){return _MissedCnt;}
+
+   /* Allows the timer to fire up to SlackMsec late, so that it can share a wakeup with
+      other timers. Use for periodic work without tight timing needs. */
+   void                    SetSlack(unsigned long SlackMsec){_SlackMsec= (SlackMsec > 0xFFFF)?(0xFFFF):(SlackMsec);}
    unsigned long           ElapsedTimeMsec();
    unsigned long           RemainingTimeMsec();
    unsigned long           RemainingTimeSec(){return (RemainingTimeMsec()/1000);}
 
    bool                    IsDone();                  // returns true if not yet started
    bool                    IsEnabled(){return (_State == TimerStateT::TST_Enabled);}
+
+   /* Optional name, shown by Dump(). Caller's string must persist. */
+   #ifdef ENB_QTIMER_STATS
+   void                    SetName(const char * pName){_pName= pName;}
+   #else
+   void                    SetName(const char * /*pName*/){}   // No-op without ENB_QTIMER_STATS, name is not stored
+   #endif
+
+   /* Status summary: period, remaining time, and with ENB_QTIMER_STATS the fire count and
+      late-fire latency. Returned string is overwritten by the next Dump() of any timer. */
+   const char *            Dump();
    
    protected:
    void                    Set(unsigned long DurationMsec, bool Repeat, bool StartTimer);
    void                    Init();
+   void                    Arm(unsigned long DeadlineMsec);
+   void                    Repeat();
+   void                    AddMissed(unsigned long MissedCnt);
+   void                    RecordFire(bool OnDeadline);
    void                    SetDuration(unsigned long DurationMsec);
    void                    Disable();
+   uint32_t                GetDeadlineMsec(){return _DeadlineMsec;}   // may rollover
 };
 
+/**************************************************************************************/
+/* QTimer64 - countdown timer on the 64 bit msec clock, for durations beyond the ~24 day
+   range of QTimer, e.g. daily or weekly work. No rollover handling needed.
+   Repeats are phase locked: the deadline advances by whole periods, skipping any missed.
+*/   
+/**************************************************************************************/
+class QTimer64
+{
+   ///////////////////////////////////////////////////////////
+   // Data
+   ///////////////////////////////////////////////////////////
+   protected:
+   /* Registry of all live timers, for GetNextExpiryMsec(). */
+   static QTimer64 *       _pFirstTimer;
+   QTimer64 *              _pNextTimer;
+
+   bool                    _Running;
+   bool                    _Done;
+   bool                    _Repeat;
+   uint64_t                _DurationMsec;
+   uint64_t                _DeadlineMsec;
+
+   ///////////////////////////////////////////////////////////
+   // Methods
+   ///////////////////////////////////////////////////////////
+   public:
+   /* Time until the next running timer is due. See QTimer::GetNextExpiryMsec(). */
+   static unsigned long    GetNextExpiryMsec(unsigned long PassStartMsec);
+
+                           QTimer64(uint64_t DurationMsec, bool Repeat, bool StartTimer);
+                           ~QTimer64();
+
+   void                    Start();
+   void                    Start(uint64_t DurationMsec);
+   void                    Restart(){Start();}
+
+   /* Stop() - Stops the Timer, placing it in Disabled state, and state is not Done. */ 
+   void                    Stop();
+
+   bool                    IsDone();
+   bool                    IsEnabled(){return _Running;}
+   uint64_t                RemainingTimeMsec();
+   uint64_t                GetDeadlineMsec(){return _DeadlineMsec;}
+};
+
+#ifdef ENB_QTIMER_WHEEL
+/**************************************************************************************/
+/* QTimerWheel - hierarchical timing wheel shared by all QTimer instances.
+   Running timers are filed in a slot by deadline. DoService() advances the wheel to the
+   current time once per loop, flagging the timers whose deadline has passed, so the cost of
+   expiry checks no longer grows with the number of live timers.
+
+   Levels are 64 slots each, with 1 msec resolution at level 0:
+      Level 0: 64 msec, 1: ~4 sec, 2: ~4.4 min, 3: ~4.7 hrs, 4: ~12.4 days
+   Timers further out than the top level are parked in its last slot and refiled on cascade.
+   A timer's slack is applied by rounding its deadline up within the slack to a coarser
+   boundary, so that timers with nearby deadlines share a slot and expire together.
+
+   Usage: enable ENB_QTIMER_WHEEL in QTimer.h and call DoService() once per loop (QCore does
+   this). Timers register automatically on Start().
+*/   
+/**************************************************************************************/
+class QTimerWheel
+{
+   ///////////////////////////////////////////////////////////
+   // Data
+   ///////////////////////////////////////////////////////////
+   protected:
+   static const int        _LevelBits=       6;
+   static const int        _SlotCnt=         (1 << _LevelBits);
+   static const uint32_t   _SlotMask=        (_SlotCnt - 1);
+   static const int        _LevelCnt=        5;
+
+   static bool             _Initialized;
+
+   /* Current position of the wheel, in msec. Lags GetTickMsec() until the next DoService(). */
+   static uint32_t         _CurTick;
+
+   /* Slot lists, and a bitmap per level of the slots that are occupied. */
+   static QTimer *         _pSlots[_LevelCnt][_SlotCnt];
+   static uint64_t         _Occupied[_LevelCnt];
+
+   static unsigned long    _ScheduledCnt;
+
+   ///////////////////////////////////////////////////////////
+   // Methods
+   ///////////////////////////////////////////////////////////
+   public:
+   /* Advances the wheel to the current time, expiring timers. Call once per loop. */
+   static void             DoService();
+
+   /* (Re)files the timer based on its current deadline. */
+   static void             Schedule(QTimer * pTimer);
+
+   /* Takes the timer off the wheel, e.g. on Pause() or Stop(). */
+   static void             Remove(QTimer * pTimer);
+
+   /* Number of timers currently on the wheel. */
+   static unsigned long    GetScheduledCnt(){return _ScheduledCnt;}
+
+   /* Time until the next wheel event: a slot expiring, or an upper level slot cascading.
+      Returns: msec, 0 if due now, QTimer::_NoExpiryMsec if the wheel is empty. */
+   static unsigned long    GetNextExpiryMsec();
+
+   protected:
+   static int              NextSlotDistance(uint64_t Occupied, uint32_t Slot);
+   static void             Insert(QTimer * pTimer);
+   static void             Cascade();
+   static void             ExpireSlot(int Slot);
+
+}; // QTimerWheel
+#endif
+
 
 
 #endif
\ No newline at end of file
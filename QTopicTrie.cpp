@@ -0,0 +1,177 @@
+///////////////////////////////////////////////////////////////////////////////
+// :mode=c:
+/*  QTopicTrie.cpp
+*/
+///////////////////////////////////////////////////////////////////////////////
+#include "QTopicTrie.h"
+
+/**************************************************************************************/
+QTopicTrie::QTopicTrie()
+{
+   Clear();
+
+} // QTopicTrie
+/**************************************************************************************/
+void QTopicTrie::Clear()
+{
+   _Nodes[0].pLevel= "";
+   _Nodes[0].LevelLen= 0;
+   _Nodes[0].Wildcard= 0;
+   _Nodes[0].LevelHash= 0;
+   _Nodes[0].FirstChild= _NoNode;
+   _Nodes[0].NextSibling= _NoNode;
+   _Nodes[0].Subscribers= 0;
+   _NodeCnt= 1;
+
+} // Clear
+/**************************************************************************************/
+/*static*/ int QTopicTrie::ScanLevel(const char * pLevel, uint16_t & Hash)
+{
+   const char * pCh= pLevel;
+   Hash= 0;
+   while ((*pCh != 0) && (*pCh != '/'))
+   {
+      Hash= (Hash * 31) + (uint8_t) *pCh;
+      pCh++;
+   }
+   return pCh - pLevel;
+
+} // ScanLevel
+/**************************************************************************************/
+/*static*/ bool QTopicTrie::IsValidFilter(const char * pFilter)
+{
+   const char * pLevel= pFilter;
+   while (true)
+   {
+      uint16_t Hash;
+      int LevelLen= ScanLevel(pLevel, Hash);
+      for (int i= 0 ; i < LevelLen ; i++)
+      {
+         if (((pLevel[i] == '+') || (pLevel[i] == '#')) && (LevelLen != 1))
+            return false;
+      }
+      if (pLevel[LevelLen] == 0)
+         return true;
+      if ((LevelLen == 1) && (pLevel[0] == '#'))
+         return false;                                // '#' not last
+      pLevel+= LevelLen + 1;
+   }
+
+} // IsValidFilter
+/**************************************************************************************/
+int QTopicTrie::FindChild(int Parent, const char * pLevel, int LevelLen, uint16_t Hash)
+{
+   for (int Child= _Nodes[Parent].FirstChild ; Child != _NoNode ; Child= _Nodes[Child].NextSibling)
+   {
+      Node & ChildNode= _Nodes[Child];
+      if ((ChildNode.LevelHash == Hash) && (ChildNode.LevelLen == LevelLen) && (memcmp(ChildNode.pLevel, pLevel, LevelLen) == 0))
+         return Child;
+   }
+   return _NoNode;
+
+} // FindChild
+/**************************************************************************************/
+bool QTopicTrie::Add(const char * pFilter, int Subscriber)
+{
+   if ((Subscriber < 0) || (Subscriber >= _MaxSubscribers) || !IsValidFilter(pFilter))
+      return false;
+
+   int NodeIndex= 0;
+   const char * pLevel= pFilter;
+   while (true)
+   {
+      uint16_t Hash;
+      int LevelLen= ScanLevel(pLevel, Hash);
+      int Child= FindChild(NodeIndex, pLevel, LevelLen, Hash);
+      if (Child == _NoNode)
+      {
+         if ((_NodeCnt >= QTOPIC_TRIE_NODES) || (LevelLen > 0xFF))
+            return false;
+
+         Child= _NodeCnt++;
+         Node & ChildNode= _Nodes[Child];
+         ChildNode.pLevel= pLevel;
+         ChildNode.LevelLen= LevelLen;
+         ChildNode.Wildcard= ((LevelLen == 1) && ((pLevel[0] == '+') || (pLevel[0] == '#')))?(pLevel[0]):(0);
+         ChildNode.LevelHash= Hash;
+         ChildNode.FirstChild= _NoNode;
+         ChildNode.Subscribers= 0;
+
+         ChildNode.NextSibling= _Nodes[NodeIndex].FirstChild;
+         _Nodes[NodeIndex].FirstChild= Child;
+      }
+
+      NodeIndex= Child;
+      if (pLevel[LevelLen] == 0)
+         break;
+      pLevel+= LevelLen + 1;
+   }
+   _Nodes[NodeIndex].Subscribers|= ((SubscriberMaskType) 1) << Subscriber;
+   return true;
+
+} // Add
+/**************************************************************************************/
+QTopicTrie::SubscriberMaskType QTopicTrie::Match(const char * pTopic)
+/* Each pass of the loop takes one topic level, moving the set of reachable nodes down a
+   level. A node is reached at most once per level, so a set fits in the pool size. */
+{
+   SubscriberMaskType Result= 0;
+   uint8_t ActiveBfr[2][QTOPIC_TRIE_NODES];
+   uint8_t * pActive= ActiveBfr[0];
+   uint8_t * pNext= ActiveBfr[1];
+   int ActiveCnt= 1;
+   pActive[0]= 0;                                     // root
+   bool System= (pTopic[0] == '$');                   // e.g. $SYS, not matched by a leading wildcard
+
+   const char * pLevel= pTopic;
+   while (true)
+   {
+      uint16_t Hash;
+      int LevelLen= ScanLevel(pLevel, Hash);
+      int NextCnt= 0;
+
+      for (int i= 0 ; i < ActiveCnt ; i++)
+      {
+         bool WildcardOk= !System || (pActive[i] != 0);
+         for (int Child= _Nodes[pActive[i]].FirstChild ; Child != _NoNode ; Child= _Nodes[Child].NextSibling)
+         {
+            Node & ChildNode= _Nodes[Child];
+            if (ChildNode.Wildcard == '#')
+            {
+               if (WildcardOk)
+                  Result|= ChildNode.Subscribers;
+            }
+            else if (ChildNode.Wildcard == '+')
+            {
+               if (WildcardOk)
+                  pNext[NextCnt++]= Child;
+            }
+            else if ((ChildNode.LevelHash == Hash) && (ChildNode.LevelLen == LevelLen) && (memcmp(ChildNode.pLevel, pLevel, LevelLen) == 0))
+               pNext[NextCnt++]= Child;
+         }
+      }
+
+      uint8_t * pSwap= pActive;
+      pActive= pNext;
+      pNext= pSwap;
+      ActiveCnt= NextCnt;
+
+      if ((pLevel[LevelLen] == 0) || (ActiveCnt == 0))
+         break;
+      pLevel+= LevelLen + 1;
+   }
+
+   /* Filters ending at the topic's last level, or with a '#' just below it, e.g. "a/#" matches "a". */
+   for (int i= 0 ; i < ActiveCnt ; i++)
+   {
+      Result|= _Nodes[pActive[i]].Subscribers;
+      for (int Child= _Nodes[pActive[i]].FirstChild ; Child != _NoNode ; Child= _Nodes[Child].NextSibling)
+      {
+         if (_Nodes[Child].Wildcard == '#')
+            Result|= _Nodes[Child].Subscribers;
+      }
+   }
+
+   return Result;
+
+} // Match
@@ -0,0 +1,90 @@
+///////////////////////////////////////////////////////////////////////////////
+// :mode=c:
+/*  QTopicTrie.h                                                             */
+///////////////////////////////////////////////////////////////////////////////
+#ifndef QTopicTrie_h
+#define QTopicTrie_h
+#include "Arduino.h"
+
+/* Subscriber count of QMQTT, defaulted here as the trie node pool is sized from it. */
+#ifndef QMQTT_MAX_SUBSCRIBERS
+#define QMQTT_MAX_SUBSCRIBERS          8              // Subscribe() calls per QMQTT instance
+#endif
+
+#ifndef QTOPIC_TRIE_NODES
+#define QTOPIC_TRIE_NODES              (QMQTT_MAX_SUBSCRIBERS * 4 + 1)   // Node pool per trie, one per distinct filter level, +1 root
+#endif
+#if QTOPIC_TRIE_NODES > 255
+#error "QTOPIC_TRIE_NODES must be <= 255, nodes are indexed by uint8_t"
+#endif
+
+/**************************************************************************************/
+/* QTopicTrie - matches mqtt topics against subscriber topic filters, with '+' (one level) and
+   '#' (this level and below) wildcards per the mqtt spec. Filters are compiled into a trie of
+   topic levels when added, from a fixed node pool. Match() makes one pass over the topic,
+   tracking the trie nodes that the levels so far can reach, and returns the matching
+   subscribers as a bitmask.
+
+   Each node refers to its level within the caller's filter string, so filters must persist.
+   Topics starting with '$' are not matched by a leading wildcard.
+
+   Usage:
+      Trie.Add("device/+/set", 0);                    // Subscriber 0
+      Trie.Add("device/#", 1);
+      SubscriberMaskType Mask= Trie.Match("device/light/set");   // 0x03
+*/
+/**************************************************************************************/
+class QTopicTrie
+{
+   ///////////////////////////////////////////////////////////
+   // Data
+   ///////////////////////////////////////////////////////////
+   public:
+   typedef uint32_t        SubscriberMaskType;
+   static const int        _MaxSubscribers=  32;      // Bits in SubscriberMaskType
+
+   protected:
+   static const uint8_t    _NoNode=          0xFF;
+
+   struct Node
+   {
+      const char *         pLevel;                    // In the caller's filter, not terminated
+      uint8_t              LevelLen;
+      char                 Wildcard;                  // '+', '#', or 0 if a literal level
+      uint16_t             LevelHash;
+      uint8_t              FirstChild;
+      uint8_t              NextSibling;
+      SubscriberMaskType   Subscribers;               // Whose filter ends at this node
+   };
+
+   Node                    _Nodes[QTOPIC_TRIE_NODES];   // [0] is the root
+   uint8_t                 _NodeCnt;
+
+   ///////////////////////////////////////////////////////////
+   // Methods
+   ///////////////////////////////////////////////////////////
+   public:
+                           QTopicTrie();
+
+   /* Adds a subscriber's filter, e.g. "device/+/set". Filter string must persist.
+      Returns: false if the filter is malformed, the subscriber is beyond _MaxSubscribers or
+               the node pool is used up.  */
+   bool                    Add(const char * pFilter, int Subscriber);
+
+   /* Returns: bit i set if subscriber i's filter matches the topic. */
+   SubscriberMaskType      Match(const char * pTopic);
+
+   /* Wildcards must take a whole level, and '#' must be the last level. */
+   static bool             IsValidFilter(const char * pFilter);
+
+   void                    Clear();
+   int                     GetNodeCnt(){return _NodeCnt;}
+   int                     GetNodePoolSize(){return QTOPIC_TRIE_NODES;}
+
+   protected:
+   /* Length and hash of the level starting at pLevel, up to '/' or the end. */
+   static int              ScanLevel(const char * pLevel, uint16_t & Hash);
+   int                     FindChild(int Parent, const char * pLevel, int LevelLen, uint16_t Hash);
+};
+
+#endif
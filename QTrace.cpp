@@ -5,6 +5,9 @@
 #error "ASSERT is already defined." 
 #endif
 #include "QTrace.h"
+#include "QTimer.h"
+#include "QTraceLog.h"
+#include "QRateLimiter.h"
 
 #ifdef NDEBUG
 #error "NDEBUG is defined. assert() is disabled." 
@@ -16,17 +19,34 @@
 /**************************************************************************************/
 /* The global trace object. */
 QTrace *         QTrace::_pMasterObject= NULL;
+QTraceSerialSink QTrace::_SerialSink;
 QTrace           _Trace= QTrace();
 
 /**************************************************************************************/
 /*static*/ void QTrace::Assert(const char * __file, int __lineno, const char * __func, const char * __sexp, const char * pMsg)
 {
-   if (QTrace::Master() != NULL)
+   QTrace * pTrace= QTrace::Master();
+   if (pTrace != NULL)
    {
+      /* Output as an Event. Logged even if the switch is off. If it fires from within trace
+         output, e.g. in a sink, it goes to serial only, on a line of its own. */
+      uint8_t Sinks;
+      if (pTrace->_Streaming)
+      {
+         Sinks= (pTrace->_pSinks[TSK_Serial] != NULL)?(1 << TSK_Serial):(0);
+         Serial.print("\n");
+      }
+      else
+      {
+         Sinks= pTrace->GetLineSinks(TS_DFLT, TLT_Event);
+         if (pTrace->_pLog != NULL)
+            Sinks|= (1 << TSK_Log);
+      }
+
       if (pMsg == NULL)
-         QTrace::Master()->printf(TS_DFLT, TLT_Event,"ASSERT: at %s#%d:%s expr:%s", __file, __lineno, __func, __sexp);
+         pTrace->EmitP(Sinks, TLT_Event, PSTR("ASSERT: at %s#%d:%s expr:%s"), __file, __lineno, __func, __sexp);
       else  
-         QTrace::Master()->printf(TS_DFLT, TLT_Event,"ASSERT: [%s] at %s#%d:%s expr:%s", pMsg, __file, __lineno, __func, __sexp);  
+         pTrace->EmitP(Sinks, TLT_Event, PSTR("ASSERT: [%s] at %s#%d:%s expr:%s"), pMsg, __file, __lineno, __func, __sexp);
    }
 
 } // Assert
@@ -43,18 +63,75 @@ void QTrace::Init()
    if (QTrace::_pMasterObject == NULL)
       _pMasterObject= this;
 
-   _TraceSwitches= _TraceSwitchesLevel_Warning;
-   _EnbSerial= true;
-   _pCallback= NULL;
+   for (int i= 0 ; i < TSK_Cnt ; i++)
+      _pSinks[i]= NULL;
+   _pSinks[TSK_Serial]= &_SerialSink;
+   _pLineSink= NULL;
+   _pLog= NULL;
+   SetTraceSwitch(_TraceSwitchesLevel_Warning);
+
+   _Streaming= false;
+   _NestedDroppedCnt= 0;
+   _NestedDroppedReportedCnt= 0;
+
+   _DeferredHead= 0;
+   _DeferredCnt= 0;
+   _DeferredDroppedCnt= 0;
+   _DeferredDroppedReportedCnt= 0;
+
+   memset(_Dedup, 0, sizeof(_Dedup));
+   _DedupNextIndex= 0;
+   _DedupWindowMsec= /*sec*/60 * /*msec*/1000;
+
+   for (int i= 0 ; i < TRACE_SWITCH_CNT ; i++)
+      _pRateLimiters[i]= NULL;
+   _RateDroppedCnt= 0;
+   _RateDroppedReportedCnt= 0;
 
 } // Init 
 /**************************************************************************************/
+void QTrace::SetTraceToSerial(bool On)
+{
+   SetSink(TSK_Serial, (On)?(&_SerialSink):(NULL));
+   
+} // SetTraceToSerial
+/**************************************************************************************/
 void QTrace::SetCallback(void (* pCallback)(const char *))
 {
-   _pCallback= pCallback;
+   if (_pLineSink == NULL)
+      _pLineSink= new QTraceLineSink();
+   _pLineSink->_pCallback= pCallback;
+
+   bool Enabled= (_pLineSink->_pCallback != NULL) || (_pLineSink->_pLevelCallback != NULL);
+   SetSink(TSK_Callback, (Enabled)?(_pLineSink):(NULL));
    
 } // SetCallback
 /**************************************************************************************/
+void QTrace::SetCallback(void (* pCallback)(const char *, TraceLevelType))
+{
+   if (_pLineSink == NULL)
+      _pLineSink= new QTraceLineSink();
+   _pLineSink->_pLevelCallback= pCallback;
+
+   bool Enabled= (_pLineSink->_pCallback != NULL) || (_pLineSink->_pLevelCallback != NULL);
+   SetSink(TSK_Callback, (Enabled)?(_pLineSink):(NULL));
+   
+} // SetCallback
+/**************************************************************************************/
+void QTrace::SetLog(QTraceLog * pLog)
+{
+   _pLog= pLog;
+   SetSink(TSK_Log, pLog);
+   
+} // SetLog
+/**************************************************************************************/
+void QTrace::SetSink(TraceSinkType Sink, QTraceSink * pSink)
+{
+   _pSinks[Sink]= pSink;
+   UpdateTraceSwitches();
+   
+} // SetSink
+/**************************************************************************************/
 uint8_t QTrace::GetTraceSwitch(uint8_t TraceSwitchId)
 {
    int Switch= (_TraceSwitches >> (TraceSwitchId*4)) & 0x0F;
@@ -64,23 +141,156 @@ uint8_t QTrace::GetTraceSwitch(uint8_t TraceSwitchId)
 /**************************************************************************************/
 void QTrace::SetTraceSwitch(uint32_t TraceSwitches)
 {
-   _TraceSwitches= TraceSwitches;
+   for (int i= 0 ; i < TSK_Cnt ; i++)
+      _SinkSwitches[i]= TraceSwitches;
+   UpdateTraceSwitches();
    
 } // SetTraceSwitch
 /**************************************************************************************/
-void QTrace::PrintIt(const char * pStr)
-/* This method is for private use. Determined at this point that trace will be outputted. */
+void QTrace::SetSinkSwitches(TraceSinkType Sink, uint32_t TraceSwitches)
 {
-   if (_pCallback != NULL)
-      _pCallback(pStr);
+   _SinkSwitches[Sink]= TraceSwitches;
+   UpdateTraceSwitches();
+   
+} // SetSinkSwitches
+/**************************************************************************************/
+bool QTrace::SetTraceSwitchLevel(TraceSinkType Sink, uint8_t TraceSwitchId, TraceLevelType TraceLevel)
+{
+   if ((TraceSwitchId >= TRACE_SWITCH_CNT) || ((int) TraceLevel < TLT_Off) || ((int) TraceLevel > TLT_Max))
+      return false;
+
+   uint32_t Mask= 0x0FUL << (TraceSwitchId*4);
+   uint32_t Nibble= ((uint32_t) TraceLevel) << (TraceSwitchId*4);
+   for (int i= 0 ; i < TSK_Cnt ; i++)
+   {
+      if ((Sink == TSK_Cnt) || (Sink == i))
+         _SinkSwitches[i]= (_SinkSwitches[i] & ~Mask) | Nibble;
+   }
+   UpdateTraceSwitches();
+   return true;
+
+} // SetTraceSwitchLevel
+/**************************************************************************************/
+bool QTrace::IsSinkEnabled(TraceSinkType Sink)
+{
+   return (_pSinks[Sink] != NULL);
    
-   if (_EnbSerial)
+} // IsSinkEnabled
+/**************************************************************************************/
+void QTrace::UpdateTraceSwitches()
+/* Sets _TraceSwitches to the most verbose level of the enabled sinks, per switch. */
+{
+   uint32_t TraceSwitches= 0;
+
+   for (int i= 0 ; i < TSK_Cnt ; i++)
    {
-      Serial.print(pStr);
-      Serial.print("\n");
+      if (!IsSinkEnabled((TraceSinkType) i))
+         continue;
+      for (int Shift= 0 ; Shift < 32 ; Shift+= 4)
+      {
+         uint32_t Mask= 0x0FUL << Shift;
+         if ((_SinkSwitches[i] & Mask) > (TraceSwitches & Mask))
+            TraceSwitches= (TraceSwitches & ~Mask) | (_SinkSwitches[i] & Mask);
+      }
    }
+   _TraceSwitches= TraceSwitches;
+   
+} // UpdateTraceSwitches
+/**************************************************************************************/
+uint8_t QTrace::GetLineSinks(uint8_t TraceSwitchId, TraceLevelType TraceLevel)
+/* Returns: bit per TraceSinkType, set for those that take this line. */
+{
+   uint8_t Sinks= 0;
 
-} // PrintIt
+   for (int i= 0 ; i < TSK_Cnt ; i++)
+   {
+      if ((_pSinks[i] != NULL) && IsSinkOutput((TraceSinkType) i, TraceSwitchId, TraceLevel))
+         Sinks|= (1 << i);
+   }
+   return Sinks;
+
+} // GetLineSinks
+/**************************************************************************************/
+void QTrace::SetRateLimit(uint8_t TraceSwitchId, uint16_t Lines, uint32_t PeriodMsec, uint16_t Burst)
+{
+   if (TraceSwitchId >= TRACE_SWITCH_CNT)
+      return;
+   if (_pRateLimiters[TraceSwitchId] == NULL)
+      _pRateLimiters[TraceSwitchId]= new QRateLimiter(Lines, PeriodMsec, Burst);
+   else
+      _pRateLimiters[TraceSwitchId]->Set(Lines, PeriodMsec, Burst);
+
+} // SetRateLimit
+/**************************************************************************************/
+bool QTrace::IsRateLimited(uint8_t TraceSwitchId, TraceLevelType TraceLevel)
+/* Returns: true if the line is over its switch's rate and is to be dropped. */
+{
+   bool Result= false;
+   QRateLimiter * pRateLimiter= (TraceSwitchId < TRACE_SWITCH_CNT)?(_pRateLimiters[TraceSwitchId]):(NULL);
+
+   if ((pRateLimiter != NULL) && (TraceLevel > TLT_Error))
+   {
+      if (!pRateLimiter->TryAcquire())
+      {
+         pRateLimiter->RecordDropped();
+         _RateDroppedCnt++;
+         Result= true;
+      }
+   }
+   return Result;
+
+} // IsRateLimited
+/**************************************************************************************/
+bool QTrace::IsRepeat(const void * pSite, uint32_t Hash, uint8_t TraceSwitchId, TraceLevelType TraceLevel)
+/* Checks the line's hash against that of the last line output from the same call site, see
+   QTraceDedup.
+   Returns: true if it is a repeat, and is to be suppressed. */
+{
+   QTraceDedup * pEntry= NULL;
+   for (int i= 0 ; i < QTRACE_DEDUP_CNT ; i++)
+   {
+      if ((_Dedup[i].pFormat == pSite) && (_Dedup[i].TraceSwitchId == TraceSwitchId) &&
+          (_Dedup[i].TraceLevel == TraceLevel))
+      {
+         pEntry= &_Dedup[i];
+         break;
+      }
+   }
+
+   if ((pEntry != NULL) && (pEntry->Hash == Hash))
+   {
+      if (pEntry->RepeatCnt == 0)
+         pEntry->FirstRepeatMsec= QTimestamp::GetTickMsec();
+      if (pEntry->RepeatCnt < 0xFFFF)
+         pEntry->RepeatCnt++;
+      return true;
+   }
+
+   if (pEntry == NULL)
+   {  /* New call site, take over the oldest entry. */
+      pEntry= &_Dedup[_DedupNextIndex];
+      _DedupNextIndex= (_DedupNextIndex + 1) % QTRACE_DEDUP_CNT;
+   }
+   if (pEntry->RepeatCnt > 0)
+      ReportRepeats(*pEntry);
+
+   pEntry->pFormat= pSite;
+   pEntry->Hash= Hash;
+   pEntry->TraceSwitchId= TraceSwitchId;
+   pEntry->TraceLevel= TraceLevel;
+   return false;
+
+} // IsRepeat
+/**************************************************************************************/
+void QTrace::ReportRepeats(QTraceDedup & Entry)
+{
+   uint16_t RepeatCnt= Entry.RepeatCnt;
+   Entry.RepeatCnt= 0;
+
+   OutputP(Entry.TraceSwitchId, (TraceLevelType) Entry.TraceLevel, /*pSite*/NULL,
+      PSTR("Last message repeated %u times: %.48s"), RepeatCnt, (const char *) Entry.pFormat);
+
+} // ReportRepeats
 /**************************************************************************************/
 // Trace Switch & Level Prints
 /**************************************************************************************/
@@ -96,10 +306,8 @@ void QTrace::print(uint8_t TraceSwitchId, TraceLevelType TraceLevel, char pStr[]
    
    /* Does the given trace level meet the threshold specified in the switch? 
       If this trace entry is more verbose than setting, we ignore it. */
-   if ((int) TraceLevel <= Switch)
-   {
-      PrintIt(pStr);     
-   }
+   if (((int) TraceLevel <= Switch) && !IsRateLimited(TraceSwitchId, TraceLevel))
+      OutputP(TraceSwitchId, TraceLevel, /*pSite*/NULL, PSTR("%s"), pStr);   // pStr may not persist, no dedup
    
 } // print
 /**************************************************************************************/
@@ -120,22 +328,17 @@ void QTrace::printf(uint8_t TraceSwitchId, TraceLevelType TraceLevel, char pStr[
             Str
 */
 { 
-   char PrnBfr[_TraceBfrSize];
    /* Get the trace threshold for this switch. */
-   //int Switch= (_TraceSwitches >> (TraceSwitchId*4)) & 0x0F;
    int Switch= GetTraceSwitch(TraceSwitchId);
    
    /* Does the given trace level meet the threshold specified in the switch? 
       If this trace entry is more verbose than setting, we ignore it. */
-   if ((int) TraceLevel <= Switch)
+   if (((int) TraceLevel <= Switch) && !IsRateLimited(TraceSwitchId, TraceLevel))
    {
       va_list arg_list;
       va_start(arg_list, pStr);
-      //vsprintf(PrnBfr, pStr, arg_list);
-      vsnprintf(PrnBfr, sizeof(PrnBfr), pStr, arg_list);
+      Output(TraceSwitchId, TraceLevel, /*pSite*/pStr, pStr, &arg_list, NULL);
       va_end (arg_list);
-   
-      PrintIt(PrnBfr);
    }
    
 } // printf
@@ -146,26 +349,590 @@ void QTrace::printf(TraceLevelType TraceLevel, char pStr[], ...)
             Str
 */
 {
-   char PrnBfr[_TraceBfrSize];
    /* Get the trace threshold for this switch. */
-   //int Switch= (_TraceSwitches >> (TraceSwitchId*4)) & 0x0F;
    int Switch= GetTraceSwitch(/*TraceSwitchId*/ TS_DFLT);
    
    /* Does the given trace level meet the threshold specified in the switch? 
       If this trace entry is more verbose than setting, we ignore it. */
-   if ((int) TraceLevel <= Switch)
+   if (((int) TraceLevel <= Switch) && !IsRateLimited(TS_DFLT, TraceLevel))
    {
       va_list arg_list;
       va_start(arg_list, pStr);
-      //vsprintf(PrnBfr, pStr, arg_list);
-      vsnprintf(PrnBfr, sizeof(PrnBfr), pStr, arg_list);
+      Output(TS_DFLT, TraceLevel, /*pSite*/pStr, pStr, &arg_list, NULL);
       va_end (arg_list);
+   }
    
-      PrintIt(PrnBfr);
+} // printf
+/**************************************************************************************/
+void QTrace::printf(uint8_t TraceSwitchId, TraceLevelType TraceLevel, const __FlashStringHelper * pFormat, ...)
+/* Format string in flash.
+   Inputs:  TraceSwitchId  0..7
+            TraceLevel
+            pFormat        e.g. F("...")
+*/
+{ 
+   int Switch= GetTraceSwitch(TraceSwitchId);
+   
+   if (((int) TraceLevel <= Switch) && !IsRateLimited(TraceSwitchId, TraceLevel))
+   {
+      va_list arg_list;
+      va_start(arg_list, pFormat);
+      Output(TraceSwitchId, TraceLevel, /*pSite*/pFormat, (PGM_P) pFormat, &arg_list, NULL);
+      va_end (arg_list);
    }
    
 } // printf
+/**************************************************************************************/
+void QTrace::printf(TraceLevelType TraceLevel, const __FlashStringHelper * pFormat, ...)
+/* Format string in flash, output to default trace switch.
+   Inputs:  TraceLevel
+            pFormat        e.g. F("...")
+*/
+{
+   int Switch= GetTraceSwitch(/*TraceSwitchId*/ TS_DFLT);
+   
+   if (((int) TraceLevel <= Switch) && !IsRateLimited(TS_DFLT, TraceLevel))
+   {
+      va_list arg_list;
+      va_start(arg_list, pFormat);
+      Output(TS_DFLT, TraceLevel, /*pSite*/pFormat, (PGM_P) pFormat, &arg_list, NULL);
+      va_end (arg_list);
+   }
+   
+} // printf
+/**************************************************************************************/
+// Streamed Output
+/**************************************************************************************/
+void QTrace::Output(uint8_t TraceSwitchId, TraceLevelType TraceLevel, const void * pSite, PGM_P pFormat, va_list * pArgs, const QTraceRecord * pRecord)
+/* Formats the line straight into the sinks that take it, see Format().
+   If pSite is given, the line is first checked against the site's last line, see IsRepeat().
+   The site's format is fixed, so only its args are hashed, raw, without formatting them.
+   So floats that differ beyond the precision shown count as different lines.
+   Inputs:  pArgs          args for pFormat, or NULL if pRecord
+            pRecord        deferred trace, or NULL   */
+{
+   if (_Streaming)
+   {  /* Issued by a sink, e.g. on a publish error. */
+      _NestedDroppedCnt++;
+      return;
+   }
+
+   QTraceStream Stream;
+   if ((pSite != NULL) && (_DedupWindowMsec != 0) && (TraceLevel != TLT_Event))
+   {
+      va_list Args;
+      if (pArgs != NULL)
+         va_copy(Args, *pArgs);
+      BeginLine(Stream, /*Sinks*/0, TraceLevel);
+      Stream.HashArgs= true;
+      Format(Stream, pFormat, (pArgs != NULL)?(&Args):(NULL), pRecord);
+      EndLine(Stream, TraceLevel);
+      if (pArgs != NULL)
+         va_end(Args);
+
+      if (IsRepeat(pSite, Stream.Hash, TraceSwitchId, TraceLevel))
+         return;
+   }
 
+   _Streaming= true;
+   BeginLine(Stream, GetLineSinks(TraceSwitchId, TraceLevel), TraceLevel);
+   Format(Stream, pFormat, pArgs, pRecord);
+   EndLine(Stream, TraceLevel);
+   _Streaming= false;
+
+} // Output
+/**************************************************************************************/
+void QTrace::OutputP(uint8_t TraceSwitchId, TraceLevelType TraceLevel, const void * pSite, PGM_P pFormat, ...)
+/* As Output(), with the args given directly. Not rate limited. */
+{
+   va_list arg_list;
+   va_start(arg_list, pFormat);
+   Output(TraceSwitchId, TraceLevel, pSite, pFormat, &arg_list, NULL);
+   va_end (arg_list);
+
+} // OutputP
+/**************************************************************************************/
+void QTrace::EmitP(uint8_t Sinks, TraceLevelType TraceLevel, PGM_P pFormat, ...)
+/* Outputs to the given sinks, regardless of switches, dedup and nesting. */
+{
+   bool Streaming= _Streaming;
+   QTraceStream Stream;
+   va_list arg_list;
+   va_start(arg_list, pFormat);
 
+   _Streaming= true;
+   BeginLine(Stream, Sinks, TraceLevel);
+   Format(Stream, pFormat, &arg_list, NULL);
+   EndLine(Stream, TraceLevel);
+   _Streaming= Streaming;
 
+   va_end (arg_list);
+
+} // EmitP
+/**************************************************************************************/
+void QTrace::BeginLine(QTraceStream & Stream, uint8_t Sinks, TraceLevelType TraceLevel)
+{
+   Stream.Sinks= Sinks;
+   Stream.HashArgs= false;
+   Stream.ChunkLen= 0;
+   Stream.LineLen= 0;
+   Stream.Hash= 2166136261UL;                         // FNV-1a
+
+   for (int i= 0 ; i < TSK_Cnt ; i++)
+   {
+      if (Sinks & (1 << i))
+         _pSinks[i]->TraceBegin(TraceLevel);
+   }
+
+} // BeginLine
+/**************************************************************************************/
+void QTrace::FlushChunk(QTraceStream & Stream)
+{
+   if (Stream.ChunkLen > 0)
+   {
+      for (int i= 0 ; i < TSK_Cnt ; i++)
+      {
+         if (Stream.Sinks & (1 << i))
+            _pSinks[i]->TraceWrite(Stream.Chunk, Stream.ChunkLen);
+      }
+      Stream.ChunkLen= 0;
+   }
+
+} // FlushChunk
+/**************************************************************************************/
+void QTrace::EndLine(QTraceStream & Stream, TraceLevelType TraceLevel)
+{
+   FlushChunk(Stream);
+
+   for (int i= 0 ; i < TSK_Cnt ; i++)
+   {
+      if (Stream.Sinks & (1 << i))
+         _pSinks[i]->TraceEnd(TraceLevel);
+   }
+
+} // EndLine
+/**************************************************************************************/
+void QTrace::Put(QTraceStream & Stream, char Ch)
+/* Lines are cut at _TraceBfrSize-1 chars. */
+{
+   if (Stream.LineLen >= _TraceBfrSize - 1)
+      return;
+   Stream.LineLen++;
+   Stream.Hash= (Stream.Hash ^ (uint8_t) Ch) * 16777619UL;
+
+   if (Stream.Sinks != 0)
+   {
+      Stream.Chunk[Stream.ChunkLen++]= Ch;
+      if (Stream.ChunkLen >= QTRACE_CHUNK_SIZE)
+         FlushChunk(Stream);
+   }
+
+} // Put
+/**************************************************************************************/
+void QTrace::PutStr(QTraceStream & Stream, const char * pStr)
+{
+   while (*pStr != 0)
+      Put(Stream, *pStr++);
+
+} // PutStr
+/**************************************************************************************/
+void QTrace::HashValue(QTraceStream & Stream, unsigned long long Value)
+{
+   for (int i= 0 ; i < (int) sizeof(Value) ; i++)
+   {
+      Stream.Hash= (Stream.Hash ^ (uint8_t) Value) * 16777619UL;
+      Value>>= 8;
+   }
+
+} // HashValue
+/**************************************************************************************/
+void QTrace::ParseSpec(const char * pSpec, QTraceSpec & Spec)
+/* Parses the flags, width and precision of a conversion spec, e.g. "%-8.3lu". */
+{
+   memset(&Spec, 0, sizeof(Spec));
+   const char * pCh= pSpec + 1;
+   while ((*pCh != 0) && (strchr("-+ #0", *pCh) != NULL))
+   {
+      switch (*pCh++)
+      {
+         case '-':   Spec.LeftAlign= true;   break;
+         case '+':   Spec.Plus= true;        break;
+         case ' ':   Spec.Space= true;       break;
+         case '#':   Spec.Alt= true;         break;
+         case '0':   Spec.ZeroPad= true;     break;
+      }
+   }
+   Spec.Width= atoi(pCh);
+   while ((*pCh >= '0') && (*pCh <= '9'))
+      pCh++;
+   Spec.Precision= (*pCh == '.')?(atoi(pCh + 1)):(-1);
+
+} // ParseSpec
+/**************************************************************************************/
+void QTrace::PutSpecStr(QTraceStream & Stream, const QTraceSpec & Spec, const char * pStr)
+/* Outputs a %s conversion. pStr may be in flash or RAM. */
+{
+   if (pStr == NULL)
+      pStr= "(null)";
+   int Len= 0;
+   while (((Spec.Precision < 0) || (Len < Spec.Precision)) && (pgm_read_byte(pStr + Len) != 0))
+      Len++;
+
+   for (int i= Len ; !Spec.LeftAlign && (i < Spec.Width) ; i++)
+      Put(Stream, ' ');
+   for (int i= 0 ; i < Len ; i++)
+      Put(Stream, pgm_read_byte(pStr + i));
+   for (int i= Len ; Spec.LeftAlign && (i < Spec.Width) ; i++)
+      Put(Stream, ' ');
+
+} // PutSpecStr
+/**************************************************************************************/
+void QTrace::PutSpecInt(QTraceStream & Stream, const QTraceSpec & Spec, char Conversion, unsigned long long Value, bool Negative)
+/* Outputs an integer conversion, d i u o x X or p, of magnitude Value. */
+{
+   bool Signed= (Conversion == 'd') || (Conversion == 'i');
+   unsigned Base= (Conversion == 'o')?(8):(((Conversion == 'x') || (Conversion == 'X') || (Conversion == 'p'))?(16):(10));
+   const char * pDigitChars= (Conversion == 'X')?("0123456789ABCDEF"):("0123456789abcdef");
+
+   /* Digits, least significant first. 64 bit division only while needed. */
+   char Digits[24];
+   int Len= 0;
+   bool Zero= (Value == 0);
+   if (!Zero || (Spec.Precision != 0))
+   {
+      while (Value > 0xFFFFFFFFULL)
+      {
+         Digits[Len++]= pDigitChars[Value % Base];
+         Value/= Base;
+      }
+      uint32_t Value32= (uint32_t) Value;
+      do
+      {
+         Digits[Len++]= pDigitChars[Value32 % Base];
+         Value32/= Base;
+      } while (Value32 != 0);
+   }
+
+   char Prefix[2];
+   int PrefixLen= 0;
+   if (Signed && Negative)
+      Prefix[PrefixLen++]= '-';
+   else if (Signed && Spec.Plus)
+      Prefix[PrefixLen++]= '+';
+   else if (Signed && Spec.Space)
+      Prefix[PrefixLen++]= ' ';
+   else if ((Base == 16) && ((Spec.Alt && !Zero) || (Conversion == 'p')))
+   {
+      Prefix[PrefixLen++]= '0';
+      Prefix[PrefixLen++]= (Conversion == 'X')?('X'):('x');
+   }
+
+   int ZeroCnt= (Spec.Precision > Len)?(Spec.Precision - Len):(0);
+   if ((Base == 8) && Spec.Alt && (ZeroCnt == 0) && ((Len == 0) || (Digits[Len-1] != '0')))
+      ZeroCnt= 1;
+   int FieldLen= PrefixLen + ZeroCnt + Len;
+   if (!Spec.LeftAlign && Spec.ZeroPad && (Spec.Precision < 0) && (Spec.Width > FieldLen))
+   {
+      ZeroCnt+= Spec.Width - FieldLen;
+      FieldLen= Spec.Width;
+   }
+
+   for (int i= FieldLen ; !Spec.LeftAlign && (i < Spec.Width) ; i++)
+      Put(Stream, ' ');
+   for (int i= 0 ; i < PrefixLen ; i++)
+      Put(Stream, Prefix[i]);
+   for (int i= 0 ; i < ZeroCnt ; i++)
+      Put(Stream, '0');
+   while (Len > 0)
+      Put(Stream, Digits[--Len]);
+   for (int i= FieldLen ; Spec.LeftAlign && (i < Spec.Width) ; i++)
+      Put(Stream, ' ');
+
+} // PutSpecInt
+/**************************************************************************************/
+void QTrace::Format(QTraceStream & Stream, PGM_P pFormat, va_list * pArgs, const QTraceRecord * pRecord)
+/* Walks the format string, streaming the output. Only floating point conversions are
+   handed to snprintf, limited to QTRACE_CONV_SIZE. The format and %s args are read with
+   pgm_read_byte(), so may be in flash or RAM.
+   Args are taken from pArgs, or for a deferred trace from pRecord. Deferred args are held
+   at 32 bits, so their length modifiers are dropped, and the output is prefixed with the
+   time the trace was recorded, e.g. "@123456 ...".
+   With Stream.HashArgs, only the args are hashed: numbers by value, strings by content.   */
+{
+   int ArgIndex= 0;
+
+   if ((pRecord != NULL) && !Stream.HashArgs)
+   {
+      QTraceSpec TimeSpec;
+      ParseSpec("%u", TimeSpec);
+      Put(Stream, '@');
+      PutSpecInt(Stream, TimeSpec, 'u', pRecord->TimestampMsec, false);
+      Put(Stream, ' ');
+   }
+
+   const char * pFmt= pFormat;
+   char Ch;
+   while ((Ch= pgm_read_byte(pFmt++)) != 0)
+   {
+      if (Ch != '%')
+      {
+         if (!Stream.HashArgs)
+            Put(Stream, Ch);
+         continue;
+      }
+
+      /* Collect the spec, e.g. "%-8.3lu". A '*' width or precision is taken from the args. */
+      char Spec[16];
+      int SpecLen= 0;
+      Spec[SpecLen++]= '%';
+      Ch= pgm_read_byte(pFmt);
+      while ((Ch != 0) && (strchr("-+ #0123456789.*hlzjtL", Ch) != NULL))
+      {
+         if (Ch == '*')
+         {
+            int Value= 0;
+            if (pRecord == NULL)
+               Value= va_arg(*pArgs, int);
+            else if (ArgIndex < pRecord->ArgCnt)
+               Value= (int) pRecord->Args[ArgIndex++].U;
+            if ((Value < 0) && (Spec[SpecLen-1] != '.') && (SpecLen < (int) sizeof(Spec) - 2))
+            {  /* Negative width is left aligned. */
+               Spec[SpecLen++]= '-';
+               Value= -Value;
+            }
+            else if (Value < 0)
+               Value= 0;
+            if (Value > 9999)
+               Value= 9999;
+            for (int Divisor= 1000 ; Divisor > 0 ; Divisor/= 10)
+            {
+               if (((Value >= Divisor) || (Divisor == 1)) && (SpecLen < (int) sizeof(Spec) - 2))
+                  Spec[SpecLen++]= '0' + (Value / Divisor) % 10;
+            }
+         }
+         else if (((pRecord == NULL) || (strchr("hlzjtL", Ch) == NULL)) && (SpecLen < (int) sizeof(Spec) - 2))
+            Spec[SpecLen++]= Ch;
+         Ch= pgm_read_byte(++pFmt);
+      }
+      if (Ch == 0)
+         break;
+      char Conversion= Ch;
+      pFmt++;
+      Spec[SpecLen++]= Conversion;
+      Spec[SpecLen]= 0;
+
+      if (Conversion == '%')
+      {
+         Put(Stream, '%');
+         continue;
+      }
+      if ((pRecord != NULL) && (ArgIndex >= pRecord->ArgCnt))
+      {
+         PutStr(Stream, "<?>");
+         continue;
+      }
+
+      QTraceSpec ParsedSpec;
+      ParseSpec(Spec, ParsedSpec);
+      switch (Conversion)
+      {
+         case 's':
+            PutSpecStr(Stream, ParsedSpec, (pRecord != NULL)?((const char *) pRecord->Args[ArgIndex++].P):(va_arg(*pArgs, const char *)));
+            break;
+         case 'c':
+         {
+            char Str[2]= {(char) ((pRecord != NULL)?(pRecord->Args[ArgIndex++].U):(va_arg(*pArgs, int))), 0};
+            ParsedSpec.Precision= -1;
+            PutSpecStr(Stream, ParsedSpec, Str);
+            break;
+         }
+         case 'd': case 'i':
+         {
+            long long Value;
+            if (pRecord != NULL)
+               Value= (int32_t) pRecord->Args[ArgIndex++].U;
+            else if (strstr(Spec, "ll") != NULL)
+               Value= va_arg(*pArgs, long long);
+            else if (strpbrk(Spec, "lzjt") != NULL)
+               Value= va_arg(*pArgs, long);
+            else if (strstr(Spec, "hh") != NULL)
+               Value= (signed char) va_arg(*pArgs, int);
+            else if (strchr(Spec, 'h') != NULL)
+               Value= (short) va_arg(*pArgs, int);
+            else
+               Value= va_arg(*pArgs, int);
+            if (Stream.HashArgs)
+               HashValue(Stream, Value);
+            else
+               PutSpecInt(Stream, ParsedSpec, Conversion, (Value < 0)?(0ULL - (unsigned long long) Value):(Value), (Value < 0));
+            break;
+         }
+         case 'u': case 'o': case 'x': case 'X':
+         {
+            unsigned long long Value;
+            if (pRecord != NULL)
+               Value= pRecord->Args[ArgIndex++].U;
+            else if (strstr(Spec, "ll") != NULL)
+               Value= va_arg(*pArgs, unsigned long long);
+            else if (strpbrk(Spec, "lzjt") != NULL)
+               Value= va_arg(*pArgs, unsigned long);
+            else if (strstr(Spec, "hh") != NULL)
+               Value= (unsigned char) va_arg(*pArgs, unsigned int);
+            else if (strchr(Spec, 'h') != NULL)
+               Value= (unsigned short) va_arg(*pArgs, unsigned int);
+            else
+               Value= va_arg(*pArgs, unsigned int);
+            if (Stream.HashArgs)
+               HashValue(Stream, Value);
+            else
+               PutSpecInt(Stream, ParsedSpec, Conversion, Value, false);
+            break;
+         }
+         case 'p':
+         {
+            uintptr_t Value= (uintptr_t) ((pRecord != NULL)?(pRecord->Args[ArgIndex++].P):(va_arg(*pArgs, void *)));
+            if (Stream.HashArgs)
+               HashValue(Stream, Value);
+            else
+               PutSpecInt(Stream, ParsedSpec, Conversion, Value, false);
+            break;
+         }
+         case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+         {
+            char ConvBfr[QTRACE_CONV_SIZE];
+            if (Stream.HashArgs)
+            {
+               double Value;
+               if (pRecord != NULL)
+                  Value= pRecord->Args[ArgIndex++].F;
+               else if (strchr(Spec, 'L') != NULL)
+                  Value= (double) va_arg(*pArgs, long double);
+               else
+                  Value= va_arg(*pArgs, double);
+               unsigned long long Bits;
+               memcpy(&Bits, &Value, sizeof(Bits));
+               HashValue(Stream, Bits);
+               break;
+            }
+            if (pRecord != NULL)
+               snprintf(ConvBfr, sizeof(ConvBfr), Spec, (double) pRecord->Args[ArgIndex++].F);
+            else if (strchr(Spec, 'L') != NULL)
+               snprintf(ConvBfr, sizeof(ConvBfr), Spec, va_arg(*pArgs, long double));
+            else
+               snprintf(ConvBfr, sizeof(ConvBfr), Spec, va_arg(*pArgs, double));
+            PutStr(Stream, ConvBfr);
+            break;
+         }
+         default:                                        // e.g. %n, not supported
+            if (pRecord != NULL)
+               ArgIndex++;
+            else
+               (void) va_arg(*pArgs, void *);
+            break;
+      }
+   }
+
+} // Format
+/**************************************************************************************/
+// Deferred Traces
+/**************************************************************************************/
+QTraceRecord * QTrace::AllocDeferred(uint8_t TraceSwitchId, TraceLevelType TraceLevel, const char * pFormat, uint8_t ArgCnt)
+/* Claims the next ring record for printd(), filling all but the args.
+   Returns: NULL if the ring is full.  */
+{
+   QTraceRecord * pRecord= NULL;
+
+   if (_DeferredCnt >= QTRACE_DEFERRED_CNT)
+      _DeferredDroppedCnt++;
+   else
+   {
+      pRecord= &_DeferredRing[(_DeferredHead + _DeferredCnt) % QTRACE_DEFERRED_CNT];
+      _DeferredCnt++;
+
+      pRecord->pFormat= pFormat;
+      pRecord->TimestampMsec= QTimestamp::GetTickMsec();
+      pRecord->TraceSwitchId= TraceSwitchId;
+      pRecord->TraceLevel= TraceLevel;
+      pRecord->ArgCnt= ArgCnt;
+   }
+
+   return pRecord;
+
+} // AllocDeferred
+/**************************************************************************************/
+void QTrace::DoService()
+/* Outputs the deferred traces recorded since the last call, oldest first. */
+{
+   while (_DeferredCnt > 0)
+   {
+      QTraceRecord * pRecord= &_DeferredRing[_DeferredHead];
+      TraceLevelType TraceLevel= (TraceLevelType) pRecord->TraceLevel;
+      _DeferredHead= (_DeferredHead + 1) % QTRACE_DEFERRED_CNT;
+      _DeferredCnt--;
+
+      if (!IsRateLimited(pRecord->TraceSwitchId, TraceLevel))
+         Output(pRecord->TraceSwitchId, TraceLevel, /*pSite*/pRecord->pFormat, pRecord->pFormat, NULL, pRecord);
+   }
+
+   /* Report repeats that have been suppressed for the dedup window. */
+   for (int i= 0 ; i < QTRACE_DEDUP_CNT ; i++)
+   {
+      if ((_Dedup[i].RepeatCnt > 0) && (QTimestamp::GetTickMsec() - _Dedup[i].FirstRepeatMsec >= _DedupWindowMsec))
+         ReportRepeats(_Dedup[i]);
+   }
+
+   if (_DeferredDroppedCnt != _DeferredDroppedReportedCnt)
+   {
+      printf(TS_SERVICES, TLT_Warning, F("QTrace: %lu deferred traces dropped, ring full."), 
+         (unsigned long) (_DeferredDroppedCnt - _DeferredDroppedReportedCnt));
+      _DeferredDroppedReportedCnt= _DeferredDroppedCnt;
+   }
+
+   if (_NestedDroppedCnt != _NestedDroppedReportedCnt)
+   {
+      printf(TS_SERVICES, TLT_Warning, F("QTrace: %lu traces dropped, issued from within trace output."),
+         (unsigned long) (_NestedDroppedCnt - _NestedDroppedReportedCnt));
+      _NestedDroppedReportedCnt= _NestedDroppedCnt;
+   }
+
+   if ((_RateDroppedCnt != _RateDroppedReportedCnt) && ((int) TLT_Warning <= GetTraceSwitch(TS_SERVICES)))
+   {  /* Output directly, else the report could itself be over the rate. */
+      OutputP(TS_SERVICES, TLT_Warning, /*pSite*/NULL, PSTR("QTrace: %lu lines dropped, over switch rate limit."),
+         (unsigned long) (_RateDroppedCnt - _RateDroppedReportedCnt));
+      _RateDroppedReportedCnt= _RateDroppedCnt;
+   }
+
+} // DoService
+
+
+/**************************************************************************************/
+// QTraceLineSink
+/**************************************************************************************/
+QTraceLineSink::QTraceLineSink()
+{
+   _pCallback= NULL;
+   _pLevelCallback= NULL;
+   _pLineBfr= new char[QTrace::_TraceBfrSize];
+   _LineLen= 0;
+
+} // QTraceLineSink
+/**************************************************************************************/
+void QTraceLineSink::TraceWrite(const char * pStr, int Len)
+{
+   if (_LineLen + Len > QTrace::_TraceBfrSize - 1)
+      Len= QTrace::_TraceBfrSize - 1 - _LineLen;
+   memcpy(&_pLineBfr[_LineLen], pStr, Len);
+   _LineLen+= Len;
+
+} // TraceWrite
+/**************************************************************************************/
+void QTraceLineSink::TraceEnd(TraceLevelType TraceLevel)
+{
+   _pLineBfr[_LineLen]= 0;
+
+   if (_pCallback != NULL)
+      _pCallback(_pLineBfr);
+   if (_pLevelCallback != NULL)
+      _pLevelCallback(_pLineBfr, TraceLevel);
 
+} // TraceEnd
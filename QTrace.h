@@ -11,6 +11,24 @@
 #include <inttypes.h>
 #include <assert.h>
 
+/* Deferred trace ring size, in records. See QTrace::printd(). */
+#ifndef QTRACE_DEFERRED_CNT
+#define QTRACE_DEFERRED_CNT            32
+#endif
+#define QTRACE_DEFERRED_MAX_ARGS       6
+
+/* Duplicate suppression table size, in call sites. See QTrace::SetDedupWindow(). */
+#ifndef QTRACE_DEDUP_CNT
+#define QTRACE_DEDUP_CNT               8
+#endif
+
+/* Streamed output. Lines are formatted in chunks of QTRACE_CHUNK_SIZE, each written to the
+   sinks as it fills, so no whole line is held on the stack. A floating point conversion is
+   limited to QTRACE_CONV_SIZE chars.   */
+#ifndef QTRACE_CHUNK_SIZE
+#define QTRACE_CHUNK_SIZE              64
+#endif
+#define QTRACE_CONV_SIZE               40
 
 /**************************************************************************************/
 enum TraceLevelType
@@ -36,11 +54,157 @@ enum
    TRACE_SWITCH_WIFI=                  TRACE_SWITCH_INTERNAL_START,
    TRACE_SWITCH_MQTT,
    TRACE_SWITCH_LIB,
-   TS_SERVICES=                        TRACE_SWITCH_LIB
+   TS_SERVICES=                        TRACE_SWITCH_LIB,
+   TRACE_SWITCH_RADIO,
+   TS_RADIO=                           TRACE_SWITCH_RADIO,
+
+   TRACE_SWITCH_CNT=                   8              // A nibble each in the 32 bit switches
 };
 
+/* Trace output sinks. Each has its own trace switches, see QTrace::SetSinkSwitches(). */
+enum TraceSinkType
+{
+   TSK_Serial=                         0,
+   TSK_Callback,                                      // SetCallback(), e.g. mqtt
+   TSK_Log,                                           // SetLog(), e.g. flash
+   TSK_Web,                                           // SetSink(TSK_Web, ...), e.g. a status page
+   TSK_Cnt
+};
+
+/* Compile-time trace levels, per trace switch. QTRACE() calls more verbose than these are
+   removed from the build, along with their args and format strings. Override from the
+   build flags, e.g. -DQTRACE_LEVEL_SERVICES=TLT_Warning. The runtime switches still apply
+   to whatever is compiled in.  */
+#ifndef QTRACE_LEVEL_APP
+#define QTRACE_LEVEL_APP               TLT_Max        // Switches 0..3
+#endif
+#ifndef QTRACE_LEVEL_WIFI
+#define QTRACE_LEVEL_WIFI              TLT_Max
+#endif
+#ifndef QTRACE_LEVEL_MQTT
+#define QTRACE_LEVEL_MQTT              TLT_Max
+#endif
+#ifndef QTRACE_LEVEL_SERVICES
+#define QTRACE_LEVEL_SERVICES          TLT_Max
+#endif
+#ifndef QTRACE_LEVEL_RADIO
+#define QTRACE_LEVEL_RADIO             TLT_Verbose    // TLT_Max adds pulse level decode traces
+#endif
+
+/* Trace front-ends. Use in place of _Trace.printf()/printd(); TraceSwitchId and TraceLevel
+   must be constants for the call to compile out. pFormat must be a string literal, it is
+   placed in flash.   */
+#define QTRACE(TraceSwitchId, TraceLevel, pFormat, ...) \
+   do { if (QTrace::IsCompiled(TraceSwitchId, TraceLevel)) _Trace.printf(TraceSwitchId, TraceLevel, F(pFormat), ##__VA_ARGS__); } while (0)
+#define QTRACED(TraceSwitchId, TraceLevel, pFormat, ...) \
+   do { if (QTrace::IsCompiled(TraceSwitchId, TraceLevel)) _Trace.printd(TraceSwitchId, TraceLevel, PSTR(pFormat), ##__VA_ARGS__); } while (0)
+
 typedef uint32_t  QTraceSwitch;
 
+class QTraceLog;
+class QRateLimiter;
+
+/**************************************************************************************/
+/* Deferred trace record. Holds a trace unformatted: the format string pointer, time and
+   the raw args. Integers are held as 32 bits, floating point as float.     */
+union QTraceArg
+{
+   uint32_t                U;
+   float                   F;
+   const void *            P;
+};
+
+struct QTraceRecord
+{
+   const char *            pFormat;
+   uint32_t                TimestampMsec;
+   uint8_t                 TraceSwitchId;
+   uint8_t                 TraceLevel;
+   uint8_t                 ArgCnt;
+   QTraceArg               Args[QTRACE_DEFERRED_MAX_ARGS];
+};
+
+/* Duplicate suppression entry. A call site is identified by its format string pointer, switch
+   and level. The linker may merge identical format literals, so sites sharing all three share
+   an entry; their lines then only count as repeats when the text is identical too. */
+struct QTraceDedup
+{
+   const void *            pFormat;
+   uint32_t                Hash;                      // of the last line output from this site
+   uint32_t                FirstRepeatMsec;
+   uint16_t                RepeatCnt;                 // suppressed since that line, or the last summary
+   uint8_t                 TraceSwitchId;
+   uint8_t                 TraceLevel;
+};
+
+/* Conversion spec flags, width and precision, see QTrace::Format(). */
+struct QTraceSpec
+{
+   bool                    LeftAlign;
+   bool                    ZeroPad;
+   bool                    Plus;
+   bool                    Space;
+   bool                    Alt;
+   int                     Width;
+   int                     Precision;                 // -1 if none
+};
+
+/* A line being streamed to the sinks, see QTrace::Output(). */
+struct QTraceStream
+{
+   uint8_t                 Sinks;                     // bit per TraceSinkType, 0 to only hash the line
+   bool                    HashArgs;                  // Hash only the raw args, see QTrace::Output()
+   uint8_t                 ChunkLen;
+   uint16_t                LineLen;
+   uint32_t                Hash;                      // FNV-1a of the line, for duplicate suppression
+   char                    Chunk[QTRACE_CHUNK_SIZE];
+};
+
+/**************************************************************************************/
+/* QTraceSink - trace output destination. A line is given as TraceBegin(), then one or more
+   TraceWrite() calls with its text in chunks, then TraceEnd(). Chunks are not terminated.
+   Note- called from within trace output, so must not trace.   */
+/**************************************************************************************/
+class QTraceSink
+{
+   public:
+   virtual void            TraceBegin(TraceLevelType TraceLevel){}
+   virtual void            TraceWrite(const char * pStr, int Len)= 0;
+   virtual void            TraceEnd(TraceLevelType TraceLevel){}
+};
+
+/* Serial output. */
+class QTraceSerialSink : public QTraceSink
+{
+   public:
+   virtual void            TraceWrite(const char * pStr, int Len){Serial.write((const uint8_t *) pStr, Len);}
+   virtual void            TraceEnd(TraceLevelType TraceLevel){Serial.print("\n");}
+};
+
+/* Adapts whole line callbacks, see QTrace::SetCallback(). Collects the line into a heap buffer. */
+class QTraceLineSink : public QTraceSink
+{
+   ///////////////////////////////////////////////////////////
+   // Data
+   ///////////////////////////////////////////////////////////
+   public:
+   void                    (* _pCallback)(const char *);
+   void                    (* _pLevelCallback)(const char *, TraceLevelType);
+
+   protected:
+   char *                  _pLineBfr;
+   int                     _LineLen;
+
+   ///////////////////////////////////////////////////////////
+   // Methods
+   ///////////////////////////////////////////////////////////
+   public:
+                           QTraceLineSink();
+   virtual void            TraceBegin(TraceLevelType TraceLevel){_LineLen= 0;}
+   virtual void            TraceWrite(const char * pStr, int Len);
+   virtual void            TraceEnd(TraceLevelType TraceLevel);
+};
+
 /**************************************************************************************/
 /* ASSERT   */
 /**************************************************************************************/
@@ -61,6 +225,10 @@ typedef uint32_t  QTraceSwitch;
    Can output to:
       Serial
       Generic callbacks - e.g. to MQTT
+      Log - e.g. to flash, see QTraceLog
+      Web - any QTraceSink, set with SetSink(TSK_Web, ...)
+   Each output (sink) has its own trace switches, e.g. Verbose to serial, Warning to MQTT.
+   Lines are formatted in chunks straight into the sinks, see QTraceSink.
    
    Note that calls to this class can be issued even when everything is disabled. Therefore,
    trace statements can always be active in code (not surrounded by #ifdef statements).
@@ -80,7 +248,9 @@ class QTrace
    static const uint32_t   _TraceSwitchesLevel_Verbose=  0x55555555;
    static const uint32_t   _TraceSwitchesLevel_Max=      0x77777777;
 
-   static const int        _TraceBfrSize=    511;
+   static const int        _TraceBfrSize=    511;      // Max line length, +1
+
+   static QTraceSerialSink _SerialSink;
    
    ///////////////////////////////////////////////////////////
    protected:
@@ -88,15 +258,42 @@ class QTrace
       application to enable tracing in desired sections. It takes the caller's given position (0..7) and level, and checks it against the trace level 
       specified here.
       The level specified in the switch indicates the max reporting level. The caller's level must be less than or equal to this to be reported.
+      Each sink has its own switches. _TraceSwitches holds, per nibble, the most verbose of the enabled sinks'. It is
+      checked first, so that a line no sink takes is not formatted.
    */
    uint32_t                _TraceSwitches;
+   uint32_t                _SinkSwitches[TSK_Cnt];
    
-   /* Output destinations. Note that more than one can be active at a time. */
-   bool                    _EnbSerial;
+   /* Output destinations, NULL if disabled. Note that more than one can be active at a time. */
+   QTraceSink *            _pSinks[TSK_Cnt];
 
-   /* Optional pointer to callback function. e.g. to trace to mqtt.
-      Called by print().      */
-   void                    (* _pCallback)(const char *);
+   /* Line callbacks, if set by SetCallback(). */
+   QTraceLineSink *        _pLineSink;
+
+   /* Optional persistent log, see QTraceLog. */
+   QTraceLog *             _pLog;
+
+   /* A line is being written to the sinks. Traces issued by a sink meanwhile are dropped. */
+   bool                    _Streaming;
+   uint32_t                _NestedDroppedCnt;
+   uint32_t                _NestedDroppedReportedCnt;
+
+   /* Duplicate suppression, see IsRepeat(). */
+   QTraceDedup             _Dedup[QTRACE_DEDUP_CNT];
+   uint8_t                 _DedupNextIndex;           // round robin replacement
+   uint32_t                _DedupWindowMsec;
+
+   /* Optional rate limit per trace switch, NULL if unlimited. */
+   QRateLimiter *          _pRateLimiters[TRACE_SWITCH_CNT];
+   uint32_t                _RateDroppedCnt;
+   uint32_t                _RateDroppedReportedCnt;
+
+   /* Deferred traces, pending formatting by DoService(). */
+   QTraceRecord            _DeferredRing[QTRACE_DEFERRED_CNT];
+   uint8_t                 _DeferredHead;
+   uint8_t                 _DeferredCnt;
+   uint32_t                _DeferredDroppedCnt;
+   uint32_t                _DeferredDroppedReportedCnt;
    
    ///////////////////////////////////////////////////////////
    // Methods
@@ -105,23 +302,78 @@ class QTrace
    static QTrace *         Master(){return _pMasterObject;}
    static void             Assert(const char * __file, int __lineno, const char * __func, const char * __sexp, const char * pMsg);
 
+   /* Compile-time level for a trace switch, see QTRACE_LEVEL_xx. */
+   static constexpr int    GetCompiledLevel(uint8_t TraceSwitchId)
+   {
+      return (TraceSwitchId == TRACE_SWITCH_WIFI)?(QTRACE_LEVEL_WIFI):
+             (TraceSwitchId == TRACE_SWITCH_MQTT)?(QTRACE_LEVEL_MQTT):
+             (TraceSwitchId == TRACE_SWITCH_LIB)?(QTRACE_LEVEL_SERVICES):
+             (TraceSwitchId == TRACE_SWITCH_RADIO)?(QTRACE_LEVEL_RADIO):
+             (QTRACE_LEVEL_APP);
+   }
+   static constexpr bool   IsCompiled(uint8_t TraceSwitchId, TraceLevelType TraceLevel)
+   {
+      return ((int) TraceLevel <= GetCompiledLevel(TraceSwitchId));
+   }
+
    /* Assert callback. */
    //static void __assert(const char *__func, const char *__file, int __lineno, const char *__sexp);
 
    ///////////////////////////////////////////////////////////
    public:
                            QTrace();
-   void                    SetTraceToSerial(bool On){_EnbSerial= On;} 
+   void                    SetTraceToSerial(bool On);
 
    /* Sets an optional callback to an external function for hooking into trace output.
       This allows output of trace information to other channels, e.g. mqtt, local display, etc.
       Note that callback function is responsible for immediately flushing the string, it is not guaranteed
-      to be persistent.    */                           
+      to be persistent.
+      Function callbacks are given whole lines, collected into a heap buffer of _TraceBfrSize. 
+      A QTraceSink is given the line in chunks, e.g. QMQTT. Replaces any function callbacks. */
    void                    SetCallback(void (* pCallback)(const char *));
+   void                    SetCallback(void (* pCallback)(const char *, TraceLevelType));
+   void                    SetCallback(QTraceSink * pSink){SetSink(TSK_Callback, pSink);}
+
+   /* Sets an optional log to keep trace output in, e.g. to flash. Asserts are always logged. */
+   void                    SetLog(QTraceLog * pLog);
+
+   /* Sets the output for a sink, NULL disables it. */
+   void                    SetSink(TraceSinkType Sink, QTraceSink * pSink);
 
-   /* Sets all of the trace switches to the specified level. */
+   /* Sets all of the trace switches to the specified level, for all sinks. */
    void                    SetTraceSwitch(uint32_t TraceSwitches);
 
+   /* Sets the trace switches of one sink, e.g. SetSinkSwitches(TSK_Callback, _TraceSwitchesLevel_Warning).
+      Applies once the sink is enabled, e.g. by SetCallback().  */
+   void                    SetSinkSwitches(TraceSinkType Sink, uint32_t TraceSwitches);
+   uint32_t                GetSinkSwitches(TraceSinkType Sink){return _SinkSwitches[Sink];}
+
+   /* Sets the level nibble of one trace switch, leaving the others, for one sink or for all
+      with TSK_Cnt. For runtime changes, e.g. raising one module to Verbose while debugging it.
+      Levels above the compiled level, see QTRACE_LEVEL_APP etc, still do not output.
+      Returns: false if TraceSwitchId or TraceLevel is out of range. */
+   bool                    SetTraceSwitchLevel(TraceSinkType Sink, uint8_t TraceSwitchId, TraceLevelType TraceLevel);
+   bool                    IsSinkEnabled(TraceSinkType Sink);
+
+   /* Returns: true if a line of this switch and level would reach any sink, e.g. to skip
+      work whose only result is the trace. */
+   bool                    IsOutput(uint8_t TraceSwitchId, TraceLevelType TraceLevel)
+   {
+      return IsCompiled(TraceSwitchId, TraceLevel) && (GetLineSinks(TraceSwitchId, TraceLevel) != 0);
+   }
+
+   /* Duplicate suppression. A line identical to the last one from the same call site, see
+      QTraceDedup, is not output, and is counted. The count is reported as "Last message
+      repeated N times" before the site's next different line, or after WindowMsec. 0 disables.
+      Event lines are exempt, as are print() lines, whose text is not at a fixed call site.   */
+   void                    SetDedupWindow(unsigned long WindowMsec){_DedupWindowMsec= WindowMsec;}
+
+   /* Limits a trace switch to Lines per PeriodMsec, bursts of up to Burst. Checked before
+      formatting, so lines over the limit cost little. Lines == 0 removes the limit.
+      Event and Error lines are exempt. Ignored if TraceSwitchId is out of range.   */
+   void                    SetRateLimit(uint8_t TraceSwitchId, uint16_t Lines, uint32_t PeriodMsec, uint16_t Burst);
+   unsigned long           GetRateDroppedCnt(){return _RateDroppedCnt;}
+
    /* Trace print output methods.
       TraceSwitchId: 0..7
    */      
@@ -130,11 +382,82 @@ class QTrace
 
    void                    printf(uint8_t TraceSwitchId, TraceLevelType TraceLevel, char pStr[], ...);
    void                    printf(TraceLevelType TraceLevel, char pStr[], ...);  // uses default switch
+
+   /* As printf(), with the format string in flash, e.g. F("...") or PSTR("..."). Saves
+      the RAM otherwise taken by the literal. */
+   void                    printf(uint8_t TraceSwitchId, TraceLevelType TraceLevel, const __FlashStringHelper * pFormat, ...);
+   void                    printf(TraceLevelType TraceLevel, const __FlashStringHelper * pFormat, ...);
+
+   /* Deferred printf, for time critical paths. Records the format pointer, time and args
+      into a ring, DoService() formats and outputs them later. Cost is the level check and
+      a few stores.
+      The format string and any %s args must be persistent, e.g. literals: only the
+      pointers are kept. The format string may be in flash (PSTR()). Args are limited to QTRACE_DEFERRED_MAX_ARGS, 32 bit integers,
+      floating point and pointers. Not for use from ISRs.
+      Traces arriving when the ring is full are dropped, and the count reported.   */
+   template<typename... ArgsT>
+   void                    printd(uint8_t TraceSwitchId, TraceLevelType TraceLevel, const char * pFormat, ArgsT... Args)
+   {
+      static_assert(sizeof...(ArgsT) <= QTRACE_DEFERRED_MAX_ARGS, "QTrace::printd(): too many args");
+      if ((int) TraceLevel <= GetTraceSwitch(TraceSwitchId))
+      {
+         QTraceRecord * pRecord= AllocDeferred(TraceSwitchId, TraceLevel, pFormat, sizeof...(ArgsT));
+         if (pRecord != NULL)
+         {
+            QTraceArg * pArg= pRecord->Args;
+            int Unused[]= {0, (PackArg(*pArg++, Args), 0)...};
+            (void) Unused;
+         }
+      }
+   }
+
+   /* Formats and outputs pending deferred traces, and reports suppressed repeats and
+      dropped lines. Called from the main loop. */
+   void                    DoService();
+   unsigned long           GetDeferredDroppedCnt(){return _DeferredDroppedCnt;}
    
    protected:
    void                    Init();
    uint8_t                 GetTraceSwitch(uint8_t TraceSwitchId);
-   void                    PrintIt(const char * pStr);
+   void                    UpdateTraceSwitches();
+   bool                    IsSinkOutput(TraceSinkType Sink, uint8_t TraceSwitchId, TraceLevelType TraceLevel)
+   {
+      return ((int) TraceLevel <= (int) ((_SinkSwitches[Sink] >> (TraceSwitchId*4)) & 0x0F));
+   }
+   uint8_t                 GetLineSinks(uint8_t TraceSwitchId, TraceLevelType TraceLevel);
+
+   bool                    IsRateLimited(uint8_t TraceSwitchId, TraceLevelType TraceLevel);
+   bool                    IsRepeat(const void * pSite, uint32_t Hash, uint8_t TraceSwitchId, TraceLevelType TraceLevel);
+   void                    ReportRepeats(QTraceDedup & Entry);
+
+   /* Streamed output. */
+   void                    Output(uint8_t TraceSwitchId, TraceLevelType TraceLevel, const void * pSite, PGM_P pFormat, va_list * pArgs, const QTraceRecord * pRecord);
+   void                    OutputP(uint8_t TraceSwitchId, TraceLevelType TraceLevel, const void * pSite, PGM_P pFormat, ...);
+   void                    EmitP(uint8_t Sinks, TraceLevelType TraceLevel, PGM_P pFormat, ...);
+   void                    BeginLine(QTraceStream & Stream, uint8_t Sinks, TraceLevelType TraceLevel);
+   void                    EndLine(QTraceStream & Stream, TraceLevelType TraceLevel);
+   void                    FlushChunk(QTraceStream & Stream);
+   void                    Put(QTraceStream & Stream, char Ch);
+   void                    PutStr(QTraceStream & Stream, const char * pStr);
+   void                    HashValue(QTraceStream & Stream, unsigned long long Value);
+   void                    PutSpecStr(QTraceStream & Stream, const QTraceSpec & Spec, const char * pStr);
+   void                    PutSpecInt(QTraceStream & Stream, const QTraceSpec & Spec, char Conversion, unsigned long long Value, bool Negative);
+   static void             ParseSpec(const char * pSpec, QTraceSpec & Spec);
+   void                    Format(QTraceStream & Stream, PGM_P pFormat, va_list * pArgs, const QTraceRecord * pRecord);
+
+   /* Deferred trace support. */
+   QTraceRecord *          AllocDeferred(uint8_t TraceSwitchId, TraceLevelType TraceLevel, const char * pFormat, uint8_t ArgCnt);
+
+   static void             PackArg(QTraceArg & Arg, float Value){Arg.F= Value;}
+   static void             PackArg(QTraceArg & Arg, double Value){Arg.F= (float) Value;}
+   template<typename T>
+   static void             PackArg(QTraceArg & Arg, T * pValue){Arg.P= pValue;}
+   template<typename T>
+   static void             PackArg(QTraceArg & Arg, T Value)
+   {
+      static_assert(sizeof(T) <= sizeof(long), "QTrace::printd(): 64 bit args not supported");
+      Arg.U= (uint32_t) Value;
+   }
    
 }; // QTrace
 
@@ -0,0 +1,170 @@
+///////////////////////////////////////////////////////////////////////////////
+// :mode=c:
+/*  QTraceLog.cpp
+*/
+///////////////////////////////////////////////////////////////////////////////
+#include "QTraceLog.h"
+
+/**************************************************************************************/
+QTraceLog::QTraceLog()
+{
+   Init();
+
+} // QTraceLog
+/**************************************************************************************/
+void QTraceLog::Init()
+{
+   _HeadIndex= 0;
+   _UnflushedCnt= 0;
+   _Flushing= false;
+   _InLine= false;
+   _LineLen= 0;
+   _FlushCnt= 0;
+   _LostCnt= 0;
+
+   _pLogFile= new QFile(_pLogFileName);
+   _pPrevFile= new QFile(_pPrevFileName);
+
+   /* Keep the last session's log for publishing, start this session's afresh. */
+   _PrevAvailable= false;
+   if (_pLogFile->Exists())
+      _PrevAvailable= _pLogFile->Rename(_pPrevFileName);
+   _FileSize= 0;
+
+   _pFlushTimer= new QTimer(_FlushMsecDflt,/*Repeat*/true,/*Start*/true);
+   _pFlushTimer->SetName("TraceLog.Flush");
+   _pFlushTimer->SetSlack(/*msec*/1000);
+   _UrgentFlushRateLimiter.Set(/*Flushes*/2, /*msec*/60 * 1000, /*Burst*/5);
+   _UrgentFlushPending= false;
+
+} // Init
+/**************************************************************************************/
+void QTraceLog::Put(const char * pStr, int Len)
+/* Copies into the ring, overwriting the oldest data once full. */
+{
+   for (int i= 0 ; i < Len ; i++)
+   {
+      _Ring[_HeadIndex]= pStr[i];
+      _HeadIndex= (_HeadIndex + 1) % QTRACE_LOG_RING_SIZE;
+   }
+
+   if (_UnflushedCnt + Len > QTRACE_LOG_RING_SIZE)
+   {
+      _LostCnt+= _UnflushedCnt + Len - QTRACE_LOG_RING_SIZE;
+      _UnflushedCnt= QTRACE_LOG_RING_SIZE;
+   }
+   else
+      _UnflushedCnt+= Len;
+
+} // Put
+/**************************************************************************************/
+void QTraceLog::Add(const char * pLine, TraceLevelType TraceLevel)
+{
+   TraceBegin(TraceLevel);
+   TraceWrite(pLine, strlen(pLine));
+   TraceEnd(TraceLevel);
+
+} // Add
+/**************************************************************************************/
+void QTraceLog::TraceBegin(TraceLevelType TraceLevel)
+{
+   _InLine= !_Flushing;                            // else e.g. a file error traced by QFile
+   if (!_InLine)
+      return;
+
+   char Prefix[12+1];
+   int PrefixLen= snprintf(Prefix, sizeof(Prefix), "%lu: ", (unsigned long) QTimestamp::GetNowTimeMsec());
+   Put(Prefix, PrefixLen);
+   _LineLen= 0;
+
+} // TraceBegin
+/**************************************************************************************/
+void QTraceLog::TraceWrite(const char * pStr, int Len)
+{
+   if (!_InLine)
+      return;
+
+   if (_LineLen + Len > QTRACE_LOG_RING_SIZE / 2)
+      Len= QTRACE_LOG_RING_SIZE / 2 - _LineLen;    // so that one line cannot evict the rest
+   if (Len > 0)
+   {
+      Put(pStr, Len);
+      _LineLen+= Len;
+   }
+
+} // TraceWrite
+/**************************************************************************************/
+void QTraceLog::TraceEnd(TraceLevelType TraceLevel)
+{
+   if (!_InLine)
+      return;
+   _InLine= false;
+   Put("\n", 1);
+
+   /* Events and errors, incl asserts, are written right away in case a reset follows. */
+   if ((TraceLevel <= TLT_Error) && !_Flushing)
+   {
+      if (_UrgentFlushRateLimiter.TryAcquire())
+         Flush();
+      else if (!_UrgentFlushPending)
+      {
+         _UrgentFlushRateLimiter.RecordDeferred();
+         _UrgentFlushPending= true;
+      }
+   }
+
+} // TraceEnd
+/**************************************************************************************/
+void QTraceLog::Flush()
+{
+   if ((_UnflushedCnt == 0) || _Flushing)
+      return;
+
+   _Flushing= true;
+
+   if (_FileSize + _UnflushedCnt > QTRACE_LOG_FILE_SIZE)
+   {  /* Rotate. */
+      _pLogFile->Rename(_pOldFileName);
+      _FileSize= 0;
+   }
+
+   /* If the ring overran, the oldest line is partial. Start at the next one. */
+   int StartIndex= (_HeadIndex + QTRACE_LOG_RING_SIZE - _UnflushedCnt) % QTRACE_LOG_RING_SIZE;
+   if (_UnflushedCnt == QTRACE_LOG_RING_SIZE)
+   {
+      while ((_UnflushedCnt > 0) && (_Ring[StartIndex] != '\n'))
+      {
+         StartIndex= (StartIndex + 1) % QTRACE_LOG_RING_SIZE;
+         _UnflushedCnt--;
+      }
+      if (_UnflushedCnt > 0)
+      {
+         StartIndex= (StartIndex + 1) % QTRACE_LOG_RING_SIZE;
+         _UnflushedCnt--;
+      }
+   }
+
+   /* Append the unwritten span, in two parts if it wraps. */
+   if (StartIndex + _UnflushedCnt <= QTRACE_LOG_RING_SIZE)
+      _FileSize+= _pLogFile->Append(&_Ring[StartIndex], _UnflushedCnt);
+   else
+   {
+      _FileSize+= _pLogFile->Append(&_Ring[StartIndex], QTRACE_LOG_RING_SIZE - StartIndex);
+      _FileSize+= _pLogFile->Append(_Ring, _HeadIndex);
+   }
+   _UnflushedCnt= 0;
+   _UrgentFlushPending= false;
+   _FlushCnt++;
+
+   _Flushing= false;
+
+} // Flush
+/**************************************************************************************/
+void QTraceLog::DoService()
+{
+   if (_pFlushTimer->IsDone())
+      Flush();
+   else if (_UrgentFlushPending && _UrgentFlushRateLimiter.TryAcquire())
+      Flush();
+
+} // DoService
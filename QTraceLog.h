@@ -0,0 +1,109 @@
+///////////////////////////////////////////////////////////////////////////////
+// :mode=c:
+/*  QTraceLog.h                                                              */
+///////////////////////////////////////////////////////////////////////////////
+#ifndef QTraceLog_h
+#define QTraceLog_h
+#include "Arduino.h"
+#include "QTrace.h"
+#include "QTimer.h"
+#include "QFile.h"
+#include "QRateLimiter.h"
+
+#ifndef QTRACE_LOG_RING_SIZE
+#define QTRACE_LOG_RING_SIZE           1024           // RAM ring of recent trace lines, bytes
+#endif
+#ifndef QTRACE_LOG_FILE_SIZE
+#define QTRACE_LOG_FILE_SIZE           16384          // Log file is rotated beyond this size
+#endif
+
+/**************************************************************************************/
+/* QTraceLog - persistent trace log, for diagnosing resets after the fact.
+   Trace lines are streamed into a RAM ring, each prefixed with the msec time. The unwritten part
+   of the ring is appended to the log file as one block:
+      - on an Event or Error line, incl assert hits, as the urgent flush rate allows. Lines
+        refused are flushed by DoService() once the rate allows.
+      - periodically, from DoService()
+   Between flushes, the oldest unwritten lines are overwritten if the ring fills. So flash
+   writes are bounded by the flush rates, regardless of trace verbosity or an error flood.
+
+   Files:
+      /trace.log     current session
+      /trace.old     earlier part of the current session, once trace.log was rotated
+      /trace.prev    trace.log of the previous session, moved aside at construction
+
+   Usage:
+      _Trace.SetLog(new QTraceLog());
+*/
+/**************************************************************************************/
+class QTraceLog : public QTraceSink
+{
+   ///////////////////////////////////////////////////////////
+   // Data
+   ///////////////////////////////////////////////////////////
+   public:
+   static constexpr char * _pLogFileName=    "/trace.log";
+   static constexpr char * _pOldFileName=    "/trace.old";
+   static constexpr char * _pPrevFileName=   "/trace.prev";
+
+   static const uint32_t   _FlushMsecDflt=   /*min*/10 * /*sec*/60 * /*msec*/1000;
+
+   protected:
+   char                    _Ring[QTRACE_LOG_RING_SIZE];
+   uint16_t                _HeadIndex;                // Next write position
+   uint16_t                _UnflushedCnt;             // Bytes not yet written, ending at _HeadIndex
+   bool                    _Flushing;                 // Ignores traces issued while flushing
+   bool                    _InLine;                   // Between TraceBegin() and TraceEnd() of a line being kept
+   uint16_t                _LineLen;
+   bool                    _PrevAvailable;
+
+   QFile *                 _pLogFile;
+   QFile *                 _pPrevFile;
+   unsigned long           _FileSize;
+   QTimer *                _pFlushTimer;
+
+   /* Caps the flushes for Event and Error lines. An isolated error is written at once. */
+   QRateLimiter            _UrgentFlushRateLimiter;
+   bool                    _UrgentFlushPending;
+
+   /* Instrumentation. */
+   uint32_t                _FlushCnt;
+   uint32_t                _LostCnt;                  // Bytes overwritten before being flushed
+
+   ///////////////////////////////////////////////////////////
+   // Methods
+   ///////////////////////////////////////////////////////////
+   public:
+   /* Starts the session's log, moving the prior session's to /trace.prev. */
+                           QTraceLog();
+
+   /* Adds a trace line. QTrace streams each line output through the QTraceSink methods. */
+   void                    Add(const char * pLine, TraceLevelType TraceLevel);
+   virtual void            TraceBegin(TraceLevelType TraceLevel);
+   virtual void            TraceWrite(const char * pStr, int Len);
+   virtual void            TraceEnd(TraceLevelType TraceLevel);
+
+   /* Appends the unwritten part of the ring to the log file. */
+   void                    Flush();
+
+   /* Call from loop(). Flushes periodically. */
+   void                    DoService();
+   void                    SetFlushTime(unsigned long FlushMsec){_pFlushTimer->Set(FlushMsec);}
+
+   /* Max rate of flushes for Event and Error lines: Flushes per PeriodMsec, bursts of up to Burst. */
+   void                    SetUrgentFlushRate(uint16_t Flushes, uint32_t PeriodMsec, uint16_t Burst){_UrgentFlushRateLimiter.Set(Flushes, PeriodMsec, Burst);}
+
+   /* Previous session's log, if there was one. See QFile::ReadTail(). */
+   bool                    HasPrevSession(){return _PrevAvailable;}
+   int                     ReadPrevTail(char * pStrBfr, int BfrSize){return _pPrevFile->ReadTail(pStrBfr, BfrSize);}
+
+   unsigned long           GetFlushCnt(){return _FlushCnt;}
+   unsigned long           GetLostCnt(){return _LostCnt;}
+   unsigned long           GetUrgentDeferredCnt(){return _UrgentFlushRateLimiter.GetDeferredCnt();}
+
+   protected:
+   void                    Init();
+   void                    Put(const char * pStr, int Len);
+};
+
+#endif
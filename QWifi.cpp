@@ -12,6 +12,7 @@
 #include "QWifi.h"
 #include "QTrace.h"
 #include "QIndicator.h"
+#include "QProfile.h"
 
 
 #define WIFI_CONNECT_WAIT_MSEC                  (/*sec*/15/*msec*/*1000)    // How long we wait for connection to be established
@@ -50,13 +51,17 @@ void QWifi::Init()
    _pSSID= _pPassword= ""; 
 
    _pConnMgrStateTimer= new QTimer(/*Msec*/100,/*Repeat*/true,/*Start*/true);
+   _pConnMgrStateTimer->SetName("Wifi.ConnMgr");
+   _pConnMgrStateTimer->SetSlack(/*Msec*/25);
    _ConnectionState= 0;
    _pConnectionTimer= new QTimer(/*Msec*/WIFI_CONNECT_WAIT_MSEC,/*Repeat*/true,/*Start*/false);
+   _pConnectionTimer->SetName("Wifi.Connection");
  
    /* Create the retry timer, but don't start it. */
    _RetryDelaySec= WIFI_RECONNECT_RETRY_DELAY_START_SEC;
    //_pRetryTimer= new QTimer(/*Msec*/WIFI_RECONNECT_WAIT_MSEC,/*Repeat*/true,/*Start*/false);
    _pRetryTimer= new QTimer(/*Sec*/_RetryDelaySec */*Msec*/1000,/*Repeat*/true,/*Start*/false);
+   _pRetryTimer->SetName("Wifi.Retry");
    _ConnectionCount= 0;
    _ConnectionAttemptTimeouts= 0;
    _ConnectionLostTimeMsec= 0;
@@ -65,7 +70,10 @@ void QWifi::Init()
    //Serial.printf("%s\n", gWiFiStatusStrArr[WifiSts]);
 
    if (_Trace_Wifi_Status)
+   {
       _pLedStsTimer= new QTimer(/*sec*/30 */*Msec*/1000,/*Repeat*/true,/*Start*/true);
+      _pLedStsTimer->SetName("Wifi.LedSts");
+   }
    
 } // Init
 /**************************************************************************************/
@@ -113,7 +121,7 @@ bool QWifi::ConnectionFailure()
    /* Changed this to fix problems with parent sensing connected state before state machine. */
    if ((!IsConnected()) && (_ConnectionLostTimeMsec > 0))
    {  // Connection dropped, has it been a long time?
-      unsigned long ElapsedTimeMsec= /*now*/millis() - _ConnectionLostTimeMsec;
+      unsigned long ElapsedTimeMsec= /*now*/QTimestamp::GetNowTimeMsec() - _ConnectionLostTimeMsec;
       unsigned long MaxElapsedTimeMsec= WIFI_CONNECTION_FAILED_TIME_SEC * /*msec*/1000;
       if (ElapsedTimeMsec > MaxElapsedTimeMsec)
          Result= true;
@@ -148,6 +156,8 @@ void QWifi::ConnectionMgr()
      of the odd problems with wifi state and how best to set this up.
 */
 {
+   QPROFILE_SCOPE("Wifi.ConnectionMgr");
+
    if (_pConnMgrStateTimer->IsDone())
    {
       switch (_ConnectionState)
@@ -177,16 +187,16 @@ void QWifi::ConnectionMgr()
                _ConnectionLostTimeMsec= 0;
                if (_Trace_Wifi_Status)
                {
-                  unsigned long ConnectTimeMsec= millis() - _ConnectStartTimeMsec;
+                  unsigned long ConnectTimeMsec= QTimestamp::GetNowTimeMsec() - _ConnectStartTimeMsec;
                   // IPAddress type print is pita. See https://forum.arduino.cc/index.php?topic=228884.msg3102705#msg3102705
-                  _Trace.printf(TRACE_SWITCH_WIFI, TLT_Verbose, "QWifi::ConnectionMgr(): Connected in %lu msec, IP:%s", ConnectTimeMsec, WiFi.localIP().toString().c_str());
+                  QTRACE(TRACE_SWITCH_WIFI, TLT_Verbose, "QWifi::ConnectionMgr(): Connected in %lu msec, IP:%s", ConnectTimeMsec, WiFi.localIP().toString().c_str());
                }
             }
             else if (_pConnectionTimer->IsDone())
             {  // Connection timer timed out.
                _ConnectionState= WFS_CONNECTION_TIMEOUT;          // Connect() failed
                if (_Trace_Wifi_Status)
-                  _Trace.printf(TRACE_SWITCH_WIFI, TLT_Verbose, "QWifi::ConnectionMgr(): timeout, Sts:%s", gWiFiStatusStrArr[WifiSts]);
+                  QTRACE(TRACE_SWITCH_WIFI, TLT_Verbose, "QWifi::ConnectionMgr(): timeout, Sts:%s", gWiFiStatusStrArr[WifiSts]);
             }
             // else - waiting, no timeout yet
 
@@ -203,18 +213,18 @@ void QWifi::ConnectionMgr()
             {  /* Lost connection - just attempt to connect again. If it times out, it will get more aggressive
                   and fall into the WFS_CONNECTION_TIMEOUT state. */
                _ConnectionState= WFS_SETUP;
-               _ConnectionLostTimeMsec= millis();
+               _ConnectionLostTimeMsec= QTimestamp::GetNowTimeMsec();
                if (_Trace_Wifi_Status)
-                  _Trace.printf(TRACE_SWITCH_WIFI, TLT_Verbose, "QWifi::ConnectionMgr(): lost connection, Sts:%s", gWiFiStatusStrArr[WifiSts]);
+                  QTRACE(TRACE_SWITCH_WIFI, TLT_Verbose, "QWifi::ConnectionMgr(): lost connection, Sts:%s", gWiFiStatusStrArr[WifiSts]);
             }
             #else
             if (WifiSts != WL_CONNECTED)
             {  /* Lost connection - just attempt to connect again. If it times out, it will get more aggressive
                   and fall into the WFS_CONNECTION_TIMEOUT state. */
                _ConnectionState= WFS_SETUP;
-               _ConnectionLostTimeMsec= millis();
+               _ConnectionLostTimeMsec= QTimestamp::GetNowTimeMsec();
                if (_Trace_Wifi_Status)
-                  _Trace.printf(TRACE_SWITCH_WIFI, TLT_Verbose, "QWifi::ConnectionMgr(): lost connection, Sts:%s", gWiFiStatusStrArr[WifiSts]);
+                  QTRACE(TRACE_SWITCH_WIFI, TLT_Verbose, "QWifi::ConnectionMgr(): lost connection, Sts:%s", gWiFiStatusStrArr[WifiSts]);
             }
             #endif
             break;
@@ -241,7 +251,7 @@ void QWifi::ConnectionMgr()
                delay(/*msec*/1);
                _ConnectionState= WFS_SETUP;
                if (_Trace_Wifi_Status)
-                  _Trace.printf(TRACE_SWITCH_WIFI, TLT_Verbose, "QWifi::ConnectionMgr(): begin retry, Sts:%s", gWiFiStatusStrArr[WiFi.status()]);
+                  QTRACE(TRACE_SWITCH_WIFI, TLT_Verbose, "QWifi::ConnectionMgr(): begin retry, Sts:%s", gWiFiStatusStrArr[WiFi.status()]);
             }
             // else - keep waiting
  
@@ -272,7 +282,7 @@ void QWifi::Setup()
    {
       WifiSts= WiFi.status();
       //Serial.printf("QWifi::Setup(): Wifi connection status: %s\n", gWiFiStatusStrArr[WifiSts] );
-      _Trace.printf(TRACE_SWITCH_WIFI, TLT_Verbose, "QWifi::Setup(): Setup done, connection status: %s", gWiFiStatusStrArr[WifiSts]);
+      QTRACE(TRACE_SWITCH_WIFI, TLT_Verbose, "QWifi::Setup(): Setup done, connection status: %s", gWiFiStatusStrArr[WifiSts]);
    }
      
 } // Setup
@@ -312,7 +322,7 @@ int QWifi::Connect()
 
 
    */
-   _ConnectStartTimeMsec= millis();
+   _ConnectStartTimeMsec= QTimestamp::GetNowTimeMsec();
   
    return WifiSts;
    